@@ -6,12 +6,21 @@
 #include <io.h>
 #else
 #include <unistd.h>
+#include <signal.h>
+#include <glob.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#endif
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/mman.h>
 #endif
 
 #include <algorithm>
 #include <functional>
 #include <vector>
+#include <thread>
 #include <chrono>
 #include <stdio.h>
 #include <fcntl.h>
@@ -120,6 +129,54 @@ void DeleteLogFile()
 	ASSERT(false && "Unable to delete log file");
 }
 
+std::string ReadFile(const std::string& path)
+{
+	std::string s;
+	FILE*       f = fopen(path.c_str(), "rb");
+	if (!f)
+		return s;
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) != 0)
+		s.append(buf, n);
+	fclose(f);
+	return s;
+}
+
+// Returns the archives of TestLog, oldest first
+std::vector<std::string> FindArchives()
+{
+	std::vector<std::string> archives;
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	HANDLE           fh = FindFirstFileA("utest-*", &fd);
+	if (fh != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			archives.push_back(fd.cFileName);
+		} while (!!FindNextFileA(fh, &fd));
+		FindClose(fh);
+	}
+#else
+	glob_t pglob;
+	if (glob("utest-*", 0, nullptr, &pglob) == 0)
+	{
+		for (size_t i = 0; i < pglob.gl_pathc; i++)
+			archives.push_back(pglob.gl_pathv[i]);
+		globfree(&pglob);
+	}
+#endif
+	std::sort(archives.begin(), archives.end());
+	return archives;
+}
+
+void DeleteArchives()
+{
+	for (const auto& a : FindArchives())
+		remove(a.c_str());
+}
+
 std::string MakeMsg(int len, int seed = 0)
 {
 	std::string x;
@@ -141,13 +198,16 @@ std::string MakeMsg(int len, int seed = 0)
 struct LogOpenCloser
 {
 	uberlog::Logger Log;
-	LogOpenCloser(size_t ringSize = 0, size_t rollingSize = 0)
+	LogOpenCloser(size_t ringSize = 0, size_t rollingSize = 0, bool deferred = false, uint32_t writeQueueDepth = 1, bool deferredPrefix = false)
 	{
 		DeleteLogFile();
 		if (ringSize != 0)
 			Log.SetRingBufferSize(ringSize);
 		if (rollingSize != 0)
 			Log.SetArchiveSettings(rollingSize, 3);
+		Log.SetDeferredFormatting(deferred);
+		Log.SetDeferredPrefix(deferredPrefix);
+		Log.SetWriteQueueDepth(writeQueueDepth);
 		Log.Open(TestLog);
 	}
 	~LogOpenCloser()
@@ -164,8 +224,21 @@ class TestHelper
 public:
 	static void SetPrefix(uberlog::Logger& log, const char* prefix)
 	{
-		ASSERT(strlen(prefix) == 42);
-		memcpy(log._Test_OverridePrefix, prefix, 42);
+		size_t len = strlen(prefix);
+		ASSERT(len == log.PrefixLen(log.IncludeDate) && len <= sizeof(log._Test_OverridePrefix));
+		memcpy(log._Test_OverridePrefix, prefix, len);
+	}
+
+#ifndef _WIN32
+	static void PauseLoggerSlave(uberlog::Logger& log, bool pause)
+	{
+		kill(log.ChildPID, pause ? SIGSTOP : SIGCONT);
+	}
+#endif
+
+	static const SharedStats& Stats(uberlog::Logger& log)
+	{
+		return log.Control->Stats;
 	}
 };
 } // namespace internal
@@ -188,6 +261,43 @@ void TestProcessLifecycle()
 	}
 }
 
+#ifndef _WIN32
+// The logger slave must exit cleanly when its parent is gone before the slave could open the shared memory,
+// whatever its sync policy
+void TestSlaveWithoutSharedMemory()
+{
+	printf("Slave without shared memory\n");
+	// A child that we have reaped leaves behind a PID that belongs to nobody
+	pid_t dead = fork();
+	if (dead == 0)
+		_exit(0);
+	ASSERT(waitpid(dead, nullptr, 0) == dead);
+
+	std::string exe    = GetMyExePath();
+	std::string path   = exe.substr(0, exe.rfind('/') + 1) + "uberlogger";
+	std::string parent = uberlog_tsf::fmt("%v", dead);
+	for (int sync = 0; sync <= (int) uberlog::SyncPolicy::OnWarn; sync++)
+	{
+		std::string policy = uberlog_tsf::fmt("%v", sync);
+		const char* argv[] = {path.c_str(), parent.c_str(), "65536", TestLog, "1000000", "3", "65536", "1", "0", "0", "0", policy.c_str(), nullptr};
+		pid_t       slave  = fork();
+		if (slave == 0)
+		{
+			// Hide the slave's complaint about the missing shared memory
+			int devnull = open("/dev/null", O_WRONLY);
+			dup2(devnull, 1);
+			dup2(devnull, 2);
+			execv(path.c_str(), (char* const*) argv);
+			_exit(127);
+		}
+		int status = 0;
+		ASSERT(waitpid(slave, &status, 0) == slave);
+		ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+	DeleteLogFile();
+}
+#endif
+
 void TestFormattedWrite()
 {
 	printf("Formatted Write\n");
@@ -203,15 +313,15 @@ void TestFormattedWrite()
 	LogFileEquals(expect.c_str());
 }
 
-void TestRingBuffer()
+void TestRingBuffer(uint32_t writeQueueDepth)
 {
-	printf("Ring Buffer\n");
-	// Test two sizes of ring buffer. One that's smaller than LoggerSlaveWriteBufferSize, and one that's larger.
+	printf("Ring Buffer (write queue depth %u)\n", writeQueueDepth);
+	// Test two sizes of ring buffer. One that's smaller than the logger slave's write buffer, and one that's larger.
 	// We must write chunks that are larger than the buffer, so that we stress that code path.
 	// Bear in mind that we don't support writing log messages that are larger than our ring buffer, so we
 	// make no attempt to test that.
 
-	static_assert(LoggerSlaveWriteBufferSize == 1024, "Alter ring sizes for test");
+	const size_t     writeBufSize         = 1024;
 	static const int nringSize            = 2;
 	const size_t     ringSizes[nringSize] = {512, 8192};
 
@@ -219,12 +329,14 @@ void TestRingBuffer()
 
 	for (int iRing = 0; iRing < nringSize; iRing++)
 	{
-		// important that we have at least one write size (5297) that is greater than LoggerSlaveWriteBufferSize
+		// important that we have at least one write size (5297) that is greater than writeBufSize
 		const int    nsizes        = 8;
 		const size_t sizes[nsizes] = {1, 2, 3, 59, 113, 307, 709, 5297};
 		ASSERT(sizes[nsizes - 1] < ringSizes[nringSize - 1]); // Our 'big' write size must be smaller than our 'big' ring buffer size.
 		uberlog::Logger log;
 		log.SetRingBufferSize(ringSizes[iRing]);
+		log.SetWriteBufferSize(writeBufSize);
+		log.SetWriteQueueDepth(writeQueueDepth);
 		log.Open(TestLog);
 		std::string expect;
 		int         isize = 0;
@@ -243,6 +355,897 @@ void TestRingBuffer()
 	}
 }
 
+void TestRollover()
+{
+	printf("Rollover\n");
+	DeleteLogFile();
+	DeleteArchives();
+
+	// Keep every archive, so that we can check that nothing went missing or out of order across rollovers
+	std::string expect;
+	{
+		uberlog::Logger log;
+		log.SetRingBufferSize(64 * 1024);
+		log.SetArchiveSettings(4096, 1000);
+		log.Open(TestLog);
+		for (int i = 0; i < 20000; i++)
+		{
+			auto msg = uberlog_tsf::fmt("msg %v\n", i);
+			log.LogRaw(msg.c_str(), msg.size());
+			expect += msg;
+		}
+		log.Close();
+	}
+	auto        archives = FindArchives();
+	std::string actual;
+	for (const auto& a : archives)
+	{
+		// Files are cut at line boundaries, and never grow beyond their maximum size
+		auto content = ReadFile(a);
+		ASSERT(content.size() <= 4096 && content.back() == '\n');
+		actual += content;
+	}
+	actual += ReadFile(TestLog);
+	ASSERT(archives.size() > 10);
+	ASSERT(actual == expect);
+	ASSERT(!FileExists("utest.log.next"));
+
+	// Old archives are deleted
+	{
+		uberlog::Logger log;
+		log.SetArchiveSettings(4096, 3);
+		log.Open(TestLog);
+		for (int i = 0; i < 20000; i++)
+			log.LogRaw("0123456789\n", 11);
+		log.Close();
+	}
+	ASSERT(FindArchives().size() == 3);
+
+	// Retention by total size
+	{
+		uberlog::Logger log;
+		log.SetArchiveSettings(4096, 1000, 5 * 4096);
+		log.Open(TestLog);
+		for (int i = 0; i < 20000; i++)
+			log.LogRaw("0123456789\n", 11);
+		log.Close();
+	}
+	size_t totalSize = 0;
+	for (const auto& a : FindArchives())
+		totalSize += ReadFile(a).size();
+	ASSERT(FindArchives().size() >= 4 && totalSize <= 5 * 4096);
+
+	// Retention by age. Archives expire even when there is no rollover.
+	{
+		uberlog::Logger log;
+		log.SetArchiveSettings(4096, 1000, 0, 1);
+		log.Open(TestLog);
+		for (int i = 0; i < 2000; i++)
+			log.LogRaw("0123456789\n", 11);
+		std::this_thread::sleep_for(std::chrono::milliseconds(2500));
+		ASSERT(FindArchives().size() == 0);
+		log.Close();
+	}
+
+#ifndef _WIN32
+	// We died during a rollover, after archiving the old file, but before the next file was renamed into place
+	DeleteArchives();
+	DeleteLogFile();
+	FILE* f = fopen("utest.log.next", "wb");
+	ASSERT(f != nullptr);
+	fputs("before the crash\n", f);
+	fclose(f);
+	{
+		uberlog::Logger log;
+		log.SetArchiveSettings(4096, 1000);
+		log.Open(TestLog);
+		log.LogRaw("after the crash\n", 16);
+		log.Close();
+	}
+	ASSERT(ReadFile(TestLog) == "before the crash\nafter the crash\n");
+	ASSERT(FindArchives().size() == 0);
+	ASSERT(!FileExists("utest.log.next"));
+#endif
+	DeleteArchives();
+	DeleteLogFile();
+}
+
+void TestPreallocate()
+{
+	printf("Preallocate\n");
+	DeleteLogFile();
+	const int64_t maxSize = 1024 * 1024;
+	std::string   expect;
+	{
+		uberlog::Logger log;
+		log.SetArchiveSettings(maxSize, 3);
+		log.SetPreallocate(true);
+		log.Open(TestLog);
+		for (int i = 0; i < 100; i++)
+		{
+			auto msg = MakeMsg(100, i);
+			log.LogRaw(msg.c_str(), msg.size());
+			expect += msg;
+		}
+#ifdef __linux__
+		// The file size only covers what has been written, but the blocks behind it have been allocated up front
+		struct stat st;
+		for (int i = 0; i < 200 && (stat(TestLog, &st) != 0 || (size_t) st.st_size != expect.size()); i++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		ASSERT((size_t) st.st_size == expect.size());
+		ASSERT(st.st_blocks * 512 >= maxSize);
+#endif
+		log.Close();
+	}
+	LogFileEquals(expect.c_str());
+#ifdef __linux__
+	// Unused space is given back when the file is closed
+	struct stat st;
+	ASSERT(stat(TestLog, &st) == 0 && st.st_blocks * 512 < 64 * 1024);
+#endif
+	DeleteLogFile();
+}
+
+// Syncing must not change what ends up in the log
+void TestSyncPolicy(uberlog::SyncPolicy policy, const char* name, uint32_t writeQueueDepth)
+{
+	printf("Sync policy %s, queue depth %u\n", name, writeQueueDepth);
+	DeleteLogFile();
+	int nwarn = 0;
+	{
+		uberlog::Logger log;
+		log.SetSyncPolicy(policy, 5, 64 * 1024);
+		log.SetWriteQueueDepth(writeQueueDepth);
+		log.SetDeferredFormatting(true);
+		log.Open(TestLog);
+		for (int i = 0; i < 5000; i++)
+		{
+			if (i % 500 == 0)
+			{
+				log.Warn("warning %v", i);
+				nwarn++;
+			}
+			else
+			{
+				log.Info("message %v", i);
+			}
+			if (i % 1000 == 0)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		log.Close();
+	}
+	auto   content = ReadFile(TestLog);
+	int    lines   = 0;
+	int    warns   = 0;
+	size_t pos     = 0;
+	for (size_t eol = content.find('\n'); eol != std::string::npos; pos = eol + 1, eol = content.find('\n', pos))
+	{
+		std::string line = content.substr(pos, eol - pos);
+		ASSERT(line.find(lines % 500 == 0 ? " [W] " : " [I] ") != std::string::npos);
+		ASSERT(line.find(uberlog_tsf::fmt(lines % 500 == 0 ? "warning %v" : "message %v", lines)) != std::string::npos);
+		warns += line.find(" [W] ") != std::string::npos ? 1 : 0;
+		lines++;
+	}
+	ASSERT(lines == 5000 && warns == nwarn);
+	DeleteLogFile();
+}
+
+// The reader's cached write pointer may fall behind its read cursor, when it skips a Pad record
+void TestRingCursor()
+{
+	printf("Ring cursor\n");
+	const size_t         ringSize = 512;
+	std::vector<uint8_t> mem(ringSize + RingBuffer::HeadSize + RingBuffer::CacheLineSize);
+	uint8_t*             buf = (uint8_t*) (((uintptr_t) &mem[0] + RingBuffer::CacheLineSize - 1) & ~(uintptr_t)(RingBuffer::CacheLineSize - 1));
+	RingBuffer           ring;
+	ring.Init(buf, ringSize, true);
+	size_t pos;
+	ASSERT(ring.Reserve(16, pos));
+	ASSERT(ring.CanRead(8));
+	ASSERT(ring.Reserve(ringSize - 16, pos));
+	ring.Hold(256);
+	ASSERT(ring.CanRead(ringSize - 256));
+	ASSERT(!ring.CanRead(ringSize - 256 + 1));
+}
+
+void TestReserveCommit()
+{
+	printf("Reserve/Commit\n");
+	// Use a small ring, so that reservations frequently run into the end of it, and must skip to the start
+	DeleteLogFile();
+	uberlog::Logger log;
+	log.SetRingBufferSize(512);
+	log.Open(TestLog);
+	std::string expect;
+	for (int i = 0; i < 1000; i++)
+	{
+		auto                 msg = MakeMsg(i % 300, i);
+		uberlog::Reservation r;
+		ASSERT(log.Reserve(msg.length() + 50, r));
+		ASSERT(r.Size() == msg.length() + 50);
+		r.Write(0, msg.c_str(), msg.length());
+		if (i % 7 == 0)
+		{
+			// abandon
+			log.Commit(r, 0);
+			continue;
+		}
+		log.Commit(r, msg.length());
+		expect += msg;
+	}
+
+	// Formatted messages, which are formatted straight into the ring
+	for (int size = 0; size <= 400; size++)
+	{
+		TestHelper::SetPrefix(log, TestLogPrefix);
+		log.Warn("%v", MakeMsg(size, size));
+		expect += TestLogPrefix + MakeMsg(size, size) + EOL;
+	}
+	log.Close();
+	LogFileEquals(expect.c_str());
+	DeleteLogFile();
+}
+
+void TestDeferredFormatting()
+{
+	printf("Deferred Formatting\n");
+	// Use a small ring, so that messages wrap around the end of it
+	DeleteLogFile();
+	uberlog::Logger log;
+	log.SetRingBufferSize(4096);
+	log.SetDeferredFormatting(true);
+	log.Open(TestLog);
+	TestHelper::SetPrefix(log, TestLogPrefix);
+	std::string expect;
+	const char* nullStr = nullptr;
+	for (int i = 0; i < 300; i++)
+	{
+		auto msg = MakeMsg(i, i);
+		log.Info("%v|%d|%x|%v|%v|%v|%.3f|%v|%c", msg, -i, i * 1000, (int64_t) i << 40, (uint64_t) 1 << 63, 1.5 * i, 0.25 * i, "lit", 'a' + i % 26);
+		expect += TestLogPrefix + uberlog_tsf::fmt("%v|%d|%x|%v|%v|%v|%.3f|%v|%c", msg, -i, i * 1000, (int64_t) i << 40, (uint64_t) 1 << 63, 1.5 * i, 0.25 * i, "lit", 'a' + i % 26) + EOL;
+	}
+	log.Info("no args");
+	expect += TestLogPrefix + std::string("no args") + EOL;
+	log.Info("null %v", nullStr);
+	expect += TestLogPrefix + std::string("null (null)") + EOL;
+
+	// The same pointer, but with different contents
+	char fmtbuf[20];
+	strcpy(fmtbuf, "first %v");
+	log.Info(fmtbuf, 1);
+	strcpy(fmtbuf, "second %v");
+	log.Info(fmtbuf, 2);
+	expect += TestLogPrefix + std::string("first 1") + EOL;
+	expect += TestLogPrefix + std::string("second 2") + EOL;
+
+	// A message that is larger than the logger slave's write buffer
+	auto big = MakeMsg(3000, 7);
+	log.Info("big %v", big);
+	expect += TestLogPrefix + std::string("big ") + big + EOL;
+
+	log.Close();
+	LogFileEquals(expect.c_str());
+	DeleteLogFile();
+}
+
+std::string ReadLogFile()
+{
+	FILE* f = fopen(TestLog, "rb");
+	ASSERT(f != nullptr);
+	std::string all;
+	char        buf[4096];
+	size_t      n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) != 0)
+		all.append(buf, n);
+	fclose(f);
+	return all;
+}
+
+// The logger slave renders the line prefixes, which must come out the same as if the producer had written them
+void TestDeferredPrefix(bool deferredFormatting)
+{
+	printf("Deferred Prefix (%s)\n", deferredFormatting ? "deferred formatting" : "immediate formatting");
+	DeleteLogFile();
+	uberlog::Logger log;
+	log.SetRingBufferSize(4096);
+	log.SetDeferredPrefix(true);
+	log.SetDeferredFormatting(deferredFormatting);
+	log.Open(TestLog);
+
+	// The logger slave renders the time stamps, so we can only check that they fall between before and after.
+	// Everything else must be exactly what the caller would have written.
+	TimeKeeper  tk;
+	char        before[TimeKeeper::MaxLen + 1] = {0};
+	char        after[TimeKeeper::MaxLen + 1]  = {0};
+	std::string noDate(tk.Len(), '#');
+	std::string tid(GetMyTIDHex(), 8);
+	std::string expect;
+	tk.Format(before);
+	for (int i = 0; i < 300; i++)
+	{
+		std::string msg(i, 'a' + i % 26); // No newlines, so that we can find the start of every line
+		log.IncludeDate = i % 10 != 9;
+		if (i % 3 == 0)
+			log.Warn("%v|%d|%.3f", msg, i, 0.25 * i);
+		else
+			log.Info("%v|%d|%.3f", msg, i, 0.25 * i);
+		expect += (log.IncludeDate ? noDate + " " : std::string()) + (i % 3 == 0 ? "[W] " : "[I] ") + tid + " " + uberlog_tsf::fmt("%v|%d|%.3f", msg, i, 0.25 * i) + EOL;
+	}
+	log.IncludeDate = true;
+	std::string big(3000, 'b');
+	log.Info("big %v", big);
+	expect += noDate + " [I] " + tid + " big " + big + EOL;
+	log.Close();
+	tk.Format(after);
+
+	std::string actual = ReadLogFile();
+	for (size_t pos = 0; pos < actual.size();)
+	{
+		size_t eol = actual.find('\n', pos);
+		ASSERT(eol != std::string::npos);
+		if (actual[pos] != '[')
+		{
+			std::string stamp = actual.substr(pos, tk.Len());
+			ASSERT(stamp >= before && stamp <= after);
+			actual.replace(pos, tk.Len(), noDate);
+		}
+		pos = eol + 1;
+	}
+	ASSERT(actual == expect);
+	DeleteLogFile();
+}
+
+void TestWakeLatency()
+{
+	if (!uberlog::internal::HaveSharedFutex)
+		return;
+	printf("Wake Latency\n");
+	// After the logger slave has been idle for a while, a new message must still reach the log file promptly.
+	// Before we had a futex, the logger slave would be sleeping for up to 1024 ms at this point.
+	LogOpenCloser oc;
+	std::string   msg1 = MakeMsg(50, 1);
+	std::string   msg2 = MakeMsg(50, 2);
+	oc.Log.LogRaw(msg1.c_str(), msg1.length());
+	SleepMS(600);
+	double start = AccurateTimeSeconds();
+	oc.Log.LogRaw(msg2.c_str(), msg2.length());
+	while (ReadLogFile() != msg1 + msg2)
+	{
+		ASSERT(AccurateTimeSeconds() - start < 0.1);
+		SleepMS(1);
+	}
+}
+
+void TestTryReserve()
+{
+	printf("TryReserve\n");
+	LogOpenCloser oc(4096);
+	std::string   expect;
+	auto          msg = MakeMsg(200, 3);
+
+	// Fill the ring until TryReserve fails. The logger slave is draining it at the same time, so this may take a while.
+	uberlog::Reservation r;
+	int                  nfull = 0;
+	for (int i = 0; nfull < 10 && i < 1000000; i++)
+	{
+		if (!oc.Log.TryReserve(msg.length(), r))
+		{
+			nfull++;
+#ifdef __linux__
+			// The logger slave must tell us when there is space again
+			pollfd pfd = {oc.Log.SpaceEventFD(), POLLIN, 0};
+			ASSERT(pfd.fd != -1);
+			ASSERT(poll(&pfd, 1, 5000) == 1);
+			uint64_t count = 0;
+			ASSERT(read(pfd.fd, &count, sizeof(count)) == sizeof(count));
+#endif
+			continue;
+		}
+		r.Write(0, msg.c_str(), msg.length());
+		oc.Log.Commit(r, msg.length());
+		expect += msg;
+	}
+	ASSERT(nfull == 10);
+	oc.Log.Close();
+	LogFileEquals(expect.c_str());
+}
+
+// The report of dropped messages must leave out the date, like the messages around it
+void TestDroppedWithoutDate(bool deferredPrefix)
+{
+#ifndef _WIN32
+	printf("Dropped messages without date (deferred prefix %s)\n", deferredPrefix ? "on" : "off");
+	DeleteLogFile();
+	{
+		uberlog::Logger log;
+		log.SetRingBufferSize(4096);
+		log.SetOverflowPolicy(uberlog::OverflowPolicy::Drop);
+		log.SetDeferredPrefix(deferredPrefix);
+		log.IncludeDate = false;
+		log.Open(TestLog);
+		log.Info("first");
+		TestHelper::PauseLoggerSlave(log, true);
+		std::thread resume([&log]() {
+			SleepMS(300);
+			TestHelper::PauseLoggerSlave(log, false);
+		});
+		for (int i = 0; i < 2000; i++)
+			log.Info("msg %v", i);
+		resume.join();
+		log.Close();
+	}
+
+	// The report has the same dateless prefix as our own lines, with the logger slave's thread ID: "[W] xxxxxxxx uberlog: "
+	std::string all     = ReadLogFile();
+	int         reports = 0;
+	for (size_t pos = 0, eol = all.find('\n'); eol != std::string::npos; pos = eol + 1, eol = all.find('\n', pos))
+	{
+		ASSERT(all[pos] == '[');
+		reports += all.compare(pos, 4, "[W] ") == 0 && all.compare(pos + 13, 9, "uberlog: ") == 0 ? 1 : 0;
+	}
+	ASSERT(reports != 0);
+	DeleteLogFile();
+#endif
+}
+
+void TestOverflowPolicy(uberlog::OverflowPolicy policy, const char* name)
+{
+#ifndef _WIN32
+	printf("Overflow Policy (%s)\n", name);
+	DeleteLogFile();
+	uberlog::Logger log;
+	log.SetRingBufferSize(4096);
+	log.SetOverflowPolicy(policy);
+	log.Open(TestLog);
+	TestHelper::SetPrefix(log, TestLogPrefix);
+
+	// Stop the logger slave for a while, so that the ring fills up
+	const int nmsg = 2000;
+	TestHelper::PauseLoggerSlave(log, true);
+	std::thread resume([&log]() {
+		SleepMS(300);
+		TestHelper::PauseLoggerSlave(log, false);
+	});
+	for (int i = 0; i < nmsg; i++)
+	{
+		// Only Info in the first half, so that the ring is sure to fill up with something that can be dropped
+		if (i >= nmsg / 2 && i % 10 == 0)
+			log.Warn("msg %v W", i);
+		else
+			log.Info("msg %v I", i);
+	}
+	resume.join();
+	log.Close();
+
+	// Every message must either be in the log, in order, or be counted as dropped
+	std::string all       = ReadLogFile();
+	int         delivered = 0;
+	int         dropped   = 0;
+	int         warns     = 0;
+	int         last      = -1;
+	for (size_t pos = 0; pos < all.size();)
+	{
+		size_t eol  = all.find('\n', pos);
+		auto   line = all.substr(pos, eol - pos);
+		pos         = eol + 1;
+		int    n    = 0;
+		char   level;
+		if (sscanf(line.c_str() + 42, "msg %d %c", &n, &level) == 2)
+		{
+			ASSERT(n > last);
+			last = n;
+			delivered++;
+			warns += level == 'W' ? 1 : 0;
+		}
+		else
+		{
+			ASSERT(sscanf(line.c_str() + 42, "uberlog: %d messages dropped", &n) == 1);
+			dropped += n;
+		}
+	}
+	ASSERT(delivered + dropped == nmsg);
+	if (policy == uberlog::OverflowPolicy::DropBelowWarn)
+		ASSERT(warns == nmsg / 20);
+	if (policy == uberlog::OverflowPolicy::Spill)
+		ASSERT(dropped == 0);
+	else
+		ASSERT(dropped > 0);
+	DeleteLogFile();
+#endif
+}
+
+// Many threads writing concurrently. We can't predict the interleaving, but every
+// message must arrive intact, and each thread's messages must be in order.
+void TestConcurrentProducers(uberlog::ProducerMode mode)
+{
+	const char* modeName = mode == uberlog::ProducerMode::LockFree ? "lock free" : (mode == uberlog::ProducerMode::PerThread ? "per thread" : "locked");
+	printf("Concurrent Producers (%s)\n", modeName);
+	const int nthread = 8;
+	const int nmsg    = 5000;
+
+	DeleteLogFile();
+	{
+		uberlog::Logger log;
+		log.SetProducerMode(mode);
+		log.SetRingBufferSize(4096); // small, so that we exercise the full-ring path and wrapping
+		log.Open(TestLog);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < nthread; t++)
+		{
+			threads.push_back(std::thread([&log, t]() {
+				for (int i = 0; i < nmsg; i++)
+				{
+					auto msg = uberlog_tsf::fmt("thread %v message %v %v\n", t, i, MakeMsg(i % 97, i));
+					log.LogRaw(msg.c_str(), msg.length());
+				}
+			}));
+		}
+		for (auto& th : threads)
+			th.join();
+		log.Close();
+	}
+
+	std::string all = ReadLogFile();
+	int         next[nthread] = {0};
+	size_t      pos           = 0;
+	while (pos < all.size())
+	{
+		int t = -1, i = -1;
+		ASSERT(sscanf(all.c_str() + pos, "thread %d message %d ", &t, &i) == 2);
+		ASSERT(t >= 0 && t < nthread);
+		ASSERT(i == next[t]);
+		auto expect = uberlog_tsf::fmt("thread %v message %v %v\n", t, i, MakeMsg(i % 97, i));
+		ASSERT(all.compare(pos, expect.size(), expect) == 0);
+		pos += expect.size();
+		next[t]++;
+	}
+	for (int t = 0; t < nthread; t++)
+		ASSERT(next[t] == nmsg);
+	DeleteLogFile();
+}
+
+// Close must wait for threads that are in the middle of writing a message, and turn away the rest
+void TestCloseWhileLogging(uberlog::ProducerMode mode)
+{
+	const char* modeName = mode == uberlog::ProducerMode::LockFree ? "lock free" : (mode == uberlog::ProducerMode::PerThread ? "per thread" : "locked");
+	printf("Close while logging (%s)\n", modeName);
+	const char   line[] = "logging during close\n";
+	const size_t len    = sizeof(line) - 1;
+	for (int run = 0; run < 20; run++)
+	{
+		DeleteLogFile();
+		uberlog::Logger log;
+		log.SetProducerMode(mode);
+		log.SetRingBufferSize(4096);
+		log.Open(TestLog);
+		std::atomic<int>         started(0);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; t++)
+		{
+			threads.push_back(std::thread([&]() {
+				started++;
+				uberlog::Reservation r;
+				while (log.Reserve(len, r))
+				{
+					r.Write(0, line, len);
+					log.Commit(r, len);
+				}
+			}));
+		}
+		while (started != 4)
+			SleepMS(0);
+		SleepMS(run % 3);
+		log.Close();
+		for (auto& t : threads)
+			t.join();
+		uberlog::Reservation after;
+		ASSERT(!log.Reserve(len, after));
+
+		// Every message that made it in is whole
+		std::string all = ReadLogFile();
+		ASSERT(all.size() % len == 0);
+		for (size_t pos = 0; pos < all.size(); pos += len)
+			ASSERT(all.compare(pos, len, line) == 0);
+	}
+	DeleteLogFile();
+}
+
+// Once Flush returns, a thread's message must be in the log file
+void TestFlush(uberlog::ProducerMode mode, uint32_t writeQueueDepth)
+{
+	const char* modeName = mode == uberlog::ProducerMode::LockFree ? "lock free" : (mode == uberlog::ProducerMode::PerThread ? "per thread" : "locked");
+	printf("Flush (%s, queue depth %u)\n", modeName, writeQueueDepth);
+	const int nthread = 4;
+	const int nmsg    = 200;
+
+	DeleteLogFile();
+	uberlog::Logger log;
+	log.SetProducerMode(mode);
+	log.SetWriteQueueDepth(writeQueueDepth);
+	log.SetSyncPolicy(uberlog::SyncPolicy::OnWarn);
+	log.Open(TestLog);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < nthread; t++)
+	{
+		threads.push_back(std::thread([&log, t]() {
+			for (int i = 0; i < nmsg; i++)
+			{
+				auto msg = uberlog_tsf::fmt("thread %v message %v\n", t, i);
+				log.LogRaw(msg.c_str(), msg.length());
+				if (i % 20 == 0)
+				{
+					ASSERT(log.Flush());
+					ASSERT(ReadLogFile().find(msg) != std::string::npos);
+				}
+			}
+		}));
+	}
+	for (auto& th : threads)
+		th.join();
+
+	// Only a Warn causes a sync
+	uint64_t seq = log.Sequence();
+	ASSERT(log.WaitFor(seq));
+	ASSERT(!log.WaitFor(seq, 50, true));
+	log.Warn("synced");
+	ASSERT(log.Flush(10000, true));
+	ASSERT(log.Sequence() == seq + 1);
+
+	// Every message has been written, so the writer must have counted at least that many bytes
+	const SharedStats& stats = TestHelper::Stats(log);
+	ASSERT(stats.Writes.load() != 0);
+	ASSERT(stats.BytesWritten.load() >= ReadLogFile().size());
+	ASSERT(stats.MaxBacklog.load() != 0);
+
+#ifndef _WIN32
+	// Time out while the logger slave can't make progress
+	TestHelper::PauseLoggerSlave(log, true);
+	log.LogRaw("paused\n", 7);
+	ASSERT(!log.Flush(50));
+	TestHelper::PauseLoggerSlave(log, false);
+	ASSERT(log.Flush());
+#endif
+	log.Close();
+	DeleteLogFile();
+}
+
+#ifdef __linux__
+// When io_uring refuses a write, the writes that are already in flight must still complete, before the
+// logger slave falls back to synchronous writes
+void TestSubmitFailure()
+{
+	printf("io_uring submit failure\n");
+	const int nmsg = 3000;
+
+	DeleteLogFile();
+	// The slave fails its third submission. By then, the first two should still be in flight.
+	setenv("UBERLOG_TEST_FAIL_SUBMIT", "3", 1);
+	{
+		uberlog::Logger log;
+		log.SetWriteQueueDepth(4);
+		log.SetWriteBufferSize(1024);
+		log.Open(TestLog);
+		unsetenv("UBERLOG_TEST_FAIL_SUBMIT");
+		// The first message waits for the slave to start. After that, let the messages pile up, so that the
+		// slave fills all of its swap buffers at once.
+		log.Info("message %v", 0);
+		TestHelper::PauseLoggerSlave(log, true);
+		for (int i = 1; i < nmsg; i++)
+			log.Info("message %v", i);
+		TestHelper::PauseLoggerSlave(log, false);
+		ASSERT(log.Flush());
+		log.Close();
+	}
+
+	std::string all   = ReadLogFile();
+	int         lines = 0;
+	size_t      pos   = 0;
+	for (size_t eol = all.find('\n'); eol != std::string::npos; pos = eol + 1, eol = all.find('\n', pos))
+	{
+		ASSERT(all.compare(pos + 42, eol - pos - 42, uberlog_tsf::fmt("message %v", lines)) == 0);
+		lines++;
+	}
+	ASSERT(lines == nmsg);
+	DeleteLogFile();
+}
+#endif
+
+// Milliseconds since midnight, of a time stamp such as 2015-07-15T14:53:51.979+0200
+int TimeStampMS(const char* buf)
+{
+	return atoi(buf + 11) * 3600000 + atoi(buf + 14) * 60000 + atoi(buf + 17) * 1000 + atoi(buf + 20);
+}
+
+void TestTimeKeeper(uberlog::ClockSource source, const char* name)
+{
+	printf("Time stamps (%s)\n", name);
+	TimeKeeper tk;
+	TimeKeeper reference;
+	if (!tk.SetClockSource(source))
+	{
+		printf("  %s clock is not available\n", name);
+		return;
+	}
+
+	// Run across at least one second boundary, and check that every thread sees well formed time stamps that never go backwards,
+	// and that agree with the system clock.
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; t++)
+	{
+		threads.push_back(std::thread([&tk, &reference]() {
+			char   prev[TimeKeeper::MaxLen + 1] = {0};
+			char   buf[TimeKeeper::MaxLen + 1]  = {0};
+			char   ref[TimeKeeper::MaxLen + 1]  = {0};
+			double start                        = AccurateTimeSeconds();
+			while (AccurateTimeSeconds() - start < 1.2)
+			{
+				tk.Format(buf);
+				reference.Format(ref);
+				for (int i = 0; i < (int) tk.Len(); i++)
+				{
+					if (i == 4 || i == 7)
+						ASSERT(buf[i] == '-');
+					else if (i == 10)
+						ASSERT(buf[i] == 'T');
+					else if (i == 13 || i == 16)
+						ASSERT(buf[i] == ':');
+					else if (i == 19)
+						ASSERT(buf[i] == '.');
+					else if (i == 23)
+						ASSERT(buf[i] == '+' || buf[i] == '-');
+					else
+						ASSERT(buf[i] >= '0' && buf[i] <= '9');
+				}
+				ASSERT(strcmp(prev, buf) <= 0);
+				// The reference was read after us, so it can only be a little bit later, unless we're at midnight
+				int diff = TimeStampMS(ref) - TimeStampMS(buf);
+				ASSERT((diff >= -1 && diff < 50) || memcmp(buf, ref, 10) != 0);
+				memcpy(prev, buf, sizeof(buf));
+			}
+		}));
+	}
+	for (auto& th : threads)
+		th.join();
+}
+
+void TestTimeFormat()
+{
+	printf("Time formats\n");
+	const uint64_t t = 1436964831979123456ull; // 2015-07-15T12:53:51.979123456Z
+
+	struct
+	{
+		uberlog::TimeFormat Format;
+		const char*         Expect;
+	} exact[] = {
+	    {uberlog::TimeFormat::UTCMilli, "2015-07-15T12:53:51.979Z"},
+	    {uberlog::TimeFormat::UTCMicro, "2015-07-15T12:53:51.979123Z"},
+	    {uberlog::TimeFormat::UTCNano, "2015-07-15T12:53:51.979123456Z"},
+	    {uberlog::TimeFormat::EpochNano, "1436964831979123456"},
+	};
+	for (const auto& x : exact)
+	{
+		TimeKeeper tk;
+		char       buf[TimeKeeper::MaxLen + 1] = {0};
+		tk.SetFormat(x.Format);
+		tk.FormatAt(t, buf);
+		ASSERT(tk.Len() == strlen(x.Expect));
+		ASSERT(strcmp(buf, x.Expect) == 0);
+	}
+
+	// Seconds since the epoch no longer fit into 32 bits after 2106
+	{
+		TimeKeeper tk;
+		char       buf[TimeKeeper::MaxLen + 1] = {0};
+		tk.SetFormat(uberlog::TimeFormat::EpochNano);
+		tk.FormatAt(5000000000123456789ull, buf);
+		ASSERT(strcmp(buf, "5000000000123456789") == 0);
+	}
+
+	// The local formats only differ from LocalMilli in the number of digits after the decimal point
+	TimeKeeper milli;
+	char       m[TimeKeeper::MaxLen + 1] = {0};
+	milli.FormatAt(t, m);
+	struct
+	{
+		uberlog::TimeFormat Format;
+		const char*         Fraction;
+	} local[] = {
+	    {uberlog::TimeFormat::LocalMicro, "979123"},
+	    {uberlog::TimeFormat::LocalNano, "979123456"},
+	};
+	for (const auto& x : local)
+	{
+		TimeKeeper tk;
+		char       buf[TimeKeeper::MaxLen + 1] = {0};
+		size_t     n                           = strlen(x.Fraction);
+		tk.SetFormat(x.Format);
+		tk.FormatAt(t, buf);
+		ASSERT(tk.Len() == milli.Len() + n - 3);
+		ASSERT(memcmp(buf, m, 20) == 0);
+		ASSERT(memcmp(buf + 20, x.Fraction, n) == 0);
+		ASSERT(strcmp(buf + 20 + n, m + 23) == 0);
+	}
+
+	// Through the logger, with the prefix rendered by the caller, and by the logger slave
+	for (int deferred = 0; deferred < 2; deferred++)
+	{
+		DeleteLogFile();
+		uberlog::Logger log;
+		log.SetTimeFormat(uberlog::TimeFormat::UTCNano);
+		log.SetDeferredPrefix(deferred != 0);
+		log.Open(TestLog);
+		log.Info("nano");
+		log.Close();
+		// 2015-07-15T12:53:51.979123456Z [I] 00001fdc nano
+		std::string line = ReadLogFile();
+		ASSERT(line.size() == 30 + 14 + 4 + strlen(EOL));
+		ASSERT(line[19] == '.' && line[29] == 'Z');
+		ASSERT(line.substr(30, 5) == " [I] " && line.substr(44, 4) == "nano");
+	}
+	DeleteLogFile();
+}
+
+// Compare the native formatting of doubles in tsf against snprintf, and check that %v reads back exactly
+void TestFormatDouble()
+{
+	printf("Format double\n");
+	const char* specs[]   = {"%g", "%f", "%e", "%G", "%E", "%.0f", "%.2f", "%.3f", "%.17f", "%.0e", "%.3e", "%.16e", "%.0g", "%.3g", "%.17g", "%10.3f", "%-10.3f|", "%010.3f", "%+g", "% .4e", "%.40f"};
+	const int   nspec     = (int) (sizeof(specs) / sizeof(specs[0]));
+	double      special[] = {0.0, -0.0, 0.5, 1.5, 2.5, 0.125, 9.9999995, 999999.5, 1e21, 1e-5, 5e-324, 2.2250738585072014e-308, 1.7976931348623157e308};
+	uint64_t    x         = 88172645463325252ull;
+	for (int i = 0; i < 200000; i++)
+	{
+		// xorshift
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		double v;
+		if (i < (int) (sizeof(special) / sizeof(special[0])))
+			v = special[i];
+		else if (i % 3 == 0)
+			memcpy(&v, &x, sizeof(v));
+		else if (i % 3 == 1)
+			v = (double) (x % 100000000) / pow(10, (double) (x >> 60));
+		else
+			v = (double) (int64_t)(x % 2000001 - 1000000) / 8;
+		if (!std::isfinite(v))
+			continue;
+
+		char        ref[400];
+		const char* spec = specs[i % nspec];
+		uberlog_tsf::fmt_snprintf(ref, sizeof(ref), spec, v);
+		ASSERT(uberlog_tsf::fmt(spec, v) == ref);
+
+		// The shortest digits that read back as v, with the same layout as %g
+		auto   s    = uberlog_tsf::fmt("%v", v);
+		double back = strtod(s.c_str(), nullptr);
+		ASSERT(memcmp(&back, &v, sizeof(v)) == 0);
+		std::string digits;
+		for (size_t j = 0; j < s.size() && s[j] != 'e'; j++)
+		{
+			if (s[j] >= '0' && s[j] <= '9' && (s[j] != '0' || digits.size() != 0))
+				digits += s[j];
+		}
+		while (digits.size() > 1 && digits.back() == '0')
+			digits.pop_back();
+		if (digits.size() > 1)
+		{
+			char shorter[40];
+			snprintf(shorter, sizeof(shorter), "%.*e", (int) digits.size() - 2, v);
+			ASSERT(strtod(shorter, nullptr) != v);
+		}
+	}
+	ASSERT(uberlog_tsf::fmt("%v", 0.1) == "0.1");
+	ASSERT(uberlog_tsf::fmt("%v", 0.1 + 0.2) == "0.30000000000000004");
+	ASSERT(uberlog_tsf::fmt("%v", 123456.75) == "123456.75");
+	ASSERT(uberlog_tsf::fmt("%v", 1234567.0) == "1.234567e+06");
+	ASSERT(uberlog_tsf::fmt("%v", 0.0001) == "0.0001");
+	ASSERT(uberlog_tsf::fmt("%v", 1e-5) == "1e-05");
+	ASSERT(uberlog_tsf::fmt("%.3v", 3.14159) == "3.14");
+	ASSERT(uberlog_tsf::fmt("%v %v", INFINITY, -INFINITY) == "inf -inf");
+}
+
 void TestStdOut()
 {
 	uberlog::Logger l;
@@ -326,10 +1329,10 @@ void BenchThroughput()
 	}
 }
 
-double BenchSpdCompare()
+double BenchSpdCompare(uint32_t writeQueueDepth = 1)
 {
 	int           nmsg = 1000000;
-	LogOpenCloser oc(1024 * 1024, 5 * 1024 * 1024);
+	LogOpenCloser oc(1024 * 1024, 5 * 1024 * 1024, false, writeQueueDepth);
 	double        start = AccurateTimeSeconds();
 	for (int i = 0; i < nmsg; i++)
 		oc.Log.Info("uberlog message %v: This is some text for your pleasure", i);
@@ -343,10 +1346,10 @@ enum Modes
 	ModeSimpleFmt,
 };
 
-double BenchLoggerLatency(Modes mode)
+double BenchLoggerLatency(Modes mode, bool deferred = false, bool deferredPrefix = false)
 {
 	// Make the ring buffer size large enough that we never stall. We want to measure minimum latency here.
-	LogOpenCloser oc(32768 * 1024, 500 * 1024 * 1024);
+	LogOpenCloser oc(32768 * 1024, 500 * 1024 * 1024, deferred, 1, deferredPrefix);
 
 	size_t warmup = 100;
 	size_t count  = 50000;
@@ -370,6 +1373,43 @@ double BenchLoggerLatency(Modes mode)
 	return 1000000000.0 * (end - start) / count;
 }
 
+// Show the cost of fetching the thread id for every message, which is what we did before caching it
+double BenchTimeStamp(uberlog::ClockSource source)
+{
+	TimeKeeper tk;
+	char       buf[TimeKeeper::MaxLen];
+	tk.SetClockSource(source);
+	int        count = 1000 * 1000;
+	double     start = AccurateTimeSeconds();
+	for (int i = 0; i < count; i++)
+		tk.Format(buf);
+	return 1000000000.0 * (AccurateTimeSeconds() - start) / count;
+}
+
+double BenchFormatDouble(bool native)
+{
+	char   buf[64];
+	int    count = 1000 * 1000;
+	double start = AccurateTimeSeconds();
+	for (int i = 0; i < count; i++)
+	{
+		double v = i * 0.001234;
+		if (native)
+			uberlog_tsf::fmt_buf(buf, sizeof(buf), "%.3f", v);
+		else
+			uberlog_tsf::fmt_snprintf(buf, sizeof(buf), "%.3f", v);
+	}
+	return 1000000000.0 * (AccurateTimeSeconds() - start) / count;
+}
+
+double BenchLoggerLatencyUncachedTID(Modes mode)
+{
+	uberlog::internal::_Test_DisableThreadIDCache = true;
+	double ns                                     = BenchLoggerLatency(mode);
+	uberlog::internal::_Test_DisableThreadIDCache = false;
+	return ns;
+}
+
 void BenchFileWriteLatency()
 {
 #ifdef _WIN32
@@ -402,6 +1442,100 @@ void BenchFileWriteLatency()
 #endif
 }
 
+#ifdef __linux__
+// Write 32 MB of log, and return how much of it is in the page cache once the logger slave has written it, in MB
+double BenchPageCache(bool dropPageCache)
+{
+	const size_t total = 32 * 1024 * 1024;
+	std::string  msg   = MakeMsg(200, 0);
+	size_t       size  = total / msg.size() * msg.size();
+	size_t       page  = (size_t) sysconf(_SC_PAGESIZE);
+	size_t       n     = 0;
+	DeleteLogFile();
+	{
+		uberlog::Logger log;
+		log.SetArchiveSettings(1024 * 1024 * 1024, 3);
+		log.SetDropPageCache(dropPageCache);
+		log.Open(TestLog);
+		for (size_t i = 0; i < total / msg.size(); i++)
+			log.LogRaw(msg.c_str(), msg.size());
+
+		struct stat st;
+		for (int i = 0; i < 1000 && (stat(TestLog, &st) != 0 || (size_t) st.st_size != size); i++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		ASSERT((size_t) st.st_size == size);
+
+		int                        fd  = open(TestLog, O_RDONLY);
+		void*                      map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		std::vector<unsigned char> resident((size + page - 1) / page);
+		ASSERT(map != MAP_FAILED && mincore(map, size, &resident[0]) == 0);
+		for (auto r : resident)
+			n += r & 1;
+		munmap(map, size);
+		close(fd);
+		log.Close();
+	}
+	DeleteLogFile();
+	return n * page / (1024.0 * 1024.0);
+}
+#endif
+
+// Bounce 8 byte messages between two threads, through raw ring buffers with the given head layout.
+// If pingPong is true, then every message is echoed back through a second ring before the next one is sent,
+// which measures round trip latency. Otherwise, one thread streams messages to the other.
+// Returns nanoseconds per message.
+double BenchRingLayout(uberlog::internal::RingLayout layout, bool pingPong)
+{
+	using namespace uberlog::internal;
+	const size_t         ringSize = 64 * 1024;
+	const uint64_t       count    = pingPong ? 200000 : 5000000;
+	std::vector<uint8_t> mem[2];
+	RingBuffer           rings[2];
+	for (int i = 0; i < 2; i++)
+	{
+		mem[i].resize(ringSize + RingBuffer::HeadSize + RingBuffer::CacheLineSize);
+		uint8_t* buf = (uint8_t*) (((uintptr_t) &mem[i][0] + RingBuffer::CacheLineSize - 1) & ~(uintptr_t)(RingBuffer::CacheLineSize - 1));
+		rings[i].Init(buf, ringSize, true, layout);
+	}
+
+	std::thread echo([&]() {
+		for (uint64_t i = 0; i < count; i++)
+		{
+			uint64_t v;
+			while (!rings[0].CanRead(sizeof(v)))
+			{
+			}
+			rings[0].Read(&v, sizeof(v));
+			if (v != i)
+				Die(__FILE__, __LINE__, "ring message out of order");
+			if (!pingPong)
+				continue;
+			while (!rings[1].CanWrite(sizeof(v)))
+			{
+			}
+			rings[1].Write(&v, sizeof(v));
+		}
+	});
+
+	double start = AccurateTimeSeconds();
+	for (uint64_t i = 0; i < count; i++)
+	{
+		while (!rings[0].CanWrite(sizeof(i)))
+		{
+		}
+		rings[0].Write(&i, sizeof(i));
+		if (!pingPong)
+			continue;
+		uint64_t v;
+		while (!rings[1].CanRead(sizeof(v)))
+		{
+		}
+		rings[1].Read(&v, sizeof(v));
+	}
+	echo.join();
+	return 1000000000.0 * (AccurateTimeSeconds() - start) / count;
+}
+
 void HelloWorld()
 {
 	uberlog::Logger l;
@@ -412,15 +1546,74 @@ void HelloWorld()
 void TestAll()
 {
 	HelloWorld();
+	Bench("time stamp", "ns", []() { return BenchTimeStamp(uberlog::ClockSource::System); }, 10);
+	Bench("time stamp, TSC", "ns", []() { return BenchTimeStamp(uberlog::ClockSource::TSC); }, 10);
+	Bench("fmt double", "ns", []() { return BenchFormatDouble(true); }, 10);
+	Bench("snprintf double", "ns", []() { return BenchFormatDouble(false); }, 10);
 	Bench("raw log", "ns", []() { return BenchLoggerLatency(ModeRaw); }, 10);
 	Bench("simple fmt log", "ns", []() { return BenchLoggerLatency(ModeSimpleFmt); }, 10);
+	Bench("simple, no TID cache", "ns", []() { return BenchLoggerLatencyUncachedTID(ModeSimpleFmt); }, 10);
 	Bench("param fmt log", "ns", []() { return BenchLoggerLatency(ModeParamFmt); }, 10);
-	Bench("spd comparison", "s", BenchSpdCompare);
+	Bench("deferred fmt log", "ns", []() { return BenchLoggerLatency(ModeParamFmt, true); }, 10);
+	Bench("deferred prefix log", "ns", []() { return BenchLoggerLatency(ModeSimpleFmt, false, true); }, 10);
+	Bench("deferred fmt+prefix", "ns", []() { return BenchLoggerLatency(ModeParamFmt, true, true); }, 10);
+	Bench("spd comparison", "s", []() { return BenchSpdCompare(); });
+	Bench("spd, io_uring x4", "s", []() { return BenchSpdCompare(4); });
 	BenchFileWriteLatency();
 	BenchThroughput();
+#ifdef __linux__
+	Bench("cached, keep", "MB", []() { return BenchPageCache(false); }, 3);
+	Bench("cached, drop", "MB", []() { return BenchPageCache(true); }, 3);
+#endif
+	if (std::thread::hardware_concurrency() > 1)
+	{
+		// These spin, so they're meaningless on a single core
+		Bench("ring v1 ping-pong", "ns", []() { return BenchRingLayout(uberlog::internal::RingLayout::V1, true); });
+		Bench("ring v2 ping-pong", "ns", []() { return BenchRingLayout(uberlog::internal::RingLayout::V2, true); });
+		Bench("ring v1 stream", "ns", []() { return BenchRingLayout(uberlog::internal::RingLayout::V1, false); });
+		Bench("ring v2 stream", "ns", []() { return BenchRingLayout(uberlog::internal::RingLayout::V2, false); });
+	}
 	TestProcessLifecycle();
+#ifndef _WIN32
+	TestSlaveWithoutSharedMemory();
+#endif
 	TestFormattedWrite();
-	TestRingBuffer();
+	TestRingBuffer(1);
+	TestRingBuffer(4);
+	TestRingCursor();
+	TestRollover();
+	TestPreallocate();
+	TestSyncPolicy(uberlog::SyncPolicy::Periodic, "periodic", 1);
+	TestSyncPolicy(uberlog::SyncPolicy::WriteBehind, "write-behind", 4);
+	TestSyncPolicy(uberlog::SyncPolicy::OnWarn, "on warn", 1);
+	TestSyncPolicy(uberlog::SyncPolicy::OnWarn, "on warn", 4);
+	TestReserveCommit();
+	TestDeferredFormatting();
+	TestDeferredPrefix(false);
+	TestDeferredPrefix(true);
+	TestWakeLatency();
+	TestTryReserve();
+	TestOverflowPolicy(uberlog::OverflowPolicy::Drop, "drop");
+	TestOverflowPolicy(uberlog::OverflowPolicy::DropBelowWarn, "drop below warn");
+	TestOverflowPolicy(uberlog::OverflowPolicy::Spill, "spill");
+	TestDroppedWithoutDate(true);
+	TestDroppedWithoutDate(false);
+	TestConcurrentProducers(uberlog::ProducerMode::LockFree);
+	TestConcurrentProducers(uberlog::ProducerMode::Locked);
+	TestConcurrentProducers(uberlog::ProducerMode::PerThread);
+	TestCloseWhileLogging(uberlog::ProducerMode::LockFree);
+	TestCloseWhileLogging(uberlog::ProducerMode::Locked);
+	TestCloseWhileLogging(uberlog::ProducerMode::PerThread);
+	TestFlush(uberlog::ProducerMode::LockFree, 1);
+	TestFlush(uberlog::ProducerMode::LockFree, 4);
+	TestFlush(uberlog::ProducerMode::PerThread, 1);
+#ifdef __linux__
+	TestSubmitFailure();
+#endif
+	TestTimeKeeper(uberlog::ClockSource::System, "system");
+	TestTimeKeeper(uberlog::ClockSource::TSC, "TSC");
+	TestTimeFormat();
+	TestFormatDouble();
 	TestStdOut();
 	TestNoDate();
 }
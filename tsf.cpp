@@ -28,19 +28,28 @@ public:
 	size_t		Pos;		// The number of bytes appended
 	size_t		Capacity;	// Capacity of 'Buffer'
 	bool		OwnBuffer;	// True if we have allocated the buffer
+	bool		Fixed;		// True if we may not grow the buffer
+	bool		Overflow;	// True if a Fixed buffer has run out of space
 
-	StackBuffer(char* staticbuf, size_t staticbuf_size)
+	StackBuffer(char* staticbuf, size_t staticbuf_size, bool fixed = false)
 	{
 		OwnBuffer = false;
+		Fixed = fixed;
+		Overflow = false;
 		Pos = 0;
 		Buffer = staticbuf;
 		Capacity = staticbuf_size;
 	}
 
-	void Reserve(size_t bytes)
+	bool Reserve(size_t bytes)
 	{
 		if (Pos + bytes > Capacity)
 		{
+			if (Fixed)
+			{
+				Overflow = true;
+				return false;
+			}
 			size_t ncap = Capacity * 2;
 			if (ncap < Pos + bytes) ncap = Pos + bytes;
 			char* nbuf = new char[ncap];
@@ -50,13 +59,15 @@ public:
 			OwnBuffer = true;
 			Buffer = nbuf;
 		}
+		return true;
 	}
 
 	void MoveCurrentPos(size_t bytes)	{ Pos += bytes; assert(Pos <= Capacity); }
 
 	char* AddUninitialized(size_t bytes)
 	{
-		Reserve(bytes);
+		if (!Reserve(bytes))
+			return nullptr;
 		char* p = Buffer + Pos;
 		Pos += bytes;
 		return p;
@@ -65,7 +76,8 @@ public:
 	void Add(char c)
 	{
 		char* p = AddUninitialized(1);
-		*p = c;
+		if (p)
+			*p = c;
 	}
 
 	size_t RemainingSpace() const { return Capacity - Pos; }
@@ -175,6 +187,635 @@ static int format_int64(char* destination, size_t count, const char* format_str,
 	return fmt_snprintf(destination, count, format_str, v);
 }
 
+// Native formatting of doubles, which avoids vsnprintf and the C locale.
+// %e, %f and %g, with flags, width and precision, produce the same text as printf. Their digits are
+// computed exactly, from the binary value of the double, and rounded half to even, like glibc does.
+// %v produces the shortest string of digits that reads back as the same double, using the Ryu
+// algorithm (Ulf Adams, 2018), laid out like %g. Infinity, NaN, %a, the '#' flag, and a width or
+// precision above dbl_max_prec go to snprintf.
+
+static const int dbl_max_digits  = 420; // 309 integer digits, plus up to dbl_max_prec fraction digits, plus a chunk
+static const int dbl_max_prec    = 64;  // Larger precision or width goes to snprintf
+static const int dbl_chunk       = 9;   // Decimal digits produced at a time
+static const int dbl_ryu_bits    = 125; // Bits in the entries of the Ryu tables
+static const int dbl_ryu_pow5    = 326; // Number of entries in dbl_ryu_tables::Pow5
+static const int dbl_ryu_pow5inv = 342; // Number of entries in dbl_ryu_tables::Pow5Inv
+
+// An unsigned integer of up to 40 * 32 bits, which is enough for the exact value of any double
+struct dbl_bigint
+{
+	uint32_t Limbs[40];
+	int      N; // Number of limbs in use. Limbs[N-1] may be zero.
+
+	dbl_bigint(uint64_t v = 0)
+	{
+		Limbs[0] = (uint32_t) v;
+		Limbs[1] = (uint32_t)(v >> 32);
+		N        = 2;
+	}
+
+	bool IsZero() const
+	{
+		for (int i = 0; i < N; i++)
+		{
+			if (Limbs[i] != 0)
+				return false;
+		}
+		return true;
+	}
+
+	int BitLength() const
+	{
+		for (int i = N - 1; i >= 0; i--)
+		{
+			for (int b = 31; b >= 0; b--)
+			{
+				if (Limbs[i] & ((uint32_t) 1 << b))
+					return i * 32 + b + 1;
+			}
+		}
+		return 0;
+	}
+
+	uint32_t Bit(int i) const
+	{
+		if (i < 0 || i >= N * 32)
+			return 0;
+		return (Limbs[i / 32] >> (i % 32)) & 1;
+	}
+
+	// Returns the 64 bits starting at bit 'pos', which may be negative
+	uint64_t Bits64(int pos) const
+	{
+		uint64_t r = 0;
+		for (int i = 0; i < 64; i++)
+			r |= (uint64_t) Bit(pos + i) << i;
+		return r;
+	}
+
+	void ShiftLeft(int bits)
+	{
+		int words = bits / 32;
+		bits %= 32;
+		Limbs[N] = 0;
+		N++;
+		if (bits != 0)
+		{
+			for (int i = N - 1; i > 0; i--)
+				Limbs[i] = (Limbs[i] << bits) | (Limbs[i - 1] >> (32 - bits));
+			Limbs[0] <<= bits;
+		}
+		if (words != 0)
+		{
+			for (int i = N - 1; i >= 0; i--)
+				Limbs[i + words] = Limbs[i];
+			for (int i = 0; i < words; i++)
+				Limbs[i] = 0;
+			N += words;
+		}
+	}
+
+	void Mul(uint32_t m)
+	{
+		uint64_t carry = 0;
+		for (int i = 0; i < N; i++)
+		{
+			carry += (uint64_t) Limbs[i] * m;
+			Limbs[i] = (uint32_t) carry;
+			carry >>= 32;
+		}
+		if (carry != 0)
+			Limbs[N++] = (uint32_t) carry;
+	}
+
+	// Divide by d, and return the remainder
+	uint32_t Div(uint32_t d)
+	{
+		uint64_t rem = 0;
+		for (int i = N - 1; i >= 0; i--)
+		{
+			rem      = (rem << 32) | Limbs[i];
+			Limbs[i] = (uint32_t)(rem / d);
+			rem %= d;
+		}
+		while (N > 1 && Limbs[N - 1] == 0)
+			N--;
+		return (uint32_t) rem;
+	}
+
+	// Remove the bits from 'pos' upwards, and return them. They must fit into 31 bits.
+	uint32_t TakeAbove(int pos)
+	{
+		int w   = pos / 32;
+		int off = pos % 32;
+		if (w >= N)
+			return 0;
+		uint32_t r = Limbs[w] >> off;
+		if (off != 0 && w + 1 < N)
+			r |= Limbs[w + 1] << (32 - off);
+		Limbs[w] &= ((uint32_t) 1 << off) - 1;
+		N = w + 1;
+		return r;
+	}
+};
+
+// The decimal number 0.D[0]D[1]...D[N-1] * 10^Point. The digits after N are zero, unless Rest is true.
+struct dbl_decimal
+{
+	char D[dbl_max_digits];
+	int  N     = 0;
+	int  Point = 1;
+	bool Rest  = false;
+
+	void AddUint(uint64_t v)
+	{
+		char tmp[20];
+		int  n = 0;
+		do
+		{
+			tmp[n++] = '0' + (char) (v % 10);
+			v /= 10;
+		} while (v != 0);
+		while (n != 0)
+			D[N++] = tmp[--n];
+	}
+
+	// Add the dbl_chunk digits of v. Leading zeros of the number are not stored, but move the decimal point.
+	void AddChunk(uint32_t v)
+	{
+		char tmp[dbl_chunk];
+		for (int i = dbl_chunk - 1; i >= 0; i--)
+		{
+			tmp[i] = '0' + (char) (v % 10);
+			v /= 10;
+		}
+		for (int i = 0; i < dbl_chunk; i++)
+		{
+			if (N == 0 && tmp[i] == '0')
+				Point--;
+			else
+				D[N++] = tmp[i];
+		}
+	}
+};
+
+// Produce the exact decimal digits of m * 2^e, until we have at least maxSig significant digits, or
+// maxFrac digits after the decimal point. Integer digits are always produced in full.
+static void dbl_exact(uint64_t m, int e, int maxSig, int maxFrac, dbl_decimal& dec)
+{
+	dec.N     = 0;
+	dec.Point = 0;
+	dec.Rest  = false;
+	if (e >= 0)
+	{
+		if (e <= 10)
+		{
+			dec.AddUint(m << e);
+		}
+		else
+		{
+			dbl_bigint big(m);
+			big.ShiftLeft(e);
+			uint32_t chunks[40];
+			int      nchunk = 0;
+			while (!big.IsZero())
+				chunks[nchunk++] = big.Div(1000000000);
+			dec.AddUint(chunks[--nchunk]);
+			while (nchunk != 0)
+				dec.AddChunk(chunks[--nchunk]);
+		}
+		dec.Point = dec.N;
+		return;
+	}
+
+	// The fraction is frac / 2^k
+	int        k    = -e;
+	dbl_bigint frac = k < 64 ? m & (((uint64_t) 1 << k) - 1) : m;
+	if (k < 64 && (m >> k) != 0)
+	{
+		dec.AddUint(m >> k);
+		dec.Point = dec.N;
+	}
+	for (int nfrac = 0; nfrac < maxFrac && dec.N < maxSig && !frac.IsZero(); nfrac += dbl_chunk)
+	{
+		// frac / 2^k * 10^9 = frac * 5^9 / 2^(k-9)
+		if (k < dbl_chunk)
+		{
+			frac.ShiftLeft(dbl_chunk - k);
+			k = dbl_chunk;
+		}
+		frac.Mul(1953125);
+		k -= dbl_chunk;
+		dec.AddChunk(frac.TakeAbove(k));
+	}
+	dec.Rest = !frac.IsZero();
+}
+
+// Round to 'keep' digits, half to even
+static void dbl_round(dbl_decimal& dec, int keep)
+{
+	if (keep >= dec.N)
+		return;
+	if (keep < 0)
+	{
+		dec.N = 0;
+		return;
+	}
+	bool up = dec.D[keep] > '5';
+	if (dec.D[keep] == '5')
+	{
+		up = dec.Rest || (keep > 0 && ((dec.D[keep - 1] - '0') & 1) != 0);
+		for (int i = keep + 1; i < dec.N && !up; i++)
+			up = dec.D[i] != '0';
+	}
+	dec.N    = keep;
+	dec.Rest = false;
+	if (!up)
+		return;
+	int i = keep - 1;
+	for (; i >= 0 && dec.D[i] == '9'; i--)
+	{
+	}
+	if (i < 0)
+	{
+		dec.D[0] = '1';
+		dec.N    = 1;
+		dec.Point++;
+	}
+	else
+	{
+		dec.D[i]++;
+		dec.N = i + 1;
+	}
+}
+
+static inline int dbl_pow5bits(int e) { return (int) (((uint32_t) e * 1217359) >> 19) + 1; } // ceil(log2(5^e)), or 1 if e = 0
+static inline int dbl_log10_pow2(int e) { return (int) (((uint32_t) e * 78913) >> 18); }      // floor(log10(2^e))
+static inline int dbl_log10_pow5(int e) { return (int) (((uint32_t) e * 732923) >> 20); }     // floor(log10(5^e))
+
+// The top dbl_ryu_bits bits of 5^i, and of 2^n / 5^i, computed once, instead of being pasted into the source
+struct dbl_ryu_tables
+{
+	uint64_t Pow5[dbl_ryu_pow5][2];
+	uint64_t Pow5Inv[dbl_ryu_pow5inv][2];
+
+	dbl_ryu_tables()
+	{
+		dbl_bigint p(1);
+		for (int i = 0; i < dbl_ryu_pow5; i++)
+		{
+			int shift  = p.BitLength() - dbl_ryu_bits;
+			Pow5[i][0] = p.Bits64(shift);
+			Pow5[i][1] = p.Bits64(shift + 64);
+			p.Mul(5);
+		}
+
+		// floor(floor(a / 5) / 5) = floor(a / 25), so we can divide by 5 repeatedly, and then shift down to each entry's precision
+		int        top = dbl_pow5bits(dbl_ryu_pow5inv - 1) - 1 + dbl_ryu_bits;
+		dbl_bigint q(1);
+		q.ShiftLeft(top);
+		for (int i = 0; i < dbl_ryu_pow5inv; i++)
+		{
+			int shift     = top - (dbl_pow5bits(i) - 1 + dbl_ryu_bits);
+			Pow5Inv[i][0] = q.Bits64(shift) + 1;
+			Pow5Inv[i][1] = q.Bits64(shift + 64) + (Pow5Inv[i][0] == 0 ? 1 : 0);
+			q.Div(5);
+		}
+	}
+};
+
+// (m * mul) >> j, where mul is a 128 bit number, and 64 < j < 128
+static inline uint64_t dbl_mul_shift(uint64_t m, const uint64_t* mul, int j)
+{
+#if defined(__SIZEOF_INT128__)
+	unsigned __int128 b0 = (unsigned __int128) m * mul[0];
+	unsigned __int128 b2 = (unsigned __int128) m * mul[1];
+	return (uint64_t)(((b0 >> 64) + b2) >> (j - 64));
+#else
+	// 128 bit products, from 32 bit pieces
+	auto mul128 = [](uint64_t a, uint64_t b, uint64_t& hi) -> uint64_t {
+		uint64_t b00  = (a & 0xffffffff) * (b & 0xffffffff);
+		uint64_t b01  = (a & 0xffffffff) * (b >> 32);
+		uint64_t b10  = (a >> 32) * (b & 0xffffffff);
+		uint64_t b11  = (a >> 32) * (b >> 32);
+		uint64_t mid1 = b10 + (b00 >> 32);
+		uint64_t mid2 = b01 + (mid1 & 0xffffffff);
+		hi            = b11 + (mid1 >> 32) + (mid2 >> 32);
+		return (mid2 << 32) | (b00 & 0xffffffff);
+	};
+	uint64_t high0, high1;
+	mul128(m, mul[0], high0);
+	uint64_t low1 = mul128(m, mul[1], high1);
+	uint64_t sum  = high0 + low1;
+	if (sum < high0)
+		high1++;
+	int dist = j - 64;
+	return (high1 << (64 - dist)) | (sum >> dist);
+#endif
+}
+
+static inline bool dbl_multiple_of_pow5(uint64_t v, int p)
+{
+	for (; p > 0; p--)
+	{
+		if (v % 5 != 0)
+			return false;
+		v /= 5;
+	}
+	return true;
+}
+
+// The shortest decimal that reads back as m * 2^e, where m and e are the raw fields of a finite, nonzero
+// double. When there is a choice, pick the one closest to the exact value. This is Ryu's d2d.
+static void dbl_shortest(uint64_t ieeeMantissa, int ieeeExponent, dbl_decimal& dec)
+{
+	static const dbl_ryu_tables tables;
+
+	int      e2;
+	uint64_t m2;
+	if (ieeeExponent == 0)
+	{
+		e2 = 1 - 1023 - 52 - 2;
+		m2 = ieeeMantissa;
+	}
+	else
+	{
+		e2 = ieeeExponent - 1023 - 52 - 2;
+		m2 = ((uint64_t) 1 << 52) | ieeeMantissa;
+	}
+	bool     acceptBounds = (m2 & 1) == 0;
+	uint64_t mv           = 4 * m2;
+	uint32_t mmShift      = ieeeMantissa != 0 || ieeeExponent <= 1;
+
+	// The value is mv * 2^e2, and it reads back from anything between mm and mp
+	uint64_t vr, vp, vm;
+	int      e10;
+	bool     vmIsTrailingZeros = false;
+	bool     vrIsTrailingZeros = false;
+	if (e2 >= 0)
+	{
+		int q = dbl_log10_pow2(e2) - (e2 > 3);
+		int k = dbl_ryu_bits + dbl_pow5bits(q) - 1;
+		int i = -e2 + q + k;
+		e10   = q;
+		vr    = dbl_mul_shift(4 * m2, tables.Pow5Inv[q], i);
+		vp    = dbl_mul_shift(4 * m2 + 2, tables.Pow5Inv[q], i);
+		vm    = dbl_mul_shift(4 * m2 - 1 - mmShift, tables.Pow5Inv[q], i);
+		if (q <= 21)
+		{
+			// Only one of mp, mv and mm can be a multiple of 5, if any
+			if (mv % 5 == 0)
+				vrIsTrailingZeros = dbl_multiple_of_pow5(mv, q);
+			else if (acceptBounds)
+				vmIsTrailingZeros = dbl_multiple_of_pow5(mv - 1 - mmShift, q);
+			else
+				vp -= dbl_multiple_of_pow5(mv + 2, q);
+		}
+	}
+	else
+	{
+		int q = dbl_log10_pow5(-e2) - (-e2 > 1);
+		int i = -e2 - q;
+		int k = dbl_pow5bits(i) - dbl_ryu_bits;
+		int j = q - k;
+		e10   = q + e2;
+		vr    = dbl_mul_shift(4 * m2, tables.Pow5[i], j);
+		vp    = dbl_mul_shift(4 * m2 + 2, tables.Pow5[i], j);
+		vm    = dbl_mul_shift(4 * m2 - 1 - mmShift, tables.Pow5[i], j);
+		if (q <= 1)
+		{
+			// mv has at least q trailing zero bits, and so does mm or mp, whichever is even
+			vrIsTrailingZeros = true;
+			if (acceptBounds)
+				vmIsTrailingZeros = mmShift == 1;
+			else
+				vp--;
+		}
+		else if (q < 63)
+		{
+			vrIsTrailingZeros = (mv & (((uint64_t) 1 << q) - 1)) == 0;
+		}
+	}
+
+	// Remove digits while vp and vm still differ, and remember the last digit of vr that we removed
+	int      removed          = 0;
+	uint32_t lastRemovedDigit = 0;
+	uint64_t output;
+	if (vmIsTrailingZeros || vrIsTrailingZeros)
+	{
+		for (; vp / 10 > vm / 10; removed++)
+		{
+			vmIsTrailingZeros &= vm % 10 == 0;
+			vrIsTrailingZeros &= lastRemovedDigit == 0;
+			lastRemovedDigit = (uint32_t)(vr % 10);
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+		}
+		if (vmIsTrailingZeros)
+		{
+			for (; vm % 10 == 0; removed++)
+			{
+				vrIsTrailingZeros &= lastRemovedDigit == 0;
+				lastRemovedDigit = (uint32_t)(vr % 10);
+				vr /= 10;
+				vp /= 10;
+				vm /= 10;
+			}
+		}
+		// Round half to even, if the exact number is .....50..0
+		if (vrIsTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0)
+			lastRemovedDigit = 4;
+		output = vr + ((vr == vm && (!acceptBounds || !vmIsTrailingZeros)) || lastRemovedDigit >= 5);
+	}
+	else
+	{
+		// The common case, where we don't need to worry about exact ties
+		bool roundUp = false;
+		if (vp / 100 > vm / 100)
+		{
+			roundUp = vr % 100 >= 50;
+			vr /= 100;
+			vp /= 100;
+			vm /= 100;
+			removed += 2;
+		}
+		for (; vp / 10 > vm / 10; removed++)
+		{
+			roundUp = vr % 10 >= 5;
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+		}
+		output = vr + (vr == vm || roundUp);
+	}
+
+	dec.N    = 0;
+	dec.Rest = false;
+	dec.AddUint(output);
+	dec.Point = dec.N + e10 + removed;
+}
+
+// Write the digits of dec with 'frac' digits after the decimal point
+static char* dbl_put_fixed(char* p, const dbl_decimal& dec, int frac)
+{
+	if (dec.Point <= 0)
+		*p++ = '0';
+	for (int i = 0; i < dec.Point; i++)
+		*p++ = i < dec.N ? dec.D[i] : '0';
+	if (frac > 0)
+		*p++ = '.';
+	for (int i = dec.Point; i < dec.Point + frac; i++)
+		*p++ = i >= 0 && i < dec.N ? dec.D[i] : '0';
+	return p;
+}
+
+// Write the digits of dec in scientific notation, with 'frac' digits after the decimal point
+static char* dbl_put_exp(char* p, const dbl_decimal& dec, int frac, char e)
+{
+	*p++ = dec.N > 0 ? dec.D[0] : '0';
+	if (frac > 0)
+		*p++ = '.';
+	for (int i = 1; i <= frac; i++)
+		*p++ = i < dec.N ? dec.D[i] : '0';
+	int x = dec.N > 0 ? dec.Point - 1 : 0;
+	*p++  = e;
+	*p++  = x < 0 ? '-' : '+';
+	if (x < 0)
+		x = -x;
+	if (x >= 100)
+		*p++ = '0' + (char) (x / 100);
+	*p++ = '0' + (char) (x / 10 % 10);
+	*p++ = '0' + (char) (x % 10);
+	return p;
+}
+
+// Write the digits of dec in the style of %g, with up to 'prec' significant digits
+static char* dbl_put_general(char* p, dbl_decimal& dec, int prec, char e)
+{
+	int x = dec.N > 0 ? dec.Point - 1 : 0;
+	while (dec.N > 0 && dec.D[dec.N - 1] == '0')
+		dec.N--;
+	if (x < -4 || x >= prec)
+		return dbl_put_exp(p, dec, dec.N > 1 ? dec.N - 1 : 0, e);
+	return dbl_put_fixed(p, dec, dec.N > dec.Point ? dec.N - dec.Point : 0);
+}
+
+static int format_double(char* destination, size_t count, const char* format_str, double v, bool shortest)
+{
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	bool     negative  = (bits >> 63) != 0;
+	int      exponent  = (int) ((bits >> 52) & 0x7ff);
+	uint64_t mantissa  = bits & (((uint64_t) 1 << 52) - 1);
+	bool     left      = false;
+	bool     zeroPad   = false;
+	char     sign      = negative ? '-' : 0;
+	int      width     = 0;
+	int      precision = -1;
+	if (exponent == 0x7ff)
+		return fmt_snprintf(destination, count, format_str, v);
+
+	// Parse %[flags][width][.precision]type
+	const char* f = format_str + 1;
+	for (;; f++)
+	{
+		if (*f == '-')
+			left = true;
+		else if (*f == '0')
+			zeroPad = true;
+		else if (*f == '+')
+			sign = negative ? '-' : '+';
+		else if (*f == ' ')
+			sign = negative ? '-' : (sign == '+' ? '+' : ' ');
+		else
+			break;
+	}
+	for (; *f >= '0' && *f <= '9' && width <= dbl_max_prec; f++)
+		width = width * 10 + (*f - '0');
+	if (*f == '.')
+	{
+		precision = 0;
+		for (f++; *f >= '0' && *f <= '9' && precision <= dbl_max_prec; f++)
+			precision = precision * 10 + (*f - '0');
+	}
+	char type = *f;
+	if (width > dbl_max_prec || precision > dbl_max_prec || f[1] != 0 || (type != 'e' && type != 'E' && type != 'f' && type != 'g' && type != 'G'))
+		return fmt_snprintf(destination, count, format_str, v);
+
+	char        e        = type == 'e' || type == 'g' ? 'e' : 'E';
+	bool        isExp    = type == 'e' || type == 'E';
+	bool        isFixed  = type == 'f';
+	bool        isShort  = shortest && precision == -1; // %v without a precision
+	dbl_decimal dec;
+	if (precision == -1)
+		precision = 6;
+	else if (precision == 0 && !isExp && !isFixed)
+		precision = 1;
+
+	if (exponent == 0 && mantissa == 0)
+	{
+		dec.N     = 0;
+		dec.Point = 1;
+	}
+	else if (isShort)
+	{
+		dbl_shortest(mantissa, exponent, dec);
+	}
+	else
+	{
+		uint64_t m = exponent == 0 ? mantissa : mantissa | ((uint64_t) 1 << 52);
+		int      x = (exponent == 0 ? 1 : exponent) - 1075;
+		if (isFixed)
+		{
+			dbl_exact(m, x, 1 << 30, precision + 1, dec);
+			dbl_round(dec, dec.Point + precision);
+		}
+		else
+		{
+			int sig = isExp ? precision + 1 : precision;
+			dbl_exact(m, x, sig + 1, 1 << 30, dec);
+			dbl_round(dec, sig);
+		}
+	}
+
+	char  body[dbl_max_digits + 16];
+	char* p = body;
+	if (isFixed)
+		p = dbl_put_fixed(p, dec, precision);
+	else if (isExp)
+		p = dbl_put_exp(p, dec, precision, e);
+	else
+		p = dbl_put_general(p, dec, precision, e);
+
+	// Pad to width
+	size_t len = (size_t) (p - body) + (sign != 0 ? 1 : 0);
+	size_t pad = (size_t) width > len ? (size_t) width - len : 0;
+	if (len + pad >= count)
+		return -1;
+	char* out = destination;
+	if (!left && !zeroPad)
+	{
+		memset(out, ' ', pad);
+		out += pad;
+	}
+	if (sign != 0)
+		*out++ = sign;
+	if (!left && zeroPad)
+	{
+		memset(out, '0', pad);
+		out += pad;
+	}
+	memcpy(out, body, p - body);
+	out += p - body;
+	if (left)
+	{
+		memset(out, ' ', pad);
+		out += pad;
+	}
+	return (int) (out - destination);
+}
+
 static inline void fmt_settype(char argbuf[argbuf_arraysize], size_t pos, const char* width, char type)
 {
 	if (width != nullptr)
@@ -268,7 +909,7 @@ static inline int fmt_output_with_snprintf(char* outbuf, char fmt_type, char arg
 	case fmtarg::TDbl:
 		if (tokenreal)	{ SETTYPE1(fmt_type); }
 		else			{ SETTYPE1('g'); }
-		return fmt_snprintf(outbuf, outputSize, argbuf, arg->Dbl);
+		return format_double(outbuf, outputSize, argbuf, arg->Dbl, fmt_type == 'v');
 	}
 
 #undef SETTYPE1
@@ -288,17 +929,20 @@ UBERLOG_TSF_FMT_API std::string fmt_core(const context& context, const char* fmt
 	return str;
 }
 
-UBERLOG_TSF_FMT_API StrLenPair fmt_core(const context& context, const char* fmt, ssize_t nargs, const fmtarg* args, char* staticbuf, size_t staticbuf_size)
+// If 'output' is Fixed, and it runs out of space, then the returned Str is null.
+static StrLenPair fmt_core_buffer(const context& context, const char* fmt, ssize_t nargs, const fmtarg* args, StackBuffer& output)
 {
 	if (nargs == 0)
 	{
 		// This is a common case worth optimizing. Unfortunately we cannot return 'fmt' directly, because it may be a temporary object.
 		size_t len = strlen(fmt);
-		if (staticbuf_size != 0 && len <= staticbuf_size + 1)
+		if (len + 1 <= output.Capacity)
 		{
-			memcpy(staticbuf, fmt, len + 1);
-			return StrLenPair{staticbuf, len};
+			memcpy(output.Buffer, fmt, len + 1);
+			return StrLenPair{output.Buffer, len};
 		}
+		if (output.Fixed)
+			return StrLenPair{nullptr, 0};
 		StrLenPair r;
 		r.Str = new char[len + 1];
 		r.Len = len;
@@ -313,13 +957,12 @@ UBERLOG_TSF_FMT_API StrLenPair fmt_core(const context& context, const char* fmt,
 	bool disallowed;
 	const ssize_t MaxOutputSize = 1 * 1024 * 1024;
 
-	size_t initial_sprintf_guessed_size = staticbuf_size >> 2; // must be less than staticbuf_size
-	StackBuffer output(staticbuf, staticbuf_size);
+	size_t initial_sprintf_guessed_size = output.Capacity >> 2; // must be less than output.Capacity
 
 	char argbuf[argbuf_arraysize];
 
 	// we can always safely look one ahead, because 'fmt' is by definition zero terminated
-	for (ssize_t i = 0; fmt[i]; i++)
+	for (ssize_t i = 0; fmt[i] && !output.Overflow; i++)
 	{
 		if (tokenstart != -1)
 		{
@@ -381,7 +1024,7 @@ UBERLOG_TSF_FMT_API StrLenPair fmt_core(const context& context, const char* fmt,
 					// grow output buffer size until we don't overflow
 					const fmtarg* arg = &args[iarg];
 					iarg++;
-					ssize_t outputSize = initial_sprintf_guessed_size;
+					ssize_t outputSize = output.Fixed ? output.RemainingSpace() : initial_sprintf_guessed_size;
 					while (true)
 					{
 						char* outbuf = (char*) output.AddUninitialized(outputSize);
@@ -396,6 +1039,13 @@ UBERLOG_TSF_FMT_API StrLenPair fmt_core(const context& context, const char* fmt,
 							output.MoveCurrentPos(written - outputSize);
 							break;
 						}
+						else if (output.Fixed)
+						{
+							// we already gave it all of the remaining space
+							output.MoveCurrentPos(-outputSize);
+							output.Overflow = true;
+							break;
+						}
 						else if (outputSize >= MaxOutputSize)
 						{
 							// give up. I first saw this on the Microsoft CRT when trying to write the "mu" symbol to an ascii string.
@@ -440,9 +1090,24 @@ UBERLOG_TSF_FMT_API StrLenPair fmt_core(const context& context, const char* fmt,
 		}
 	}
 	output.Add('\0');
+	if (output.Overflow)
+		return {nullptr, 0};
 	return {output.Buffer, output.Pos - 1};
 }
 
+UBERLOG_TSF_FMT_API StrLenPair fmt_core(const context& context, const char* fmt, ssize_t nargs, const fmtarg* args, char* staticbuf, size_t staticbuf_size)
+{
+	StackBuffer output(staticbuf, staticbuf_size);
+	return fmt_core_buffer(context, fmt, nargs, args, output);
+}
+
+UBERLOG_TSF_FMT_API ssize_t fmt_core_fixed(const context& context, const char* fmt, ssize_t nargs, const fmtarg* args, char* buf, size_t buf_size)
+{
+	StackBuffer output(buf, buf_size, true);
+	StrLenPair res = fmt_core_buffer(context, fmt, nargs, args, output);
+	return res.Str != nullptr ? (ssize_t) res.Len : -1;
+}
+
 static inline int fmt_translate_snprintf_return_value(int r, size_t count)
 {
 	if (r < 0 || (size_t) r >= count)
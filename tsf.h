@@ -13,9 +13,10 @@ commands that you expect from the printf family of functions work.
 This makes the code much smaller than other implementations.
 
 We do however implement some of the common operations ourselves,
-such as emitting integers or plain strings, because most snprintf
-implementations are actually very slow, and we can gain a lot of
-speed by doing these common operations ourselves.
+such as emitting integers, plain strings, and doubles (%e, %f, %g), because
+most snprintf implementations are actually very slow, and we can gain a lot of
+speed by doing these common operations ourselves. Our doubles come out exactly
+as glibc's snprintf would print them, but they don't depend on the C locale.
 
 Usage:
 
@@ -24,6 +25,7 @@ tsf::fmt("%s %d", "abc", 123)        -->  "abc 123"     <== Specific value types
 tsf::fmt("%v", std::string("abc"))   -->  "abc"         <== std::string
 tsf::fmt("%v", std::wstring("abc"))  -->  "abc"         <== std::wstring
 tsf::fmt("%.3f", 25.5)               -->  "25.500"      <== Use format strings as usual
+tsf::fmt("%v", 0.1 + 0.2)            -->  "0.30000000000000004" <== The shortest digits that read back as the same double, laid out like %g
 tsf::print("%v", "Hello world")      -->  "Hello world" <== Print to stdout
 tsf::print(stderr, "err %v", 5)      -->  "err 5"       <== Print to stderr (or any other FILE*)
 
@@ -147,6 +149,10 @@ struct StrLenPair
 UBERLOG_TSF_FMT_API std::string fmt_core(const context& context, const char* fmt, ssize_t nargs, const fmtarg* args);
 UBERLOG_TSF_FMT_API StrLenPair  fmt_core(const context& context, const char* fmt, ssize_t nargs, const fmtarg* args, char* staticbuf, size_t staticbuf_size);
 
+// Format into a caller-supplied buffer, which must have room for a null terminator. The terminator is written, but is not
+// included in the return value. Returns the number of characters written, or -1 if the buffer is too small. No memory is allocated.
+UBERLOG_TSF_FMT_API ssize_t     fmt_core_fixed(const context& context, const char* fmt, ssize_t nargs, const fmtarg* args, char* buf, size_t buf_size);
+
 namespace internal {
 
 inline void fmt_pack(fmtarg* pack)
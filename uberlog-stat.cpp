@@ -0,0 +1,180 @@
+/*
+uberlog-stat attaches to the shared memory of a running logger, and prints
+live rates from its statistics block, similar to vmstat. See SharedStats.
+*/
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <signal.h>
+#include <errno.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+#include "uberlog.h"
+
+namespace uberlog {
+namespace internal {
+
+// A snapshot of the counters, so that we can print the difference between two of them
+struct StatSample
+{
+	uint64_t Time;
+	uint64_t Messages;
+	uint64_t Bytes;
+	uint64_t Dropped;
+	uint64_t Stalls;
+	uint64_t StallNS;
+	uint64_t MaxBacklog;
+	uint64_t Writes;
+	uint64_t BytesWritten;
+	uint64_t Rollovers;
+	uint64_t RolloverNS;
+	uint64_t WriteLatency[SharedStats::NumLatencyBuckets];
+
+	void Read(const SharedControl* c)
+	{
+		const SharedStats& s = c->Stats;
+		Time                 = MonotonicNanoseconds();
+		Messages             = c->CommittedSeq.load(std::memory_order_relaxed);
+		Bytes                = c->BytesProduced.load(std::memory_order_relaxed);
+		Dropped              = c->Dropped.load(std::memory_order_relaxed);
+		Stalls               = s.Stalls.load(std::memory_order_relaxed);
+		StallNS              = s.StallNS.load(std::memory_order_relaxed);
+		MaxBacklog           = s.MaxBacklog.load(std::memory_order_relaxed);
+		Writes               = s.Writes.load(std::memory_order_relaxed);
+		BytesWritten         = s.BytesWritten.load(std::memory_order_relaxed);
+		Rollovers            = s.Rollovers.load(std::memory_order_relaxed);
+		RolloverNS           = s.RolloverNS.load(std::memory_order_relaxed);
+		for (uint32_t i = 0; i < SharedStats::NumLatencyBuckets; i++)
+			WriteLatency[i] = s.WriteLatency[i].load(std::memory_order_relaxed);
+	}
+};
+
+// Returns the upper bound, in microseconds, of the bucket that holds the given fraction of the writes between a and b
+static uint64_t LatencyPercentile(const StatSample& a, const StatSample& b, double fraction)
+{
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < SharedStats::NumLatencyBuckets; i++)
+		total += b.WriteLatency[i] - a.WriteLatency[i];
+	if (total == 0)
+		return 0;
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < SharedStats::NumLatencyBuckets; i++)
+	{
+		seen += b.WriteLatency[i] - a.WriteLatency[i];
+		if (seen >= (uint64_t)(fraction * total))
+			return (uint64_t) 1 << i;
+	}
+	return (uint64_t) 1 << (SharedStats::NumLatencyBuckets - 1);
+}
+
+static bool IsProcessAlive(proc_id_t pid)
+{
+#ifdef _WIN32
+	HANDLE h = OpenProcess(SYNCHRONIZE, false, (DWORD) pid);
+	if (h == NULL)
+		return false;
+	bool alive = WaitForSingleObject(h, 0) == WAIT_TIMEOUT;
+	CloseHandle(h);
+	return alive;
+#else
+	return kill(pid, 0) == 0 || errno == EPERM;
+#endif
+}
+
+static void PrintHeader()
+{
+	printf("   msg/s    KB/s  dropped  stalls stall-ms backlog-KB writes/s wr-KB/s rollovers roll-ms p50-us p99-us\n");
+}
+
+static void PrintRates(const StatSample& a, const StatSample& b)
+{
+	double s = (b.Time - a.Time) / 1e9;
+	printf("%8.0f %7.0f %8llu %7llu %8.1f %10.0f %8.0f %7.0f %9llu %7.1f %6llu %6llu\n",
+	       (b.Messages - a.Messages) / s,
+	       (b.Bytes - a.Bytes) / 1024.0 / s,
+	       (unsigned long long) (b.Dropped - a.Dropped),
+	       (unsigned long long) (b.Stalls - a.Stalls),
+	       (b.StallNS - a.StallNS) / 1e6,
+	       b.MaxBacklog / 1024.0,
+	       (b.Writes - a.Writes) / s,
+	       (b.BytesWritten - a.BytesWritten) / 1024.0 / s,
+	       (unsigned long long) (b.Rollovers - a.Rollovers),
+	       (b.RolloverNS - a.RolloverNS) / 1e6,
+	       (unsigned long long) LatencyPercentile(a, b, 0.5),
+	       (unsigned long long) LatencyPercentile(a, b, 0.99));
+}
+
+void ShowHelp()
+{
+	auto help = R"(uberlog-stat prints live statistics of a process that is logging with uberlog.
+uberlog-stat <pid> <logfilename> [intervalms]
+The shared memory name is derived from the logging process's pid, and the full path of its log file.)";
+	printf("%s\n", help);
+}
+
+int Run(proc_id_t pid, const char* logFilename, uint32_t intervalMS)
+{
+	// The logger uses the full path of the log file, unless the file did not exist yet when the log was opened
+	shm_handle_t shm      = NullShmHandle;
+	void*        buf      = nullptr;
+	std::string  names[2] = {FullPath(logFilename), logFilename};
+	std::string  name;
+	for (const auto& n : names)
+	{
+		if (&n != &names[0] && n == names[0])
+			continue;
+		if (SetupSharedMemory(pid, n.c_str(), 0, SharedControlSize, false, shm, buf))
+		{
+			name = n;
+			break;
+		}
+	}
+	if (buf == nullptr)
+	{
+		fprintf(stderr, "Unable to attach to the log of process %u, writing to '%s'\n", (unsigned) pid, logFilename);
+		return 1;
+	}
+	char shmName[100];
+	SharedMemObjectName(pid, name.c_str(), 0, shmName);
+	printf("Attached to %s (process %u, log file '%s')\n", shmName, (unsigned) pid, name.c_str());
+
+	const SharedControl* control = (const SharedControl*) buf;
+	StatSample           prev;
+	StatSample           next;
+	prev.Read(control);
+	for (int line = 0; IsProcessAlive(pid); line++)
+	{
+		if (line % 20 == 0)
+			PrintHeader();
+		SleepMS(intervalMS);
+		next.Read(control);
+		PrintRates(prev, next);
+		fflush(stdout);
+		prev = next;
+	}
+	CloseSharedMemory(shm, buf, SharedControlSize);
+	return 0;
+}
+
+} // namespace internal
+} // namespace uberlog
+
+int main(int argc, char** argv)
+{
+	if (argc < 3 || argc > 4)
+	{
+		uberlog::internal::ShowHelp();
+		return 1;
+	}
+	uint32_t intervalMS = argc >= 4 ? (uint32_t) strtoul(argv[3], nullptr, 10) : 1000;
+	return uberlog::internal::Run((uberlog::internal::proc_id_t) strtoul(argv[1], nullptr, 10), argv[2], intervalMS == 0 ? 1000 : intervalMS);
+}
@@ -13,6 +13,7 @@
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
+#include <pthread.h>
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -20,16 +21,30 @@
 
 #ifdef __linux__
 #include <linux/unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <errno.h>
 #endif
 
 #ifdef __APPLE__
 #include <libproc.h>
 #endif
 
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define UBERLOG_HAVE_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#define UBERLOG_HAVE_TSC 1
+#endif
+
 #include <algorithm>
 #include <chrono>
+#include <memory>
 #include <assert.h>
 #include <string.h>
+#include <wchar.h>
 #include <stdint.h>
 #include <sys/timeb.h>
 
@@ -121,10 +136,10 @@ void SleepMS(uint32_t ms)
 {
 	Sleep((DWORD) ms);
 }
-bool SetupSharedMemory(proc_id_t parentID, const char* logFilename, size_t size, bool create, shm_handle_t& shmHandle, void*& shmBuf)
+bool SetupSharedMemory(proc_id_t parentID, const char* logFilename, uint32_t ringIndex, size_t size, bool create, shm_handle_t& shmHandle, void*& shmBuf)
 {
 	char shmName[100];
-	SharedMemObjectName(parentID, logFilename, shmName);
+	SharedMemObjectName(parentID, logFilename, ringIndex, shmName);
 	// The cast of 'size' up to 64-bits is only necessary on 32-bit platforms, but it is indeed necessary, at least on MSVC 2015 (undefined behaviour, specifically)
 	if (create)
 		shmHandle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t) size >> 32), (DWORD) size, shmName);
@@ -151,7 +166,7 @@ void CloseSharedMemory(shm_handle_t shmHandle, void* buf, size_t size)
 	UnmapViewOfFile(buf);
 	CloseHandle(shmHandle);
 }
-void DeleteSharedMemory(proc_id_t parentID, const char* logFilename)
+void DeleteSharedMemory(proc_id_t parentID, const char* logFilename, uint32_t ringIndex)
 {
 	// not necessary on Windows
 }
@@ -247,10 +262,10 @@ void SleepMS(uint32_t ms)
 	t.tv_sec  = (nanoseconds - t.tv_nsec) / 1000000000;
 	nanosleep(&t, nullptr);
 }
-bool SetupSharedMemory(proc_id_t parentID, const char* logFilename, size_t size, bool create, shm_handle_t& shmHandle, void*& shmBuf)
+bool SetupSharedMemory(proc_id_t parentID, const char* logFilename, uint32_t ringIndex, size_t size, bool create, shm_handle_t& shmHandle, void*& shmBuf)
 {
 	char shmName[100];
-	SharedMemObjectName(parentID, logFilename, shmName);
+	SharedMemObjectName(parentID, logFilename, ringIndex, shmName);
 	if (create)
 		shmHandle = shm_open(shmName, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
 	else
@@ -286,10 +301,10 @@ void CloseSharedMemory(shm_handle_t shmHandle, void* buf, size_t size)
 	munmap(buf, size);
 	close(shmHandle);
 }
-void DeleteSharedMemory(proc_id_t parentID, const char* logFilename)
+void DeleteSharedMemory(proc_id_t parentID, const char* logFilename, uint32_t ringIndex)
 {
 	char shmName[100];
-	SharedMemObjectName(parentID, logFilename, shmName);
+	SharedMemObjectName(parentID, logFilename, ringIndex, shmName);
 	shm_unlink(shmName);
 }
 UBERLOG_NORETURN void Panic(const char* msg)
@@ -301,12 +316,19 @@ UBERLOG_NORETURN void Panic(const char* msg)
 }
 #endif
 
-void SharedMemObjectName(proc_id_t parentID, const char* logFilename, char shmName[100])
+// ringIndex 0 is the primary shared memory segment. Per-thread rings are numbered from 1.
+void SharedMemObjectName(proc_id_t parentID, const char* logFilename, uint32_t ringIndex, char shmName[100])
 {
 	char key1[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
 	char key2[16] = {15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1};
 	memcpy(key1, &parentID, sizeof(parentID));
 	memcpy(key2, &parentID, sizeof(parentID));
+	if (ringIndex != 0)
+	{
+		// Mix the ring index into the key, rather than appending it to the name, because of PSHMNAMLEN on OSX
+		memcpy(key1 + 8, &ringIndex, sizeof(ringIndex));
+		memcpy(key2 + 8, &ringIndex, sizeof(ringIndex));
+	}
 	uint64_t h1 = siphash24(logFilename, strlen(logFilename), key1);
 	uint64_t h2 = siphash24(logFilename, strlen(logFilename), key2);
 #ifdef _WIN32
@@ -329,6 +351,79 @@ size_t SharedMemSizeFromRingSize(size_t ringBufferSize)
 	return shmSize;
 }
 
+uint64_t MonotonicNanoseconds()
+{
+	return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef __linux__
+bool FutexWait(std::atomic<uint32_t>* word, uint32_t expected, uint32_t milliseconds)
+{
+	timespec timeout;
+	timeout.tv_sec  = milliseconds / 1000;
+	timeout.tv_nsec = (long) (milliseconds % 1000) * 1000000;
+	return syscall(SYS_futex, (uint32_t*) word, FUTEX_WAIT, expected, &timeout, nullptr, 0) == 0 || errno != ETIMEDOUT;
+}
+
+void FutexWake(std::atomic<uint32_t>* word, int count)
+{
+	syscall(SYS_futex, (uint32_t*) word, FUTEX_WAKE, count, nullptr, nullptr, 0);
+}
+#else
+bool FutexWait(std::atomic<uint32_t>* word, uint32_t expected, uint32_t milliseconds)
+{
+	SleepMS(milliseconds);
+	return word->load() != expected;
+}
+
+void FutexWake(std::atomic<uint32_t>* word, int count)
+{
+}
+#endif
+
+// Every thread caches its ID, because on linux, fetching it is a syscall.
+// After fork(), the child's main thread has a new ID, so we bump ThreadIDGeneration to invalidate the caches.
+struct ThreadIDCache
+{
+	uint32_t Generation = 0;
+	uint32_t ID         = 0;
+	char     Hex[8];
+};
+
+static std::atomic<uint32_t>      ThreadIDGeneration(1);
+static thread_local ThreadIDCache MyThreadID;
+bool                              _Test_DisableThreadIDCache = false;
+
+#ifndef _WIN32
+static void OnForkChild()
+{
+	ThreadIDGeneration++;
+}
+static int RegisterForkHandler = pthread_atfork(nullptr, nullptr, OnForkChild);
+#endif
+
+static const ThreadIDCache& MyThreadIDCache()
+{
+	uint32_t generation = ThreadIDGeneration.load(std::memory_order_relaxed);
+	if (MyThreadID.Generation != generation || _Test_DisableThreadIDCache)
+	{
+		MyThreadID.ID = (uint32_t) GetMyTID();
+		TimeKeeper::FormatUintHex(8, MyThreadID.Hex, MyThreadID.ID);
+		MyThreadID.Generation = generation;
+	}
+	return MyThreadID;
+}
+
+const char* GetMyTIDHex()
+{
+	return MyThreadIDCache().Hex;
+}
+
+uint32_t GetMyTIDCached()
+{
+	return MyThreadIDCache().ID;
+}
+
 // Emit a warning message that is not going into the log - eg. a warning about failing to setup the log writer, etc.
 void OutOfBandWarning(_In_z_ _Printf_format_string_ const char* msg, ...)
 {
@@ -473,98 +568,156 @@ static size_t RoundUpToPowerOf2(size_t v)
 	return x;
 }
 
-void RingBuffer::Init(void* buf, size_t size, bool reset)
+void RingBuffer::Init(void* buf, size_t size, bool reset, RingLayout layout)
 {
 	if ((size & (size - 1)) != 0)
 		Panic("Ring Buffer size must be a power of 2");
-	Buf  = (uint8_t*) buf;
-	Size = size;
+	Buf    = (uint8_t*) buf;
+	Size   = size;
+	Layout = layout;
 	if (reset)
 	{
-		ReadPtr()->store(0);
-		WritePtr()->store(0);
+		memset(Buf + Size, 0, HeadSize);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
 	}
 }
 
 // If data is null, then the only thing we do here is increment the write pointer.
 void RingBuffer::Write(const void* data, size_t len)
 {
+	if (!CanWrite(len))
+		return Panic("attempt to write more than available bytes to ringbuffer");
+
+	size_t writep = WritePtr()->load(std::memory_order_relaxed);
 	if (data != nullptr)
-		WriteNoCommit(0, data, len);
-	size_t writep = WritePtr()->load();
-	WritePtr()->store((writep + len) & (Size - 1));
+		WriteAt(writep, data, len);
+	WritePtr()->store(writep + len, std::memory_order_release);
 }
 
-// Writes data, but does not alter WritePtr.
-// Used to implement writing out a message in more than one piece,
-// and atomically updating the write pointer at the end.
-// Data is written into the address WritePtr + offset.
-void RingBuffer::WriteNoCommit(size_t offset, const void* data, size_t len)
+// Find space for a record of len bytes, for a single producer. If the record would straddle the end of the ring,
+// then we first commit a skip record, which covers the rest of the ring, so that the record can start at the
+// beginning of the ring. Returns false if there is not enough space (yet).
+bool RingBuffer::PrepareWrite(size_t len, size_t& pos)
 {
-	if (AvailableForWrite() < len + offset)
-		return Panic("attempt to write more than available bytes to ringbuffer");
-
-	const uint8_t* data8 = (const uint8_t*) data;
-
-	size_t writep = (WritePtr()->load() + offset) & (Size - 1);
-	if (writep + len > Size)
+	size_t writep = WritePtr()->load(std::memory_order_relaxed);
+	size_t tail   = TailAt(writep);
+	if (tail < len)
 	{
-		// split
-		auto part1 = Size - writep;
-		memcpy(Buf + writep, data8, part1);
-		memcpy(Buf, data8 + part1, len - part1);
-	}
-	else
-	{
-		memcpy(Buf + writep, data8, len);
+		if (!CanWrite(tail))
+			return false;
+		WriteSkip(writep, tail);
+		Write(nullptr, tail);
+		writep += tail;
 	}
+	if (!CanWrite(len))
+		return false;
+	pos = writep;
+	return true;
 }
 
-size_t RingBuffer::Read(void* data, size_t max_len)
+// Claim len bytes for a single producer, out of many. The write pointer is advanced
+// immediately, so the caller must commit the region by some other means, after
+// it has written into it. If the region would straddle the end of the ring, then
+// we first claim the rest of the ring, and fill it with a skip record.
+bool RingBuffer::Reserve(size_t len, size_t& pos)
 {
-	uint8_t* data8 = (uint8_t*) data;
-	size_t   copy  = std::min((size_t) max_len, AvailableForRead());
-	size_t   readp = ReadPtr()->load();
-	if (data != nullptr)
+	// Load the read pointer before the write pointer, so that readp <= writep.
+	// A cached read pointer is older than the real one, so that holds for it too.
+	size_t readp  = Layout == RingLayout::V2 ? CachedReadPtr()->load(std::memory_order_acquire) : ReadPtr()->load(std::memory_order_acquire);
+	size_t writep = WritePtr()->load(std::memory_order_relaxed);
+	for (;;)
 	{
-		if (readp + copy > Size)
+		size_t claim = std::min(len, TailAt(writep));
+		if (writep - readp + claim > Size)
 		{
-			// split
-			auto part1 = Size - readp;
-			memcpy(data8, Buf + readp, part1);
-			memcpy(data8 + part1, Buf, copy - part1);
+			readp = ReadPtr()->load(std::memory_order_acquire);
+			if (Layout == RingLayout::V2)
+				CachedReadPtr()->store(readp, std::memory_order_release);
+			writep = WritePtr()->load(std::memory_order_relaxed);
+			claim  = std::min(len, TailAt(writep));
+			if (writep - readp + claim > Size)
+				return false;
 		}
-		else
+		// Acquire, so that we see the zeroing done by a producer that gave these bytes back in Unreserve
+		if (WritePtr()->compare_exchange_weak(writep, writep + claim, std::memory_order_acq_rel, std::memory_order_relaxed))
 		{
-			memcpy(data8, Buf + readp, copy);
+			if (claim == len)
+			{
+				pos = writep;
+				return true;
+			}
+			WriteSkip(writep, claim);
+			writep += claim;
 		}
 	}
-	ReadPtr()->store((readp + copy) & (Size - 1));
+}
+
+// Shrink the reservation [pos, pos + len) to [pos, pos + newLen), which is only possible if nobody
+// has reserved anything after it. Returns false if the reservation could not be shrunk.
+bool RingBuffer::Unreserve(size_t pos, size_t len, size_t newLen)
+{
+	size_t writep = pos + len;
+	// Release, so that the tail that our caller zeroed is visible to the next producer that reserves it
+	return WritePtr()->compare_exchange_strong(writep, pos + newLen, std::memory_order_release, std::memory_order_relaxed);
+}
+
+void RingBuffer::WriteSkip(size_t pos, size_t len)
+{
+	MessageHead head;
+	head.Cmd        = Command::Pad;
+	head.PayloadLen = (uint32_t) len;
+	WriteAt(pos + offsetof(MessageHead, PayloadLen), &head.PayloadLen, sizeof(head.PayloadLen));
+	((std::atomic<uint32_t>*) PtrAt(pos))->store(head.CommitWord(), std::memory_order_release);
+}
+
+// Regions never straddle the end of the ring, so ZeroAt, WriteAt and Read need only one memset or memcpy
+void RingBuffer::ZeroAt(size_t pos, size_t len)
+{
+	memset(PtrAt(pos), 0, len);
+}
+
+void RingBuffer::WriteAt(size_t pos, const void* data, size_t len)
+{
+	memcpy(PtrAt(pos), data, len);
+}
+
+size_t RingBuffer::Read(void* data, size_t max_len)
+{
+	size_t   copy  = CanRead(max_len) ? max_len : std::min((size_t) max_len, AvailableForRead());
+	size_t   readp = ReadPtr()->load(std::memory_order_relaxed);
+	uint8_t* src   = PtrAt(readp);
+	if (copy > TailAt(readp))
+		Panic("RingBuffer.Read may not straddle the end of the ring");
+	if (data != nullptr)
+		memcpy(data, src, copy);
+	memset(src, 0, copy);
+	ReadPtr()->store(readp + copy, std::memory_order_release);
 	return copy;
 }
 
-// Fetch one or two pointers into the ring buffer, which hold the location of the readable data.
-// Does not increment the read pointer. You must call Read(null, len) once you've copied the
-// data out of the ring buffer.
-void RingBuffer::ReadNoCopy(size_t len, void*& ptr1, size_t& ptr1_size, void*& ptr2, size_t& ptr2_size) const
+void RingBuffer::Release()
 {
-	if (len > AvailableForRead())
-		Panic("ReadPointers attempted to read more than available bytes");
+	ReleaseTo(ReadCursor());
+}
 
-	size_t pos1 = ReadPtr()->load();
-	ptr1        = Buf + pos1;
-	if (pos1 + len <= Size)
-	{
-		ptr1_size = len;
-		ptr2      = nullptr;
-		ptr2_size = 0;
-	}
-	else
-	{
-		ptr1_size = Size - pos1;
-		ptr2      = Buf;
-		ptr2_size = len - ptr1_size;
-	}
+void RingBuffer::ReleaseTo(size_t pos)
+{
+	size_t readp = ReadPtr()->load(std::memory_order_relaxed);
+	size_t len   = pos - readp;
+	if (len == 0)
+		return;
+	if (len > Held)
+		Panic("ring.ReleaseTo: position is beyond the held bytes");
+	size_t part1 = std::min(len, TailAt(readp));
+	memset(PtrAt(readp), 0, part1);
+	memset(Buf, 0, len - part1);
+	ReadPtr()->store(pos, std::memory_order_release);
+	Held -= len;
+}
+
+size_t RingBuffer::ReadCursor() const
+{
+	return ReadPtr()->load(std::memory_order_relaxed) + Held;
 }
 
 std::atomic<size_t>* RingBuffer::ReadPtr() const
@@ -573,22 +726,75 @@ std::atomic<size_t>* RingBuffer::ReadPtr() const
 }
 
 std::atomic<size_t>* RingBuffer::WritePtr() const
+{
+	return (std::atomic<size_t>*) (Buf + Size + (Layout == RingLayout::V2 ? CacheLineSize : sizeof(size_t)));
+}
+
+std::atomic<size_t>* RingBuffer::CachedWritePtr() const
 {
 	return (std::atomic<size_t>*) (Buf + Size + sizeof(size_t));
 }
 
+std::atomic<size_t>* RingBuffer::CachedReadPtr() const
+{
+	return (std::atomic<size_t>*) (Buf + Size + CacheLineSize + sizeof(size_t));
+}
+
+std::atomic<uint32_t>* RingBuffer::ReadPtrWord() const
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return (std::atomic<uint32_t>*) (Buf + Size + sizeof(size_t) - sizeof(uint32_t));
+#else
+	return (std::atomic<uint32_t>*) (Buf + Size);
+#endif
+}
+
+std::atomic<uint32_t>* RingBuffer::Waiters() const
+{
+	return (std::atomic<uint32_t>*) (Buf + Size + (Layout == RingLayout::V2 ? 2 * CacheLineSize : 2 * sizeof(size_t)));
+}
+
 size_t RingBuffer::AvailableForRead() const
 {
-	size_t readp  = ReadPtr()->load();
-	size_t writep = WritePtr()->load();
-	return (writep - readp) & (Size - 1);
+	size_t readp  = ReadPtr()->load(std::memory_order_acquire);
+	size_t writep = WritePtr()->load(std::memory_order_acquire);
+	return writep - readp;
 }
 
 size_t RingBuffer::AvailableForWrite() const
 {
-	return Size - 1 - AvailableForRead();
+	return Size - AvailableForRead();
 }
 
+bool RingBuffer::CanRead(size_t len) const
+{
+	size_t readp = ReadCursor();
+	if (Layout == RingLayout::V1)
+		return WritePtr()->load() - readp >= len;
+
+	// Skipping a Pad record can take the read cursor past our cached write pointer
+	size_t cached = CachedWritePtr()->load(std::memory_order_relaxed);
+	if (cached >= readp && cached - readp >= len)
+		return true;
+	size_t writep = WritePtr()->load(std::memory_order_acquire);
+	CachedWritePtr()->store(writep, std::memory_order_relaxed);
+	return writep - readp >= len;
+}
+
+bool RingBuffer::CanWrite(size_t len) const
+{
+	size_t writep = WritePtr()->load(std::memory_order_relaxed);
+	if (Layout == RingLayout::V1)
+		return writep - ReadPtr()->load() + len <= Size;
+
+	if (writep - CachedReadPtr()->load(std::memory_order_acquire) + len <= Size)
+		return true;
+	size_t readp = ReadPtr()->load(std::memory_order_acquire);
+	CachedReadPtr()->store(readp, std::memory_order_release);
+	return writep - readp + len <= Size;
+}
+
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 TimeKeeper::TimeKeeper()
@@ -607,76 +813,210 @@ TimeKeeper::TimeKeeper()
 	TimezoneMinutes    = timezone / 60; // The global libc variable 'timezone' is set by tzset(), and is seconds west of UTC.
 #endif
 
-	LocalDayStartSeconds = 0;
+	Version      = 0;
+	CachedSecond = 0;
+	for (auto& w : Cached)
+		w = 0;
+	ClockVersion  = 0;
+	AnchorTSC     = 0;
+	AnchorNS      = 0;
+	NSPerTick     = 0;
+	ReanchorTicks = 0;
+
+	SetFormat(TimeFormat::LocalMilli);
+}
+
+void TimeKeeper::SetFormat(TimeFormat format)
+{
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		bool                        utc = format == TimeFormat::UTCMilli || format == TimeFormat::UTCMicro || format == TimeFormat::UTCNano;
+
+		Layout.IsEpoch = format == TimeFormat::EpochNano;
+		switch (format)
+		{
+		case TimeFormat::LocalMicro:
+		case TimeFormat::UTCMicro:
+			Layout.FracDigits = 6;
+			break;
+		case TimeFormat::LocalNano:
+		case TimeFormat::UTCNano:
+			Layout.FracDigits = 9;
+			break;
+		default:
+			Layout.FracDigits = 3;
+			break;
+		}
+
+		// cache time zone
+		OffsetMinutes = utc ? 0 : TimezoneMinutes;
+		if (utc)
+		{
+			strcpy(TimeZoneStr, "Z");
+		}
+		else
+		{
+			uint32_t tzhour = abs(TimezoneMinutes) / 60;
+			uint32_t tzmin  = abs(TimezoneMinutes) % 60;
+			snprintf(TimeZoneStr, 6, "%c%02u%02u", TimezoneMinutes <= 0 ? '+' : '-', tzhour, tzmin);
+		}
+		Layout.Len = Layout.IsEpoch ? 19 : (uint8_t)(20 + Layout.FracDigits + strlen(TimeZoneStr));
 
-	// cache time zone
-	uint32_t tzhour = abs(TimezoneMinutes) / 60;
-	uint32_t tzmin  = abs(TimezoneMinutes) % 60;
-	snprintf(TimeZoneStr, 6, "%c%02u%02u", TimezoneMinutes <= 0 ? '+' : '-', tzhour, tzmin);
+		// The cached second and day were in the old time zone
+		char zero[MaxLen] = {0};
+		LocalDayStartSeconds = 0;
+		PublishCache(0, zero);
+	}
 
-	NewDay();
+	char buf[MaxLen];
+	Format(buf);
 }
 
 void TimeKeeper::Format(char* buf) const
 {
-	uint64_t seconds;
-	uint32_t nano;
-	UnixTimeNow(seconds, nano);
+	FormatAt(Now(), buf);
+}
+
+void TimeKeeper::FormatAt(uint64_t unixNS, char* buf) const
+{
+	if (Layout.IsEpoch)
+	{
+		// 10 digits of seconds are enough until the year 2286. They don't fit into 32 bits after 2106, so we format them in two halves.
+		uint64_t seconds = unixNS / 1000000000;
+		FormatUintDecimal(5, buf, (uint32_t)(seconds / 100000 % 100000));
+		FormatUintDecimal(5, buf + 5, (uint32_t)(seconds % 100000));
+		FormatUintDecimal(9, buf + 10, (uint32_t)(unixNS % 1000000000));
+		return;
+	}
+
+	uint64_t seconds = unixNS / 1000000000 - OffsetMinutes * 60;
+	uint32_t nano    = (uint32_t)(unixNS % 1000000000);
 
-	if (seconds - LocalDayStartSeconds.load() >= 86400)
-		NewDay();
+	if (!ReadCache(seconds, buf))
+		NewSecond(seconds, buf);
 
-	uint32_t dsec = (uint32_t)(seconds - LocalDayStartSeconds.load());
-	uint32_t hour = 0;
-	while (dsec >= 3600)
+	// Constant divisors let the compiler turn the divisions into multiplications
+	switch (Layout.FracDigits)
 	{
-		hour++;
-		dsec -= 3600;
+	case 3: FormatUintDecimal(3, buf + 20, nano / 1000000); break;
+	case 6: FormatUintDecimal(6, buf + 20, nano / 1000); break;
+	default: FormatUintDecimal(9, buf + 20, nano); break;
 	}
+}
+
+uint64_t TimeKeeper::Now() const
+{
+	uint64_t ns;
+	bool     stale = false;
+	if (TSCTimeNS(ns, stale))
+	{
+		// Carry on extrapolating from the old anchor, so that our time stamps don't go back by the error of the old rate
+		if (stale)
+			TryReanchor();
+		return ns;
+	}
+	if (NSPerTick.load(std::memory_order_relaxed) != 0)
+		TryReanchor();
+	return SystemTimeNS();
+}
+
+// Copy the cached time stamp into buf, if it is for the given second.
+// Returns false if the cache holds a different second, or if it is being rewritten.
+bool TimeKeeper::ReadCache(uint64_t seconds, char* buf) const
+{
+	uint32_t version = Version.load(std::memory_order_acquire);
+	if ((version & 1) != 0 || CachedSecond.load(std::memory_order_relaxed) != seconds)
+		return false;
+
+	uint64_t words[5];
+	for (int i = 0; i < 5; i++)
+		words[i] = Cached[i].load(std::memory_order_relaxed);
+
+	// Order the loads of the cache before the second load of Version
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (Version.load(std::memory_order_relaxed) != version)
+		return false;
+
+	memcpy(buf, words, Layout.Len);
+	return true;
+}
+
+// Build the time stamp for the given second into buf, and publish it to the cache
+void TimeKeeper::NewSecond(uint64_t seconds, char* buf) const
+{
+	TimeKeeper&                 mutableThis = const_cast<TimeKeeper&>(*this);
+	std::lock_guard<std::mutex> guard(mutableThis.Lock);
 
-	uint32_t minute = 0;
-	while (dsec >= 60)
+	// We are the only writer, so we can read the cache directly. Another thread may have just refreshed it.
+	uint64_t cached = CachedSecond.load(std::memory_order_relaxed);
+	if (cached == seconds)
 	{
-		minute++;
-		dsec -= 60;
+		uint64_t words[5];
+		for (int i = 0; i < 5; i++)
+			words[i] = Cached[i].load(std::memory_order_relaxed);
+		memcpy(buf, words, Layout.Len);
+		return;
 	}
 
-	uint32_t milli = nano / 1000000;
+	mutableThis.BuildPrefix(seconds, buf);
+
+	// A thread that read the clock just before the second ticked over must not drag the cache
+	// back by a second. A clock that was stepped backwards does move the cache back.
+	if (seconds + 1 == cached)
+		return;
+
+	mutableThis.PublishCache(seconds, buf);
+}
+
+// Store the time stamp in buf as the cached time stamp of the given second. Lock must be held.
+void TimeKeeper::PublishCache(uint64_t seconds, const char* buf)
+{
+	uint64_t words[5] = {0};
+	memcpy(words, buf, Layout.Len);
+	uint32_t version = Version.load(std::memory_order_relaxed);
+	Version.store(version + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	for (int i = 0; i < 5; i++)
+		Cached[i].store(words[i], std::memory_order_relaxed);
+	CachedSecond.store(seconds, std::memory_order_relaxed);
+	Version.store(version + 2, std::memory_order_release);
+}
+
+// Write the time stamp for the given second into buf, with a zero fraction. Lock must be held.
+void TimeKeeper::BuildPrefix(uint64_t seconds, char* buf)
+{
+	if (seconds - LocalDayStartSeconds >= 86400)
+		NewDay(seconds);
 
+	uint32_t dsec = (uint32_t)(seconds - LocalDayStartSeconds);
 	memcpy(buf, DateStr, 10);
-	FormatUintDecimal(2, buf + 11, hour);
-	FormatUintDecimal(2, buf + 14, minute);
-	FormatUintDecimal(2, buf + 17, dsec);
-	FormatUintDecimal(3, buf + 20, milli);
+	FormatUintDecimal(2, buf + 11, dsec / 3600);
+	FormatUintDecimal(2, buf + 14, dsec / 60 % 60);
+	FormatUintDecimal(2, buf + 17, dsec % 60);
+	memset(buf + 20, '0', Layout.FracDigits);
 	buf[10] = 'T';
 	buf[13] = ':';
 	buf[16] = ':';
 	buf[19] = '.';
-	memcpy(buf + 23, TimeZoneStr, 5);
+	memcpy(buf + 20 + Layout.FracDigits, TimeZoneStr, Layout.Len - 20 - Layout.FracDigits);
 }
 
-void TimeKeeper::NewDay() const
+// Compute the calendar day of the given second. Lock must be held.
+void TimeKeeper::NewDay(uint64_t seconds)
 {
-	TimeKeeper&                 mutableThis = const_cast<TimeKeeper&>(*this);
-	std::lock_guard<std::mutex> guard(mutableThis.Lock);
-	uint64_t                    seconds;
-	uint32_t                    nano;
-	UnixTimeNow(seconds, nano);
-	tm t2;
+	tm     t2;
+	time_t tmp = (time_t) seconds;
 #ifdef _WIN32
-	time_t tmp = seconds;
 	gmtime_s(&t2, &tmp);
 #else
-	struct timespec tp = {0};
-	tp.tv_sec          = seconds;
-	tp.tv_nsec         = nano;
-	gmtime_r(&tp.tv_sec, &t2);
+	gmtime_r(&tmp, &t2);
 #endif
-	mutableThis.LocalDayStartSeconds.store(seconds - (t2.tm_hour * 3600 + t2.tm_min * 60 + t2.tm_sec));
-	strftime(mutableThis.DateStr, 11, "%Y-%m-%d", &t2);
+	LocalDayStartSeconds = seconds - (t2.tm_hour * 3600 + t2.tm_min * 60 + t2.tm_sec);
+	strftime(DateStr, 11, "%Y-%m-%d", &t2);
 }
 
-void TimeKeeper::UnixTimeNow(uint64_t& seconds, uint32_t& nano) const
+// Unix time in nanoseconds, from the system clock
+uint64_t TimeKeeper::SystemTimeNS() const
 {
 #ifdef _WIN32
 	FILETIME ft;
@@ -686,15 +1026,172 @@ void TimeKeeper::UnixTimeNow(uint64_t& seconds, uint32_t& nano) const
 		GetSystemTimeAsFileTime(&ft);
 	uint64_t raw             = (uint64_t) ft.dwHighDateTime << 32 | (uint64_t) ft.dwLowDateTime;
 	uint64_t unix_time_100ns = raw - (370 * 365 - 276) * (uint64_t) 86400 * (uint64_t) 10000000;
-	seconds                  = unix_time_100ns / 10000000;
-	nano                     = (unix_time_100ns % 10000000) * 100;
+	return unix_time_100ns * 100;
 #else
 	struct timespec tp;
 	clock_gettime(CLOCK_REALTIME, &tp);
-	seconds = tp.tv_sec;
-	nano    = tp.tv_nsec;
+	return (uint64_t) tp.tv_sec * 1000000000 + tp.tv_nsec;
+#endif
+}
+
+// Unix time in nanoseconds, extrapolated from the last TSC anchor. Returns false if the TSC is not in use,
+// or if the anchor is too old to extrapolate from. Sets stale if the anchor is more than a second old, in which
+// case the time is still good, but the TSC should be anchored again.
+bool TimeKeeper::TSCTimeNS(uint64_t& ns, bool& stale) const
+{
+#ifdef UBERLOG_HAVE_TSC
+	uint32_t version;
+	uint64_t mult, anchorTSC, anchorNS, reanchorTicks;
+	do
+	{
+		version       = ClockVersion.load(std::memory_order_acquire);
+		mult          = NSPerTick.load(std::memory_order_relaxed);
+		anchorTSC     = AnchorTSC.load(std::memory_order_relaxed);
+		anchorNS      = AnchorNS.load(std::memory_order_relaxed);
+		reanchorTicks = ReanchorTicks.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while ((version & 1) != 0 || ClockVersion.load(std::memory_order_relaxed) != version);
+	if (mult == 0)
+		return false;
+
+	uint64_t delta = ReadTSC() - anchorTSC;
+	if (delta > MaxTSCDelta)
+		return false;
+	stale = delta > reanchorTicks;
+	ns    = anchorNS + ((delta * mult) >> TSCShift);
+	return true;
+#else
+	return false;
+#endif
+}
+
+uint64_t TimeKeeper::ReadTSC()
+{
+#ifdef UBERLOG_HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+// An invariant TSC ticks at a constant rate, regardless of frequency scaling and sleep states,
+// and is synchronized between cores. This is CPUID leaf 0x80000007, EDX bit 8, on both Intel and AMD.
+bool TimeKeeper::HaveInvariantTSC()
+{
+#if defined(UBERLOG_HAVE_TSC) && defined(_MSC_VER)
+	int regs[4];
+	__cpuid(regs, 0x80000000);
+	if ((uint32_t) regs[0] < 0x80000007)
+		return false;
+	__cpuid(regs, 0x80000007);
+	return (regs[3] & (1 << 8)) != 0;
+#elif defined(UBERLOG_HAVE_TSC)
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	if (__get_cpuid_max(0x80000000, nullptr) < 0x80000007)
+		return false;
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+	return (edx & (1 << 8)) != 0;
+#else
+	return false;
 #endif
-	seconds -= TimezoneMinutes * 60;
+}
+
+bool TimeKeeper::SetClockSource(ClockSource source)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	if (source == ClockSource::System || !HaveInvariantTSC())
+	{
+		PublishAnchor(0, 0, 0);
+		return source == ClockSource::System;
+	}
+
+	// Measure the TSC against the system clock over a short interval. Reanchor refines this over longer intervals.
+	uint64_t tsc1, ns1, tsc2, ns2;
+	ReadClockPair(tsc1, ns1);
+	SleepMS(TSCCalibrateMS);
+	ReadClockPair(tsc2, ns2);
+	if (tsc2 <= tsc1 || ns2 <= ns1)
+	{
+		PublishAnchor(0, 0, 0);
+		return false;
+	}
+	BaselineTSC = tsc2;
+	BaselineNS  = ns2;
+	PublishAnchor(tsc2, ns2, (uint64_t)((double)(ns2 - ns1) / (double)(tsc2 - tsc1) * (double)(1 << TSCShift)));
+	return true;
+}
+
+// Read the system clock, along with the TSC at the same moment, which we take to be halfway between a TSC read on
+// either side of the clock read
+void TimeKeeper::ReadClockPair(uint64_t& tsc, uint64_t& ns) const
+{
+	uint64_t before = ReadTSC();
+	ns              = SystemTimeNS();
+	uint64_t after  = ReadTSC();
+	tsc             = before + (after - before) / 2;
+}
+
+ClockSource TimeKeeper::GetClockSource() const
+{
+	return NSPerTick.load(std::memory_order_relaxed) != 0 ? ClockSource::TSC : ClockSource::System;
+}
+
+// Called by a thread that found the anchor to be stale. The first such thread anchors the TSC again, and the others carry on.
+void TimeKeeper::TryReanchor() const
+{
+	TimeKeeper&                  mutableThis = const_cast<TimeKeeper&>(*this);
+	std::unique_lock<std::mutex> lock(mutableThis.Lock, std::try_to_lock);
+	if (lock.owns_lock() && NSPerTick.load(std::memory_order_relaxed) != 0 && ReadTSC() - AnchorTSC.load(std::memory_order_relaxed) > ReanchorTicks.load(std::memory_order_relaxed))
+		mutableThis.Reanchor();
+}
+
+// Anchor the TSC to the system clock again, so that errors in our estimate of the TSC rate don't accumulate.
+// The rate is recomputed over the time since BaselineTSC, which makes it more accurate the longer we run. Lock must be held.
+void TimeKeeper::Reanchor()
+{
+	uint64_t oldMult = NSPerTick.load(std::memory_order_relaxed);
+	uint64_t oldTSC  = AnchorTSC.load(std::memory_order_relaxed);
+	uint64_t oldNS   = AnchorNS.load(std::memory_order_relaxed);
+	uint64_t tsc, ns;
+	ReadClockPair(tsc, ns);
+
+	// If the system clock has moved further from our prediction than an error in the old rate can explain, then it was
+	// stepped, so start a new baseline. Otherwise, the rate over the whole baseline is better than the old one, however
+	// much they differ, because the old one may only have come from the short initial calibration.
+	double   elapsed = (double) (tsc - oldTSC) * (double) oldMult / (double) (1 << TSCShift);
+	double   error   = (double) ns - ((double) oldNS + elapsed);
+	double   limit   = elapsed / 100 + 1000000;
+	uint64_t mult    = oldMult;
+	if (error > limit || error < -limit || tsc <= BaselineTSC || ns <= BaselineNS)
+	{
+		BaselineTSC = tsc;
+		BaselineNS  = ns;
+	}
+	else
+	{
+		mult = (uint64_t)((double)(ns - BaselineNS) / (double)(tsc - BaselineTSC) * (double)(1 << TSCShift));
+	}
+
+	// Don't let time go backwards by a little bit, because the old rate ran fast. Steps of the system clock are followed.
+	if (tsc - oldTSC <= MaxTSCDelta)
+	{
+		uint64_t predicted = oldNS + (((tsc - oldTSC) * oldMult) >> TSCShift);
+		if (predicted > ns && predicted - ns < 1000000)
+			ns = predicted;
+	}
+	PublishAnchor(tsc, ns, mult);
+}
+
+void TimeKeeper::PublishAnchor(uint64_t tsc, uint64_t ns, uint64_t mult)
+{
+	uint32_t version = ClockVersion.load(std::memory_order_relaxed);
+	ClockVersion.store(version + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	AnchorTSC.store(tsc, std::memory_order_relaxed);
+	AnchorNS.store(ns, std::memory_order_relaxed);
+	NSPerTick.store(mult, std::memory_order_relaxed);
+	ReanchorTicks.store(mult != 0 ? std::min(((uint64_t) 1000000000 << TSCShift) / mult, (uint64_t) MaxTSCDelta) : 0, std::memory_order_relaxed);
+	ClockVersion.store(version + 2, std::memory_order_release);
 }
 
 void TimeKeeper::FormatUintDecimal(uint32_t ndigit, char* buf, uint32_t v)
@@ -715,6 +1212,30 @@ void TimeKeeper::FormatUintHex(uint32_t ndigit, char* buf, uint32_t v)
 	}
 }
 
+size_t FormatLinePrefix(char* buf, const TimeKeeper& tk, uint64_t unixNS, char levelChar, const char* tidHex, bool includeDate)
+{
+	if (includeDate)
+	{
+		size_t n = tk.Len();
+		tk.FormatAt(unixNS, buf);
+		buf[n]      = ' ';
+		buf[n + 1]  = '[';
+		buf[n + 2]  = levelChar;
+		buf[n + 3]  = ']';
+		buf[n + 4]  = ' ';
+		memcpy(buf + n + 5, tidHex, 8);
+		buf[n + 13] = ' ';
+		return n + 14;
+	}
+	buf[0] = '[';
+	buf[1] = levelChar;
+	buf[2] = ']';
+	buf[3] = ' ';
+	memcpy(buf + 4, tidHex, 8);
+	buf[12] = ' ';
+	return 13;
+}
+
 } // namespace internal
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -749,12 +1270,29 @@ UBERLOG_API Level ParseLevel(const char* level)
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Every Logger caches the ring of the calling thread, so that the common case doesn't need to take Lock.
+// Entries are keyed by Logger::InstanceID, which is unique for every Open(), so a stale entry can never match.
+struct ThreadRingCacheEntry
+{
+	uint64_t    LoggerInstance;
+	ThreadRing* Ring;
+};
+
+static const int                         ThreadRingCacheSize = 4;
+static thread_local ThreadRingCacheEntry ThreadRingCache[ThreadRingCacheSize];
+static std::atomic<uint64_t>             NextLoggerInstanceID(1);
+
 Logger::Logger()
 {
 	LoggerPath  = "uberlogger";
 	Level       = uberlog::Level::Info;
 	TeeStdOut   = false;
 	IncludeDate = true;
+	IsOpen      = false;
+	InstanceID  = 0;
+	SpillActive = false;
+	for (uint32_t i = 0; i < NumProducerCounts; i++)
+		Producers[i].N = 0;
 }
 
 Logger::~Logger()
@@ -777,6 +1315,7 @@ void Logger::Open(const char* filename)
 void Logger::OpenStdOut()
 {
 	std::lock_guard<std::mutex> guard(Lock);
+	TK.SetFormat(TimeFmt);
 	IsStdOutMode = true;
 	IsOpen       = true;
 	StdOutFD     = fileno(stdout);
@@ -784,15 +1323,25 @@ void Logger::OpenStdOut()
 
 void Logger::Close()
 {
-	std::lock_guard<std::mutex> guard(Lock);
-	if (!IsOpen)
-		return;
-	if (IsStdOutMode)
+	// This must happen before we take the lock, because the spill thread may need it
+	StopSpill();
+
 	{
+		std::lock_guard<std::mutex> guard(Lock);
+		if (!IsOpen)
+			return;
+		// From here on, producers are turned away
 		IsOpen = false;
-		return;
+		if (IsStdOutMode)
+			return;
 	}
 
+	// Other threads may still be writing into the ring. We don't hold Lock while we wait for them, because a
+	// producer may need it, for example to create its thread's ring.
+	WaitForProducers();
+
+	std::lock_guard<std::mutex> guard(Lock);
+
 	// Always wait 10 seconds for our child to exit.
 	// Waiting is nice behaviour, because the caller knows that he can manipulate the log file after Close() returns.
 	uint32_t timeout = 10000;
@@ -804,7 +1353,6 @@ void Logger::Close()
 	ChildPID      = -1;
 
 	CloseRingBuffer();
-	IsOpen = false;
 }
 
 void Logger::SetLoggerProgramPath(const char* uberloggerFilename)
@@ -823,48 +1371,170 @@ void Logger::SetRingBufferSize(size_t ringBufferSize)
 	RingBufferSize = RoundUpToPowerOf2(ringBufferSize);
 }
 
-void Logger::SetArchiveSettings(int64_t maxFileSize, int32_t maxNumArchives)
+void Logger::SetProducerMode(ProducerMode mode)
 {
 	std::lock_guard<std::mutex> guard(Lock);
 	if (IsOpen)
 	{
-		OutOfBandWarning("Logger.SetArchiveSettings must be called before Open\n");
+		OutOfBandWarning("Logger.SetProducerMode must be called before Open\n");
 		return;
 	}
-	MaxFileSize    = maxFileSize;
-	MaxNumArchives = maxNumArchives;
+	Mode = mode;
 }
 
-void Logger::SetLevel(uberlog::Level level)
+void Logger::SetOverflowPolicy(OverflowPolicy policy, size_t spillLimit)
 {
 	std::lock_guard<std::mutex> guard(Lock);
-	Level = level;
-}
-
-void Logger::SetLevel(const char* level)
-{
-	SetLevel(ParseLevel(level));
+	if (IsOpen)
+	{
+		OutOfBandWarning("Logger.SetOverflowPolicy must be called before Open\n");
+		return;
+	}
+	Overflow   = policy;
+	SpillLimit = spillLimit;
 }
 
-void Logger::LogRaw(const void* data, size_t len) const
+void Logger::SetSyncPolicy(SyncPolicy policy, uint32_t intervalMS, uint64_t intervalBytes)
 {
-	Logger&                     mutableThis = const_cast<Logger&>(*this);
-	std::lock_guard<std::mutex> guard(mutableThis.Lock);
-	if (!IsOpen)
+	std::lock_guard<std::mutex> guard(Lock);
+	if (IsOpen)
 	{
-		OutOfBandWarning("Logger.LogRaw called but log is not open\n");
+		OutOfBandWarning("Logger.SetSyncPolicy must be called before Open\n");
 		return;
 	}
-	if (IsStdOutMode)
+	Sync              = policy;
+	SyncIntervalMS    = intervalMS;
+	SyncIntervalBytes = intervalBytes;
+}
+
+void Logger::SetDropPageCache(bool drop)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	if (IsOpen)
 	{
-		if (StdOutFD >= 0)
-			write(StdOutFD, data, (unsigned) len);
+		OutOfBandWarning("Logger.SetDropPageCache must be called before Open\n");
 		return;
 	}
-	if (TeeStdOut && StdOutFD >= 0)
-		write(StdOutFD, data, (unsigned) len);
+	DropPageCache = drop;
+}
 
-	size_t maxLen = Ring.MaxAvailableForWrite() - sizeof(MessageHead);
+void Logger::SetTimeFormat(TimeFormat format)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	if (IsOpen)
+	{
+		OutOfBandWarning("Logger.SetTimeFormat must be called before Open\n");
+		return;
+	}
+	TimeFmt = format;
+}
+
+void Logger::SetDeferredPrefix(bool deferred)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	if (IsOpen)
+	{
+		OutOfBandWarning("Logger.SetDeferredPrefix must be called before Open\n");
+		return;
+	}
+	DeferredPrefix = deferred;
+}
+
+void Logger::SetDeferredFormatting(bool deferred)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	if (IsOpen)
+	{
+		OutOfBandWarning("Logger.SetDeferredFormatting must be called before Open\n");
+		return;
+	}
+	Deferred = deferred;
+}
+
+void Logger::SetArchiveSettings(int64_t maxFileSize, int32_t maxNumArchives, int64_t maxArchiveBytes, int64_t maxArchiveAgeSeconds)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	if (IsOpen)
+	{
+		OutOfBandWarning("Logger.SetArchiveSettings must be called before Open\n");
+		return;
+	}
+	MaxFileSize          = maxFileSize;
+	MaxNumArchives       = maxNumArchives;
+	MaxArchiveBytes      = maxArchiveBytes;
+	MaxArchiveAgeSeconds = maxArchiveAgeSeconds;
+}
+
+void Logger::SetWriteBufferSize(size_t writeBufferSize)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	if (IsOpen)
+	{
+		OutOfBandWarning("Logger.SetWriteBufferSize must be called before Open\n");
+		return;
+	}
+	WriteBufferSize = writeBufferSize;
+}
+
+void Logger::SetWriteQueueDepth(uint32_t depth)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	if (IsOpen)
+	{
+		OutOfBandWarning("Logger.SetWriteQueueDepth must be called before Open\n");
+		return;
+	}
+	WriteQueueDepth = depth;
+}
+
+void Logger::SetClockSource(ClockSource source)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	if (IsOpen)
+	{
+		OutOfBandWarning("Logger.SetClockSource must be called before Open\n");
+		return;
+	}
+	TK.SetClockSource(source);
+}
+
+void Logger::SetPreallocate(bool preallocate)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	if (IsOpen)
+	{
+		OutOfBandWarning("Logger.SetPreallocate must be called before Open\n");
+		return;
+	}
+	Preallocate = preallocate;
+}
+
+void Logger::SetLevel(uberlog::Level level)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	Level = level;
+}
+
+void Logger::SetLevel(const char* level)
+{
+	SetLevel(ParseLevel(level));
+}
+
+void Logger::LogRaw(const void* data, size_t len) const
+{
+	LogRawAtLevel(data, len, uberlog::Level::Info);
+}
+
+void Logger::LogRawAtLevel(const void* data, size_t len, uberlog::Level level) const
+{
+	if (IsOpen && IsStdOutMode)
+	{
+		if (StdOutFD >= 0)
+			write(StdOutFD, data, (unsigned) len);
+		return;
+	}
+
+	size_t maxLen = Ring.MaxAvailableForWrite() - MessageHeadSize(StampMessages());
 
 	if (len > maxLen)
 	{
@@ -872,10 +1542,285 @@ void Logger::LogRaw(const void* data, size_t len) const
 		len = maxLen;
 	}
 
-	bool wasFalse     = false;
-	bool firstMessage = mutableThis.IsFirstLogMessage.compare_exchange_strong(wasFalse, true);
+	Reservation r;
+	if (!ReserveSpace(len, r, true, level))
+	{
+		WarnIfNotOpen("LogRaw");
+		return;
+	}
+	r.Write(0, data, len);
+	Commit(r, len);
+}
+
+void Reservation::Write(size_t offset, const void* data, size_t len)
+{
+	if (offset + len > Len)
+		Panic("Reservation.Write out of bounds");
+	memcpy(Ptr + offset, data, len);
+}
+
+bool Logger::Reserve(size_t len, Reservation& r) const
+{
+	return ReserveSpace(len, r, true, uberlog::Level::Info);
+}
 
-	mutableThis.SendMessage(Command::LogMsg, data, len);
+bool Logger::TryReserve(size_t len, Reservation& r) const
+{
+	return ReserveSpace(len, r, false, uberlog::Level::Info);
+}
+
+// If wait is false, then this is TryReserve. Otherwise, what happens when the ring is full depends on Overflow.
+bool Logger::ReserveSpace(size_t len, Reservation& r, bool wait, uberlog::Level level) const
+{
+	uint32_t slot = 0;
+	if (IsStdOutMode || !EnterProducer(slot))
+		return false;
+	if (!ReserveRegion(len, r, wait, level))
+	{
+		LeaveProducer(slot);
+		return false;
+	}
+	r.Slot = (uint8_t) slot;
+	return true;
+}
+
+// Called when ReserveSpace fails. If the log is open, then the message was dropped because of our OverflowPolicy,
+// which is not worth a warning. entryPoint is the public function that the user called.
+void Logger::WarnIfNotOpen(const char* entryPoint) const
+{
+	if (!IsOpen)
+		OutOfBandWarning("Logger.%s called but log is not open\n", entryPoint);
+}
+
+// Count the calling thread as a producer, so that Close waits for it. Returns false if the logger is not open.
+// Close clears IsOpen before it reads the counts, and we raise our count before we read IsOpen. Both are
+// sequentially consistent, so either we see that the logger is closing, or Close sees our count.
+bool Logger::EnterProducer(uint32_t& slot) const
+{
+	Logger& mutableThis = const_cast<Logger&>(*this);
+	slot                = GetMyTIDCached() % NumProducerCounts;
+	mutableThis.Producers[slot].N.fetch_add(1, std::memory_order_seq_cst);
+	if (IsOpen.load(std::memory_order_seq_cst))
+		return true;
+	LeaveProducer(slot);
+	return false;
+}
+
+void Logger::LeaveProducer(uint32_t slot) const
+{
+	Logger& mutableThis = const_cast<Logger&>(*this);
+	mutableThis.Producers[slot].N.fetch_sub(1, std::memory_order_release);
+}
+
+// Wait until every producer that got in before IsOpen was cleared has committed its message
+void Logger::WaitForProducers()
+{
+	for (uint32_t i = 0; i < NumProducerCounts; i++)
+	{
+		while (Producers[i].N.load(std::memory_order_acquire) != 0)
+			SleepMS(0);
+	}
+}
+
+// The part of ReserveSpace that runs while the caller is counted as a producer
+bool Logger::ReserveRegion(size_t len, Reservation& r, bool wait, uberlog::Level level) const
+{
+	Logger& mutableThis = const_cast<Logger&>(*this);
+
+	size_t maxLen = Ring.MaxAvailableForWrite() - MessageHeadSize(StampMessages());
+	if (len > maxLen)
+		len = maxLen;
+
+	// Once we've started spilling, all messages must be spilled, until the spill has been drained. Otherwise,
+	// a thread's messages could be written out of order.
+	if (wait && Overflow == OverflowPolicy::Spill && SpillActive)
+		return ReserveSpill(len, r, level);
+
+	bool block = wait && (Overflow == OverflowPolicy::Block || (Overflow == OverflowPolicy::DropBelowWarn && level >= uberlog::Level::Warn));
+
+	r      = Reservation();
+	r.Ring = &mutableThis.Ring;
+	if (Mode == ProducerMode::PerThread)
+		r.Thread = mutableThis.GetThreadRing();
+
+	if (r.Thread != nullptr)
+	{
+		r.Ring = &r.Thread->Ring;
+	}
+	else if (Mode == ProducerMode::LockFree)
+	{
+		r.MultiProducer = true;
+	}
+	else
+	{
+		// Either we're in Locked mode, or this thread could not be given a ring of its own, so it shares
+		// the primary ring with other such threads.
+		mutableThis.Lock.lock();
+		r.HoldsLock = true;
+		if (!IsOpen)
+		{
+			mutableThis.Lock.unlock();
+			r.Ring = nullptr;
+			return false;
+		}
+	}
+
+	if (!mutableThis.WaitForSpace(*r.Ring, r.MultiProducer, MessageSize(len, StampMessages()), r.Pos, block, !wait))
+	{
+		if (r.HoldsLock)
+			mutableThis.Lock.unlock();
+		r = Reservation();
+		if (!wait)
+			return false;
+		if (Overflow == OverflowPolicy::Spill)
+			return ReserveSpill(len, r, level);
+		Control->Dropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	if (Mode == ProducerMode::PerThread)
+		r.Stamp = MonotonicNanoseconds();
+
+	r.Level = (uint8_t) level;
+	r.Ptr   = (char*) r.Ring->PtrAt(r.Pos + MessageHeadSize(StampMessages()));
+	r.Len   = len;
+	return true;
+}
+
+// Produce a reservation in memory, which will be moved into the ring by SpillLoop
+bool Logger::ReserveSpill(size_t len, Reservation& r, uberlog::Level level) const
+{
+	r         = Reservation();
+	r.Level   = (uint8_t) level;
+	r.Spilled = new SpilledMessage();
+	r.Spilled->Payload.resize(len);
+	if (Mode == ProducerMode::PerThread)
+		r.Spilled->Stamp = MonotonicNanoseconds();
+	r.Ptr = len != 0 ? &r.Spilled->Payload[0] : nullptr;
+	r.Len = len;
+	return true;
+}
+
+void Logger::PushSpill(Reservation& r, internal::Command cmd, size_t len) const
+{
+	Logger&                         mutableThis = const_cast<Logger&>(*this);
+	std::unique_ptr<SpilledMessage> msg(r.Spilled);
+	msg->Level = r.Level;
+	r          = Reservation();
+	if (len == 0)
+		return;
+
+	msg->Cmd = cmd;
+	msg->Payload.resize(len);
+
+	std::lock_guard<std::mutex> guard(mutableThis.SpillLock);
+	if (SpillBytes + len > SpillLimit || SpillStop)
+	{
+		Control->Dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	msg->Seq = Control->CommittedSeq.fetch_add(1, std::memory_order_relaxed) + 1;
+	Control->BytesProduced.fetch_add(len, std::memory_order_relaxed);
+	mutableThis.SpillBytes += len;
+	mutableThis.Spill.push_back(std::move(*msg));
+	mutableThis.SpillActive = true;
+	if (!SpillThread.joinable())
+		mutableThis.SpillThread = std::thread([&mutableThis]() { mutableThis.SpillLoop(); });
+	mutableThis.SpillCV.notify_one();
+}
+
+// Move spilled messages into the primary ring, in order, waiting for space as necessary
+void Logger::SpillLoop()
+{
+	std::unique_lock<std::mutex> guard(SpillLock);
+	while (true)
+	{
+		SpillCV.wait(guard, [this] { return !Spill.empty() || SpillStop; });
+		if (Spill.empty())
+			return;
+
+		// References into a deque remain valid while other threads push_back
+		SpilledMessage& msg = Spill.front();
+		guard.unlock();
+		{
+			bool                         multiProducer = Mode == ProducerMode::LockFree;
+			std::unique_lock<std::mutex> ringGuard(Lock, std::defer_lock);
+			if (!multiProducer)
+				ringGuard.lock();
+			size_t total = MessageSize(msg.Payload.size(), StampMessages());
+			size_t pos   = 0;
+			WaitForSpace(Ring, multiProducer, total, pos, true, false);
+			Ring.WriteAt(pos + MessageHeadSize(StampMessages()), msg.Payload.data(), msg.Payload.size());
+			CommitMessage(Ring, multiProducer, pos, total, msg.Cmd, msg.Payload.size(), msg.Stamp, (uberlog::Level) msg.Level, msg.Seq);
+		}
+		guard.lock();
+
+		SpillBytes -= msg.Payload.size();
+		Spill.pop_front();
+		if (Spill.empty())
+			SpillActive = false;
+	}
+}
+
+// Wait for all spilled messages to be moved into the ring, and then stop the spill thread
+void Logger::StopSpill()
+{
+	{
+		std::lock_guard<std::mutex> guard(SpillLock);
+		SpillStop = true;
+		SpillCV.notify_one();
+	}
+	if (SpillThread.joinable())
+		SpillThread.join();
+	SpillThread = std::thread();
+}
+
+void Logger::Commit(Reservation& r, size_t len) const
+{
+	CommitReservation(r, Command::LogMsg, len);
+}
+
+void Logger::CommitReservation(Reservation& r, internal::Command cmd, size_t len) const
+{
+	Logger& mutableThis = const_cast<Logger&>(*this);
+	if (r.Ring == nullptr && r.Spilled == nullptr)
+		Panic("Logger.Commit called without a successful Reserve");
+	if (len > r.Size())
+		Panic("Logger.Commit called with more bytes than were reserved");
+
+	if (len != 0 && cmd == Command::LogMsg && TeeStdOut && StdOutFD >= 0)
+		write(StdOutFD, r.Ptr, (unsigned) len);
+
+	uint32_t slot = r.Slot;
+	if (r.Spilled != nullptr)
+	{
+		PushSpill(r, cmd, len);
+		LeaveProducer(slot);
+		return;
+	}
+
+	uint64_t seq = mutableThis.CommitMessage(*r.Ring, r.MultiProducer, r.Pos, MessageSize(r.Size(), StampMessages()), len != 0 ? cmd : Command::Null, len, r.Stamp, (uberlog::Level) r.Level);
+	if (r.HoldsLock)
+		mutableThis.Lock.unlock();
+
+	ThreadRing* thread = r.Thread;
+	r                  = Reservation();
+	if (len == 0)
+	{
+		LeaveProducer(slot);
+		return;
+	}
+
+	if (thread != nullptr && thread->IsNew)
+	{
+		// The logger slave only discovers this ring once it polls the control block. See the comment
+		// below for why we must wait until it has opened the ring.
+		thread->IsNew = false;
+		if (!WaitFor(seq, TimeoutChildProcessInitMS))
+			OutOfBandWarning("Timed out waiting for uberlog slave to consume log messages");
+	}
+
+	bool wasTrue      = true;
+	bool firstMessage = mutableThis.IsFirstLogMessage.compare_exchange_strong(wasTrue, false);
 	if (firstMessage)
 	{
 		// At process startup, it is likely that we are sending messages, and our
@@ -890,9 +1835,10 @@ void Logger::LogRaw(const void* data, size_t len) const
 		// This is the last moment in time where we can perform this check, and
 		// still live up to our claim that we won't lose a single log message,
 		// even if the main process faults immediately after sending that message.
-		if (!WaitForRingToBeEmpty(TimeoutChildProcessInitMS))
+		if (!WaitFor(seq, TimeoutChildProcessInitMS))
 			OutOfBandWarning("Timed out waiting for uberlog slave to consume log messages");
 	}
+	LeaveProducer(slot);
 }
 
 bool Logger::Open()
@@ -904,6 +1850,7 @@ bool Logger::Open()
 		return false;
 
 	StdOutFD = fileno(stdout);
+	TK.SetFormat(TimeFmt);
 
 	std::string uberLoggerPath = LoggerPath;
 	if (uberLoggerPath.size() == 0)
@@ -917,15 +1864,25 @@ bool Logger::Open()
 			uberLoggerPath = myPath.substr(0, lastSlash + 1) + uberLoggerPath;
 	}
 
-	const int   nArgs = 6;
+	const int   nArgs = 16;
 	std::string args[nArgs];
 	const char* argv[nArgs + 1];
-	args[0] = uberLoggerPath;
-	args[1] = uberlog_tsf::fmt("%u", GetMyPID());
-	args[2] = uberlog_tsf::fmt("%u", RingBufferSize);
-	args[3] = Filename;
-	args[4] = uberlog_tsf::fmt("%d", MaxFileSize);
-	args[5] = uberlog_tsf::fmt("%d", MaxNumArchives);
+	args[0]  = uberLoggerPath;
+	args[1]  = uberlog_tsf::fmt("%u", GetMyPID());
+	args[2]  = uberlog_tsf::fmt("%u", RingBufferSize);
+	args[3]  = Filename;
+	args[4]  = uberlog_tsf::fmt("%d", MaxFileSize);
+	args[5]  = uberlog_tsf::fmt("%d", MaxNumArchives);
+	args[6]  = uberlog_tsf::fmt("%v", (uint64_t) WriteBufferSize);
+	args[7]  = uberlog_tsf::fmt("%v", WriteQueueDepth);
+	args[8]  = uberlog_tsf::fmt("%v", MaxArchiveBytes);
+	args[9]  = uberlog_tsf::fmt("%v", MaxArchiveAgeSeconds);
+	args[10] = Preallocate ? "1" : "0";
+	args[11] = uberlog_tsf::fmt("%v", (int) Sync);
+	args[12] = uberlog_tsf::fmt("%v", SyncIntervalMS);
+	args[13] = uberlog_tsf::fmt("%v", SyncIntervalBytes);
+	args[14] = DropPageCache ? "1" : "0";
+	args[15] = uberlog_tsf::fmt("%v", (int) TimeFmt);
 	for (size_t i = 0; i < nArgs; i++)
 		argv[i] = args[i].c_str();
 	argv[nArgs] = nullptr;
@@ -936,135 +1893,610 @@ bool Logger::Open()
 		return false;
 	}
 
-	IsOpen            = true;
+#ifdef __linux__
+	if (SpaceEvent != -1)
+		fcntl(SpaceEvent, F_SETFD, FD_CLOEXEC);
+#endif
+
+	// InstanceID must be assigned before IsOpen, because producers only read it once they've seen IsOpen
+	SpillStop         = false;
 	IsFirstLogMessage = true;
+	InstanceID.store(NextLoggerInstanceID++, std::memory_order_relaxed);
+	IsOpen = true;
 	return true;
 }
 
+// The caller must hold Lock
 void Logger::SendMessage(internal::Command cmd, const void* payload, size_t payload_len)
 {
-	MessageHead msg;
-	msg.Cmd        = cmd;
-	msg.PayloadLen = payload_len;
+	bool   multiProducer = Mode == ProducerMode::LockFree;
+	size_t total         = MessageSize(payload_len, StampMessages());
+	size_t pos           = 0;
+	WaitForSpace(Ring, multiProducer, total, pos, true, false);
+	if (payload)
+		Ring.WriteAt(pos + MessageHeadSize(StampMessages()), payload, payload_len);
+	CommitMessage(Ring, multiProducer, pos, total, cmd, payload_len, Mode == ProducerMode::PerThread ? MonotonicNanoseconds() : 0);
+}
 
-	if (sizeof(msg) + payload_len > Ring.MaxAvailableForWrite())
+// Claim len bytes of the ring, starting at pos. This includes the space for the MessageHead.
+// If multiProducer is false, then the caller must guarantee that no other thread is writing into the ring.
+// If wait is false, and the ring is full, then return false immediately. If armSpaceEvent is also true, then ask
+// the logger slave to signal SpaceEvent once it has consumed a message.
+bool Logger::WaitForSpace(internal::RingBuffer& ring, bool multiProducer, size_t len, size_t& pos, bool wait, bool armSpaceEvent)
+{
+	if (len > ring.MaxAvailableForWrite())
 		Panic("Attempt to write too much data to the ring buffer");
 
 	// If there's not enough space in the ring buffer, then wait for slave to consume messages
-	for (int64_t i = 0; sizeof(msg) + payload_len > Ring.AvailableForWrite(); i++)
+	const int64_t spinCount = 100;
+	uint64_t      waitStart = 0;
+	bool          warned    = false;
+	for (int64_t i = 0; multiProducer ? !ring.Reserve(len, pos) : !ring.PrepareWrite(len, pos); i++)
 	{
-		if (i < 1000)
-			SleepMS(0);
-		else if (i < 2000)
-			SleepMS(1);
-		else
-			SleepMS(5);
+		// We may have committed a skip record on the way here, which the logger slave doesn't know about yet
+		WakeWriter();
+
+		if (!wait)
+		{
+			if (!armSpaceEvent)
+				return false;
+			// Look again after arming the event, in case the logger slave consumed a message in the meantime
+			Control->SpaceArmed.store(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (len <= ring.AvailableForWrite())
+				continue;
+			return false;
+		}
+
+		if (waitStart == 0)
+			waitStart = MonotonicNanoseconds();
+
+		if (!HaveSharedFutex)
+		{
+			if (i < 1000)
+				SleepMS(0);
+			else if (i < 2000)
+				SleepMS(1);
+			else
+				SleepMS(5);
+
+			if (i == 2001)
+				OutOfBandWarning("Waiting for log writer slave to flush queue");
+			continue;
+		}
 
-		if (i == 2001)
+		// Spin for a little while, because the logger slave is probably busy draining the ring
+		if (i < spinCount)
+			continue;
+
+		// Park on the read pointer until the logger slave advances it. See LoggerSlave::NotifySpace for the other side of this.
+		// The logger slave only wakes us once the ring is half empty, so that we don't bounce back and forth for every message.
+		// We need the timeout in case the logger slave dies.
+		uint32_t readp = ring.ReadPtrWord()->load();
+		ring.Waiters()->fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (ring.AvailableForWrite() < std::min(std::max(len, ring.Size / 2), ring.Size))
+			FutexWait(ring.ReadPtrWord(), readp, 1000);
+		ring.Waiters()->fetch_sub(1);
+
+		if (!warned && MonotonicNanoseconds() - waitStart > 1000000000)
+		{
 			OutOfBandWarning("Waiting for log writer slave to flush queue");
+			warned = true;
+		}
 	}
 
-	Ring.WriteNoCommit(0, &msg, sizeof(msg));
-	if (payload)
-		Ring.WriteNoCommit(sizeof(msg), payload, payload_len);
-	Ring.Write(nullptr, sizeof(msg) + payload_len);
+	if (waitStart != 0)
+	{
+		Control->Stats.Stalls.fetch_add(1, std::memory_order_relaxed);
+		Control->Stats.StallNS.fetch_add(MonotonicNanoseconds() - waitStart, std::memory_order_relaxed);
+	}
+	return true;
+}
+
+// Publish a message whose payload has already been written into the space claimed by WaitForSpace.
+// If the message is smaller than reservedLen, then the remainder is given back. If cmd is Null, then
+// the entire space is given back, and nothing is published.
+// Log messages are given the next sequence number, unless seq is non-zero. Returns the message's sequence number, or zero.
+uint64_t Logger::CommitMessage(internal::RingBuffer& ring, bool multiProducer, size_t pos, size_t reservedLen, internal::Command cmd, size_t payloadLen, uint64_t stamp, uberlog::Level level, uint64_t seq)
+{
+	bool   stamped = StampMessages();
+	size_t total   = cmd != Command::Null ? MessageSize(payloadLen, stamped) : 0;
+
+	// The slave relies on unused space being zero, so that it can tell when a message has been committed.
+	// The space that we're giving back may contain the remains of a message that didn't fit.
+	if (total < reservedLen)
+		ring.ZeroAt(pos + total, reservedLen - total);
+
+	MessageHead msg;
+	msg.Cmd        = cmd;
+	msg.Flags      = stamped ? MessageFlagStamp : 0;
+	msg.Level      = (uint8_t) level;
+	msg.PayloadLen = (uint32_t) payloadLen;
+	if (stamped && total != 0)
+		ring.WriteAt(pos + sizeof(msg), &stamp, sizeof(stamp));
+
+	// Take the sequence number as late as possible, so that the logger slave seldom sees them out of order
+	if (total != 0 && cmd != Command::Close)
+	{
+		msg.Flags |= MessageFlagSeq;
+		if (seq == 0)
+		{
+			seq = Control->CommittedSeq.fetch_add(1, std::memory_order_relaxed) + 1;
+			Control->BytesProduced.fetch_add(payloadLen, std::memory_order_relaxed);
+		}
+		ring.WriteAt(pos + MessageHeadSize(stamped) - sizeof(seq), &seq, sizeof(seq));
+	}
+	else
+	{
+		seq = 0;
+	}
+
+	if (!multiProducer)
+	{
+		if (total != 0)
+		{
+			ring.WriteAt(pos, &msg, sizeof(msg));
+			ring.Write(nullptr, total);
+			WakeWriter();
+		}
+		return seq;
+	}
+
+	if (total < reservedLen && !ring.Unreserve(pos, reservedLen, total))
+	{
+		// Another producer has already claimed the space after ours, so we cannot give the remainder back.
+		// Instead, we fill it with a Pad record, which the slave will skip over.
+		MessageHead pad;
+		pad.Cmd        = Command::Pad;
+		pad.PayloadLen = (uint32_t) (reservedLen - total);
+		ring.WriteAt(pos + total + offsetof(MessageHead, PayloadLen), &pad.PayloadLen, sizeof(pad.PayloadLen));
+		((std::atomic<uint32_t>*) ring.PtrAt(pos + total))->store(pad.CommitWord(), std::memory_order_release);
+	}
+
+	if (total != 0)
+	{
+		// Write everything except for the commit word, and then publish it, which commits the message.
+		ring.WriteAt(pos + offsetof(MessageHead, PayloadLen), &msg.PayloadLen, sizeof(msg.PayloadLen));
+		((std::atomic<uint32_t>*) ring.PtrAt(pos))->store(msg.CommitWord(), std::memory_order_release);
+	}
+
+	WakeWriter();
+	return seq;
+}
+
+uint64_t Logger::Sequence() const
+{
+	if (!IsOpen || IsStdOutMode)
+		return 0;
+	return Control->CommittedSeq.load(std::memory_order_acquire);
+}
+
+bool Logger::WaitFor(uint64_t seq, uint32_t timeoutMS, bool synced) const
+{
+	if (!IsOpen || IsStdOutMode)
+		return true;
+
+	// See LoggerSlave::PublishSeq for the other side of this
+	const std::atomic<uint64_t>& mark  = synced ? Control->SyncedSeq : Control->WrittenSeq;
+	uint64_t                     start = MonotonicNanoseconds();
+	while (true)
+	{
+		if (mark.load(std::memory_order_acquire) >= seq)
+			return true;
+		uint64_t elapsedMS = (MonotonicNanoseconds() - start) / 1000000;
+		if (elapsedMS >= timeoutMS)
+			return false;
+
+		uint32_t word = Control->SeqWord.load();
+		Control->SeqWaiters.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (mark.load(std::memory_order_acquire) < seq)
+			FutexWait(&Control->SeqWord, word, (uint32_t) std::min(timeoutMS - elapsedMS, (uint64_t) (HaveSharedFutex ? 100 : 1)));
+		Control->SeqWaiters.fetch_sub(1);
+	}
+}
+
+bool Logger::Flush(uint32_t timeoutMS, bool synced) const
+{
+	return WaitFor(Sequence(), timeoutMS, synced);
+}
+
+// If the logger slave is blocked, waiting for messages, then wake it up. This is just a load of a cache line that is
+// seldom written, so the syscall only happens when the ring goes from idle to busy. We cannot merely check whether
+// the ring was empty before our message, because with multiple producers, a message that was reserved while the ring
+// was non-empty may only be committed after the logger slave has drained the ring and gone to sleep.
+void Logger::WakeWriter()
+{
+	// Pairs with the fence in LoggerSlave::SleepUntilWoken. Either we see that it is asleep, or it sees our message.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (Control->WriterAsleep.load(std::memory_order_relaxed) != 0 && Control->WriterAsleep.exchange(0) != 0)
+		FutexWake(&Control->WriterAsleep, 1);
+}
+
+ThreadRing* Logger::GetThreadRing()
+{
+	const uint64_t instance = InstanceID.load(std::memory_order_relaxed);
+	for (int i = 0; i < ThreadRingCacheSize; i++)
+	{
+		if (ThreadRingCache[i].LoggerInstance == instance)
+			return ThreadRingCache[i].Ring;
+	}
+
+	// Cache miss. Look for an existing ring, or create a new one.
+	// If we end up with a null ring, then we cache that too, so that we don't retry on every message.
+	ThreadRing* ring = CreateThreadRing();
+	memmove(ThreadRingCache + 1, ThreadRingCache, sizeof(ThreadRingCache[0]) * (ThreadRingCacheSize - 1));
+	ThreadRingCache[0].LoggerInstance = instance;
+	ThreadRingCache[0].Ring           = ring;
+	return ring;
+}
+
+ThreadRing* Logger::CreateThreadRing()
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	proc_id_t                   tid = GetMyTID();
+	for (auto tr : ThreadRings)
+	{
+		if (Control->ThreadRings[tr->Index].TID == (uint32_t) tid)
+			return tr;
+	}
+
+	if (ThreadRings.size() == SharedControl::MaxThreadRings)
+		return nullptr;
+
+	uint32_t     index = (uint32_t) ThreadRings.size();
+	shm_handle_t shm   = internal::NullShmHandle;
+	void*        buf   = nullptr;
+	if (!SetupSharedMemory(GetMyPID(), Filename.c_str(), index + 1, SharedMemSizeFromRingSize(RingBufferSize), true, shm, buf))
+		return nullptr;
+
+	ThreadRing* tr = new ThreadRing();
+	tr->ShmHandle  = shm;
+	tr->Index      = index;
+	tr->Ring.Init(buf, RingBufferSize, true);
+	ThreadRings.push_back(tr);
+
+	Control->ThreadRings[index].TID = (uint32_t) tid;
+	Control->NumThreadRings.store(index + 1, std::memory_order_release);
+	return tr;
 }
 
 bool Logger::CreateRingBuffer()
 {
 	shm_handle_t shm = internal::NullShmHandle;
 	void*        buf = nullptr;
-	if (!SetupSharedMemory(GetMyPID(), Filename.c_str(), SharedMemSizeFromRingSize(RingBufferSize), true, shm, buf))
+	if (!SetupSharedMemory(GetMyPID(), Filename.c_str(), 0, SharedControlSize + SharedMemSizeFromRingSize(RingBufferSize), true, shm, buf))
 		return false;
-	ShmHandle = shm;
-	Ring.Init(buf, RingBufferSize, true);
+	ShmHandle               = shm;
+	Control                 = (SharedControl*) buf;
+	Control->ThreadRingSize = RingBufferSize;
+	Control->SpaceEventFD   = -1;
+	Control->IncludeDate    = 1;
+	Ring.Init((uint8_t*) buf + SharedControlSize, RingBufferSize, true);
+
+#ifdef __linux__
+	// The logger slave inherits this, so it only becomes close-on-exec once the logger slave has been launched. See Open().
+	SpaceEvent            = eventfd(0, EFD_NONBLOCK);
+	Control->SpaceEventFD = SpaceEvent;
+#endif
+
+	if (Deferred)
+	{
+		FormatCache = new FormatCacheEntry[FormatCacheSize];
+		for (size_t i = 0; i < FormatCacheSize; i++)
+			FormatCache[i].Str = nullptr;
+		FormatTableUsed = 0;
+	}
 	return true;
 }
 
 void Logger::CloseRingBuffer()
 {
+	for (auto tr : ThreadRings)
+	{
+		CloseSharedMemory(tr->ShmHandle, tr->Ring.Buf, SharedMemSizeFromRingSize(tr->Ring.Size));
+		DeleteSharedMemory(GetMyPID(), Filename.c_str(), tr->Index + 1);
+		delete tr;
+	}
+	ThreadRings.clear();
+
+	delete[] FormatCache;
+	FormatCache = nullptr;
+
+#ifdef __linux__
+	if (SpaceEvent != -1)
+		close(SpaceEvent);
+#endif
+	SpaceEvent = -1;
+
 	if (Ring.Buf)
 	{
-		CloseSharedMemory(ShmHandle, Ring.Buf, SharedMemSizeFromRingSize(Ring.Size));
-		DeleteSharedMemory(GetMyPID(), Filename.c_str());
+		CloseSharedMemory(ShmHandle, Control, SharedControlSize + SharedMemSizeFromRingSize(Ring.Size));
+		DeleteSharedMemory(GetMyPID(), Filename.c_str(), 0);
 	}
 	Ring.Buf  = nullptr;
 	Ring.Size = 0;
+	Control   = nullptr;
 	ShmHandle = internal::NullShmHandle;
+	InstanceID.store(0, std::memory_order_relaxed);
 }
 
-bool Logger::WaitForRingToBeEmpty(uint32_t milliseconds) const
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable : 6386) // /analyze thinks we might overrun 'buf'
+#endif
+
+// IncludeDate = true, with the default TimeFormat::LocalMilli
+// [------------- 42 characters ------------]
+// [------ 28 characters -----]
+// 2015-07-15T14:53:51.979+0200 [I] 00001fdc The log message here
+// Other TimeFormats change the length of the time stamp (TimeKeeper::Len), but the 14 characters after it stay the same.
+
+// IncludeDate = false
+// [  13 chars ]
+// [I] 00001fdc The log message here
+
+// Write the first part of the log message into buf. This is the time, the log level, and the thread id
+void Logger::FormatPrefix(char* buf, uberlog::Level level, bool includeDate) const
 {
-	auto start = std::chrono::system_clock::now();
-	while (Ring.AvailableForRead() != 0)
+	if (_Test_OverridePrefix[0] != 0)
 	{
-		internal::SleepMS(1);
-		auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start);
-		if (elapsed_ms.count() >= milliseconds)
-			return false;
+		memcpy(buf, _Test_OverridePrefix, PrefixLen(includeDate));
+	}
+	else
+	{
+		FormatLinePrefix(buf, TK, includeDate ? TK.Now() : 0, LevelChar(level), GetMyTIDHex(), includeDate);
 	}
-	auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start);
-	//printf("took %d for initial drain\n", (int) elapsed_ms.count());
-	return true;
 }
 
-#ifdef _MSC_VER
-#pragma warning(push)
-#pragma warning(disable : 6386) // /analyze thinks we might overrun 'buf'
-#endif
+// Write a RawPrefix into buf, for the logger slave to render. See SetDeferredPrefix.
+void Logger::WriteRawPrefix(char* buf, bool includeDate) const
+{
+	RawPrefix raw;
+	raw.Time        = includeDate ? TK.Now() : 0;
+	raw.TID         = GetMyTIDCached();
+	raw.IncludeDate = includeDate ? 1 : 0;
+	memcpy(buf, &raw, sizeof(raw));
+}
+
+// Tell the logger slave whether our lines include the date, so that its report of dropped messages can match them.
+// Only call this while holding a reservation, which keeps Control mapped.
+void Logger::PublishIncludeDate(bool includeDate) const
+{
+	if (Control->IncludeDate.load(std::memory_order_relaxed) != (uint32_t) includeDate)
+		Control->IncludeDate.store(includeDate ? 1 : 0, std::memory_order_relaxed);
+}
 
-void Logger::LogDefaultFormat_Phase2(uberlog::Level level, bool includeDate, uberlog_tsf::StrLenPair msg, bool buf_is_static) const
+// Format the message directly into the ring buffer, which saves us from copying it there afterwards.
+void Logger::LogDefaultFormat_Phase2(uberlog::Level level, const char* format_str, ssize_t nargs, const uberlog_tsf::fmtarg* args) const
 {
-	// IncludeDate = true
-	// [------------- 42 characters ------------]
-	// [------ 28 characters -----]
-	// 2015-07-15T14:53:51.979+0200 [I] 00001fdc The log message here
+	const bool includeDate = IncludeDate;
+	if (IsStdOutMode || level == Level::Fatal)
+		return LogDefaultFormat_Buffered(level, includeDate, format_str, nargs, args);
 
-	// IncludeDate = false
-	// [  13 chars ]
-	// [I] 00001fdc The log message here
+	if (FormatCache != nullptr && !TeeStdOut && LogDeferred(level, format_str, nargs, args))
+		return;
 
-	const size_t fixedPortion = includeDate ? 42 : 13;
+	const char*  eol          = uberlog::internal::UseCRLF ? "\r\n" : "\n";
+	const bool   rawPrefix    = UseRawPrefix();
+	const size_t fixedPortion = rawPrefix ? sizeof(RawPrefix) : PrefixLen(includeDate);
+	const size_t maxLen       = Ring.MaxAvailableForWrite() - MessageHeadSize(StampMessages());
 
-	char*  buf;
-	size_t bufsize = fixedPortion + msg.Len + EolLen + 1;
-	if (buf_is_static)
+	// Start with a guess that is good enough for most messages, and grow it if the message doesn't fit.
+	uberlog_tsf::context cx;
+	size_t               reserve = fixedPortion + 256;
+	while (true)
 	{
-		buf = msg.Str - fixedPortion;
+		reserve = std::min(reserve, maxLen);
+		Reservation r;
+		if (!ReserveSpace(reserve, r, true, level))
+		{
+			WarnIfNotOpen("Log");
+			return;
+		}
+		PublishIncludeDate(includeDate);
+		if (r.Size() < fixedPortion + EolLen + 1)
+		{
+			Commit(r, 0);
+			return;
+		}
+
+		if (rawPrefix)
+			WriteRawPrefix(r.Ptr, includeDate);
+		else
+			FormatPrefix(r.Ptr, level, includeDate);
+
+		// Leave space for the EOL. The formatter also needs space for its null terminator, which we'll overwrite with the EOL.
+		size_t  space  = r.Size() - fixedPortion - EolLen + 1;
+		ssize_t msgLen = uberlog_tsf::fmt_core_fixed(cx, format_str, nargs, args, r.Ptr + fixedPortion, space);
+		if (msgLen >= 0)
+		{
+			memcpy(r.Ptr + fixedPortion + msgLen, eol, EolLen);
+			CommitReservation(r, rawPrefix ? Command::LogLine : Command::LogMsg, fixedPortion + msgLen + EolLen);
+			return;
+		}
+
+		Commit(r, 0);
+		if (reserve == maxLen)
+		{
+			// The message is larger than the ring buffer, so let LogRaw truncate it
+			return LogDefaultFormat_Buffered(level, includeDate, format_str, nargs, args);
+		}
+		reserve *= 2;
 	}
-	else
+}
+
+uint32_t Logger::FormatStringID(const char* format_str) const
+{
+	Logger& mutableThis = const_cast<Logger&>(*this);
+	size_t  mask        = FormatCacheSize - 1;
+	size_t  hash        = ((size_t) format_str >> 3) * 2654435761u;
+
+	// The fast path, which is lock free
+	for (size_t i = 0; i < FormatCacheSize; i++)
 	{
-		buf = new char[bufsize];
-		memcpy(buf + fixedPortion, msg.Str, msg.Len);
-		delete[] msg.Str;
+		auto&       e   = FormatCache[(hash + i) & mask];
+		const char* str = e.Str.load(std::memory_order_acquire);
+		if (str == nullptr)
+			break;
+		if (str == format_str && strcmp(format_str, Control->FormatTable + e.ID) == 0)
+			return e.ID;
 	}
 
-	// Write the first part of the log message into buf. This is the time, the log level, and the thread id
-	if (_Test_OverridePrefix[0] != 0)
+	// Add the string to the table. We must search again, now that we hold the lock, because another
+	// thread may have added it in the meantime.
+	std::lock_guard<std::mutex> guard(mutableThis.Lock);
+	if (!IsOpen)
+		return NoFormatID;
+	size_t i = 0;
+	for (; i < FormatCacheSize; i++)
+	{
+		auto&       e   = FormatCache[(hash + i) & mask];
+		const char* str = e.Str.load(std::memory_order_relaxed);
+		if (str == nullptr)
+			break;
+		if (str == format_str && strcmp(format_str, Control->FormatTable + e.ID) == 0)
+			return e.ID;
+	}
+
+	size_t len = strlen(format_str) + 1;
+	if (i == FormatCacheSize || len > SharedControl::FormatTableSize - FormatTableUsed)
+		return NoFormatID;
+
+	uint32_t id = FormatTableUsed;
+	memcpy(Control->FormatTable + id, format_str, len);
+	mutableThis.FormatTableUsed += (uint32_t) len;
+
+	auto& e = FormatCache[(hash + i) & mask];
+	e.ID    = id;
+	e.Str.store(format_str, std::memory_order_release);
+	return id;
+}
+
+// Write the message prefix and the raw arguments into the ring buffer, so that the logger slave can format the message.
+// Returns false if the message cannot be deferred, in which case the caller must format it.
+bool Logger::LogDeferred(uberlog::Level level, const char* format_str, ssize_t nargs, const uberlog_tsf::fmtarg* args) const
+{
+	static const char    nullStr[]   = "(null)";
+	static const wchar_t nullWStr[]  = L"(null)";
+	const bool           includeDate = IncludeDate;
+	const bool           rawPrefix   = UseRawPrefix();
+	const size_t         prefixLen   = rawPrefix ? sizeof(RawPrefix) : PrefixLen(includeDate);
+	uint32_t             slot        = 0;
+
+	// The format table is in shared memory, so we must be counted as a producer while we look up the string
+	if (!EnterProducer(slot))
+		return false;
+	uint32_t formatID = FormatStringID(format_str);
+	LeaveProducer(slot);
+	if (formatID == NoFormatID || nargs > UINT16_MAX)
+		return false;
+
+	// Measure
+	size_t argsStart = (sizeof(DeferredMsgHead) + prefixLen + 7) & ~(size_t) 7;
+	size_t len       = argsStart;
+	for (ssize_t i = 0; i < nargs; i++)
+	{
+		len += sizeof(DeferredArg);
+		if (args[i].Type == uberlog_tsf::fmtarg::TCStr)
+			len += (strlen(args[i].CStr ? args[i].CStr : nullStr) + 1 + 7) & ~(size_t) 7;
+		else if (args[i].Type == uberlog_tsf::fmtarg::TWStr)
+			len += ((wcslen(args[i].WStr ? args[i].WStr : nullWStr) + 1) * sizeof(wchar_t) + 7) & ~(size_t) 7;
+	}
+	if (len > Ring.MaxAvailableForWrite() - MessageHeadSize(StampMessages()))
+		return false;
+
+	Reservation r;
+	if (!ReserveSpace(len, r, true, level))
+	{
+		WarnIfNotOpen("Log");
+		return true;
+	}
+	PublishIncludeDate(includeDate);
+
+	DeferredMsgHead head;
+	head.FormatID    = formatID;
+	head.NumArgs     = (uint16_t) nargs;
+	head.PrefixLen   = (uint8_t) prefixLen;
+	head.IsRawPrefix = rawPrefix ? 1 : 0;
+	r.Write(0, &head, sizeof(head));
+
+	char prefix[MaxLinePrefixLen];
+	if (rawPrefix)
+		WriteRawPrefix(prefix, includeDate);
+	else
+		FormatPrefix(prefix, level, includeDate);
+	r.Write(sizeof(head), prefix, prefixLen);
+
+	size_t pos = argsStart;
+	for (ssize_t i = 0; i < nargs; i++)
 	{
-		memcpy(buf, _Test_OverridePrefix, fixedPortion);
+		const auto& arg = args[i];
+		const void* str = nullptr;
+		DeferredArg da;
+		da.Type  = (uint32_t) arg.Type;
+		da.Len   = 0;
+		da.Value = 0;
+		switch (arg.Type)
+		{
+		case uberlog_tsf::fmtarg::TCStr:
+			str    = arg.CStr ? arg.CStr : nullStr;
+			da.Len = (uint32_t) strlen((const char*) str) + 1;
+			break;
+		case uberlog_tsf::fmtarg::TWStr:
+			str    = arg.WStr ? arg.WStr : nullWStr;
+			da.Len = (uint32_t) ((wcslen((const wchar_t*) str) + 1) * sizeof(wchar_t));
+			break;
+		case uberlog_tsf::fmtarg::TI32:
+		case uberlog_tsf::fmtarg::TU32:
+			da.Value = arg.UI32;
+			break;
+		case uberlog_tsf::fmtarg::TNull:
+			break;
+		default:
+			// TPtr, TI64, TU64, TDbl
+			memcpy(&da.Value, &arg.UI64, sizeof(da.Value));
+			break;
+		}
+		r.Write(pos, &da, sizeof(da));
+		pos += sizeof(da);
+		if (str != nullptr)
+		{
+			r.Write(pos, str, da.Len);
+			pos += (da.Len + 7) & ~(size_t) 7;
+		}
 	}
-	else if (includeDate)
+
+	CommitReservation(r, Command::LogFmt, len);
+	return true;
+}
+
+void Logger::LogDefaultFormat_Buffered(uberlog::Level level, bool includeDate, const char* format_str, ssize_t nargs, const uberlog_tsf::fmtarg* args) const
+{
+	const size_t fixedPortion = PrefixLen(includeDate);
+	const size_t statbufsize  = 200;
+	char         statbuf[statbufsize];
+
+	uberlog_tsf::context    cx;
+	uberlog_tsf::StrLenPair msg = uberlog_tsf::fmt_core(cx, format_str, nargs, args, statbuf + fixedPortion, statbufsize - fixedPortion - EolLen);
+
+	bool   buf_is_static = msg.Str == statbuf + fixedPortion;
+	char*  buf;
+	size_t bufsize = fixedPortion + msg.Len + EolLen + 1;
+	if (buf_is_static)
 	{
-		TK.Format(buf);
-		buf[28] = ' ';
-		buf[29] = '[';
-		buf[30] = LevelChar(level);
-		buf[31] = ']';
-		buf[32] = ' ';
-		TimeKeeper::FormatUintHex(8, buf + 33, (unsigned int) uberlog::internal::GetMyTID());
-		buf[41] = ' ';
+		buf = statbuf;
 	}
 	else
 	{
-		buf[0] = '[';
-		buf[1] = LevelChar(level);
-		buf[2] = ']';
-		buf[3] = ' ';
-		TimeKeeper::FormatUintHex(8, buf + 4, (unsigned int) uberlog::internal::GetMyTID());
-		buf[12] = ' ';
+		buf = new char[bufsize];
+		memcpy(buf + fixedPortion, msg.Str, msg.Len);
+		delete[] msg.Str;
 	}
 
+	FormatPrefix(buf, level, includeDate);
+
 	size_t totalLen = fixedPortion + msg.Len;
 	if (uberlog::internal::UseCRLF)
 	{
@@ -1078,7 +2510,7 @@ void Logger::LogDefaultFormat_Phase2(uberlog::Level level, bool includeDate, ube
 		buf[totalLen + 1] = 0;
 	}
 
-	LogRaw(buf, bufsize - 1);
+	LogRawAtLevel(buf, bufsize - 1, level);
 
 	if (level == Level::Fatal)
 		Panic(buf);
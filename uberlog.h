@@ -1,8 +1,13 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+#include <string.h>
 #include <time.h>
 #include "tsf.h"
 
@@ -12,14 +17,34 @@
 
 namespace uberlog {
 
+// Where the time stamps of log messages come from
+enum class ClockSource
+{
+	System, // clock_gettime(CLOCK_REALTIME), or GetSystemTimePreciseAsFileTime on Windows. This is the default.
+	TSC,    // The CPU's time stamp counter, calibrated against the system clock. Only used if the TSC is invariant.
+};
+
+// How the time at the start of each log line is written
+enum class TimeFormat
+{
+	LocalMilli, // 2015-07-15T14:53:51.979+0200. This is the default.
+	LocalMicro, // 2015-07-15T14:53:51.979123+0200
+	LocalNano,  // 2015-07-15T14:53:51.979123456+0200
+	UTCMilli,   // 2015-07-15T12:53:51.979Z
+	UTCMicro,   // 2015-07-15T12:53:51.979123Z
+	UTCNano,    // 2015-07-15T12:53:51.979123456Z
+	EpochNano,  // 1436964831979123456, nanoseconds since the Unix epoch, in 19 digits
+};
+
 namespace internal {
 
-// The size of the write buffer in the logger slave. This exists so that the
-// logger slave doesn't issue a write() call for every log message.
-// If we make it too large, we waste memory bandwidth and pollute the cache.
-// If we make it too small, we issue too many kernel calls.
-// On Windows, it doesn't seem to make much of a difference above 1024.
-static const size_t LoggerSlaveWriteBufferSize = 1024;
+// The default size of the swap buffers in the logger slave. The slave's drain thread copies
+// messages out of the ring buffer into a swap buffer, and its I/O thread writes full swap
+// buffers to the log file. This exists so that the logger slave doesn't issue a write()
+// call for every log message. If we make it too small, we issue too many kernel calls.
+// The slave has a handful of these, so this is memory in the child process, not in
+// shared memory. This can be changed with Logger::SetWriteBufferSize.
+static const size_t LoggerSlaveWriteBufferSize = 64 * 1024;
 
 #ifdef _WIN32
 static const char         PATH_SLASH = '\\';
@@ -41,101 +66,384 @@ static const bool         UseCRLF       = false;
 #define UBERLOG_NORETURN __attribute__((noreturn))
 #endif
 
+#ifdef __linux__
+static const bool HaveSharedFutex = true; // futex works across processes, on shared memory
+#else
+static const bool HaveSharedFutex = false;
+#endif
+
 class TestHelper;
 
 bool                  ProcessCreate(const char* cmd, const char** argv, proc_handle_t& handle, proc_id_t& pid);
 bool                  WaitForProcessToDie(proc_handle_t handle, proc_id_t pid, uint32_t milliseconds);
 proc_id_t             GetMyPID();
 proc_id_t             GetMyTID();
+const char*           GetMyTIDHex();    // 8 character hex rendering of GetMyTID(), cached per thread
+uint32_t              GetMyTIDCached(); // GetMyTID(), cached per thread
 std::string           GetMyExePath();
 void                  SleepMS(uint32_t ms);
-void                  SharedMemObjectName(proc_id_t parentID, const char* logFilename, char shmName[100]);
-bool                  SetupSharedMemory(proc_id_t parentID, const char* logFilename, size_t size, bool create, shm_handle_t& shmHandle, void*& shmBuf);
+void                  SharedMemObjectName(proc_id_t parentID, const char* logFilename, uint32_t ringIndex, char shmName[100]);
+bool                  SetupSharedMemory(proc_id_t parentID, const char* logFilename, uint32_t ringIndex, size_t size, bool create, shm_handle_t& shmHandle, void*& shmBuf);
 void                  CloseSharedMemory(shm_handle_t shmHandle, void* buf, size_t size);
 size_t                SharedMemSizeFromRingSize(size_t ringBufferSize);
+uint64_t              MonotonicNanoseconds();
+bool                  FutexWait(std::atomic<uint32_t>* word, uint32_t expected, uint32_t milliseconds); // Returns false on timeout. Without HaveSharedFutex, this just sleeps.
+void                  FutexWake(std::atomic<uint32_t>* word, int count);                                // No-op without HaveSharedFutex
 void                  OutOfBandWarning(_In_z_ _Printf_format_string_ const char* msg, ...);
 UBERLOG_NORETURN void Panic(const char* msg);
 std::string           FullPath(const char* relpath);
 bool                  IsPathAbsolute(const char* path);
 uint64_t              siphash24(const void* src, size_t src_sz, const char key[16]);
 
-/* Memory mapped ring buffer.
-To write in two (or more) phases, use WriteNoCommit, each time increasing the
-offset. When you're done, use Write, but make data null. In the final call
-to Write, make len equal to the total length of all your writes.
+extern bool _Test_DisableThreadIDCache; // Used by benchmarks to measure the cost of fetching the thread id for every message
 
-Write and WriteNoCommit will panic if you try to call them with
-a value of len that is greater than AvailableForWrite().
+/* Memory mapped ring buffer.
+The ring holds records (see MessageHead), and a record never straddles the end of
+the ring. If a record would straddle the end, then the rest of the ring is first
+filled with a skip record (a Command::Pad). That way, headers can be parsed in place,
+and payloads can be handed straight to write().
+
+A single producer writes in two phases. PrepareWrite finds space for the record, and
+then the producer writes into it with WriteAt. Write(nullptr, len) commits the record.
+Write will panic if you try to call it with a value of len that is greater than
+AvailableForWrite().
+
+The read and write pointers are free-running counters. They are only masked
+by Size when they are used to address Buf. This allows multiple producers to
+reserve space with a compare-and-swap on the write pointer, without being
+susceptible to the ABA problem. When using Reserve, the write pointer no longer
+means "readable up to here", so the reader needs some other means of knowing
+that a region has been committed (see MessageHead::Cmd).
+
+Any bytes that are consumed by Read are zeroed before the read pointer advances.
+
+The head, which lives after the ring data, has two layouts:
+V1: ReadPtr, WritePtr, Waiters, all on the same cache line.
+V2: The read pointer and the write pointer each get their own cache line. Next to
+    each pointer is that side's copy of the other side's pointer. The reader only
+    loads the real write pointer when its cached copy says there is not enough
+    to read, and producers only load the real read pointer when their cached copy
+    says there is not enough space. Waiters gets a third cache line.
+    In multi-producer mode, Unreserve can move the write pointer backwards, so the
+    reader's cached copy may be ahead of it. That is harmless, because the reader
+    only trusts MessageHead::Cmd to tell it what has been committed.
+V1 is only kept around so that we can benchmark against it.
 */
+enum class RingLayout
+{
+	V1,
+	V2,
+};
+
 class RingBuffer
 {
 public:
-	// Size of read & write pointers
-	static const size_t HeadSize = sizeof(size_t) * 2;
+	static const size_t CacheLineSize = 64;
+
+	// Size of the head. This is large enough for either layout.
+	static const size_t HeadSize = CacheLineSize * 3;
 
-	uint8_t* Buf  = nullptr;
-	size_t   Size = 0; // The size of the pure ring buffer (ie this number excludes the extra space used by the Read and Write pointers)
+	uint8_t*   Buf    = nullptr;
+	size_t     Size   = 0; // The size of the pure ring buffer (ie this number excludes the extra space used by the Read and Write pointers)
+	RingLayout Layout = RingLayout::V2;
+	size_t     Held   = 0; // Reader only. Bytes after the read pointer which have been consumed, but not yet released. See Hold.
 
 	// You must call Init() with a size that is a power of 2. However, the actual buffer
 	// must be at least size + HeadSize large.
 	// If reset is true, then the read and write pointers are set to 0.
-	void   Init(void* buf, size_t size, bool reset);
-	void   Write(const void* data, size_t len);
-	void   WriteNoCommit(size_t offset, const void* data, size_t len);
-	size_t Read(void* data, size_t max_len);
-	void   ReadNoCopy(size_t len, void*& ptr1, size_t& ptr1_size, void*& ptr2, size_t& ptr2_size) const;
-
-	std::atomic<size_t>* ReadPtr() const;
-	std::atomic<size_t>* WritePtr() const;
-
+	void   Init(void* buf, size_t size, bool reset, RingLayout layout = RingLayout::V2);
+	void   Write(const void* data, size_t len);                 // Single producer. Write data (if not null) at the write pointer, and advance the write pointer.
+	bool   PrepareWrite(size_t len, size_t& pos);               // Single producer. Returns true if len contiguous bytes are available at pos, which is the write pointer. May commit a skip record to get there.
+	bool   Reserve(size_t len, size_t& pos);                    // Multi-producer. Atomically claim len contiguous bytes, starting at pos. Returns false if there is not enough space.
+	bool   Unreserve(size_t pos, size_t len, size_t newLen);    // Multi-producer. Shrink the most recent reservation. Returns false if another reservation followed it.
+	void   WriteAt(size_t pos, const void* data, size_t len);   // Write into a region that was claimed by PrepareWrite or Reserve
+	void   ZeroAt(size_t pos, size_t len);                      // Zero part of a region that was claimed by PrepareWrite or Reserve
+	size_t Read(void* data, size_t max_len);                    // Copy out (if data is not null), zero, and consume bytes. Must not straddle the end of the ring.
+	void   Hold(size_t len) { Held += len; }                    // Reader only. Consume len bytes, but leave them in place, so that they can be written out in a batch.
+	void   Release();                                           // Reader only. Zero the held bytes, and advance the read pointer past them.
+	void   ReleaseTo(size_t pos);                               // Reader only. Like Release, but only up to pos, which is a ReadCursor() from earlier.
+	size_t ReadCursor() const;                                  // Reader only. The read pointer, plus the held bytes.
+
+	std::atomic<size_t>*   ReadPtr() const;
+	std::atomic<size_t>*   WritePtr() const;
+	std::atomic<size_t>*   CachedWritePtr() const; // V2 only. The reader's last sighting of WritePtr.
+	std::atomic<size_t>*   CachedReadPtr() const;  // V2 only. The producers' last sighting of ReadPtr.
+	std::atomic<uint32_t>* ReadPtrWord() const;    // The low 32 bits of the read pointer, which producers wait on with a futex when the ring is full
+	std::atomic<uint32_t>* Waiters() const;        // Number of producers that are waiting on ReadPtrWord
+
+	uint8_t* PtrAt(size_t pos) const { return Buf + (pos & (Size - 1)); }
+	size_t   TailAt(size_t pos) const { return Size - (pos & (Size - 1)); } // Number of bytes from pos until the end of the ring
+
+	// Exact, but these touch both the read and the write pointer
 	size_t AvailableForRead() const;
 	size_t AvailableForWrite() const;
-	size_t MaxAvailableForWrite() const { return Size - 1; } // The amount of data you can transmit atomically, when the buffer is empty
+
+	// Cheap checks, which consult the cached copy of the other side's pointer first
+	bool   CanRead(size_t len) const;  // Reader only
+	bool   CanWrite(size_t len) const; // Single producer only (or with the producer lock held)
+	size_t MaxAvailableForWrite() const { return Size; } // The amount of data you can transmit atomically, when the buffer is empty
+
+private:
+	void WriteSkip(size_t pos, size_t len); // Fill [pos, pos + len) with a skip record, and publish it
 };
 
 // The TimeKeeper's job is to speed up the creation of textual time stamps (eg. 2015-07-15T14:53:51.979+0200)
-// We do this by keeping a cache of the date string.
-// That means we only need to build up the time string for each request, which is much simpler than computing the calendar day.
+// We do this by keeping a cache of the entire time stamp, for the current second. The cache is guarded by a seqlock,
+// so readers never block, and only need to patch in the fraction of a second. Once per second, one thread takes the lock and
+// rebuilds the cache. Computing the calendar day is more expensive still, so we only do that once per day.
+// SetFormat turns a TimeFormat into a TimeLayout once, so formatting never has to interpret the format.
+// With ClockSource::TSC, the time is extrapolated from the CPU's time stamp counter, instead of asking the OS.
+// The TSC is anchored to the system clock again once the anchor is a second old, by whichever thread notices first.
 class TimeKeeper
 {
 public:
+	static const uint32_t MaxLen         = 34;                 // 2015-07-15T14:53:51.979123456+0200, which is the longest TimeFormat
+	static const uint32_t TSCShift       = 24;                 // Fractional bits of NSPerTick
+	static const uint64_t MaxTSCDelta    = (uint64_t) 1 << 34; // Beyond this many ticks since the anchor, delta * NSPerTick could overflow
+	static const uint32_t TSCCalibrateMS = 10;                 // Initial calibration interval of the TSC
+
 	TimeKeeper();
 
-	void        Format(char* buf) const;
+	// This must be called before other threads use the TimeKeeper. The default is TimeFormat::LocalMilli.
+	void     SetFormat(TimeFormat format);
+	uint32_t Len() const { return Layout.Len; } // Length of a time stamp in the current format
+
+	// Returns false if the TSC was requested, but is not invariant (or this is not an x86 CPU), in which case the system clock is used.
+	bool        SetClockSource(ClockSource source);
+	ClockSource GetClockSource() const;
+
+	uint64_t    Now() const;                                // Unix time in nanoseconds, from the clock source
+	void        Format(char* buf) const;                    // Write the Len() bytes of the current time stamp into buf
+	void        FormatAt(uint64_t unixNS, char* buf) const; // Write the Len() bytes of the time stamp of unixNS into buf
 	static void FormatUintDecimal(uint32_t ndigit, char* buf, uint32_t v);
 	static void FormatUintHex(uint32_t ndigit, char* buf, uint32_t v);
 
 private:
-	int                   TimezoneMinutes = 0;  // Minutes west of UTC
-	std::atomic<uint64_t> LocalDayStartSeconds; // Unix time, in local time zone, of start of today.
-	char                  DateStr[11];          // 2015-01-01
-	char                  TimeZoneStr[6];       // +0200
-	std::mutex            Lock;                 // Guards access to NewDay()
+	// The fields of a time stamp in the current TimeFormat. The date and time always start at 0, and the fraction at 20.
+	struct TimeLayout
+	{
+		uint8_t Len        = 28;    // Length of the whole time stamp
+		uint8_t FracDigits = 3;     // Number of digits after the decimal point. The time zone follows them.
+		bool    IsEpoch    = false; // The time stamp is just nanoseconds since the epoch, with no date, fraction, or time zone
+	};
+
+	TimeLayout            Layout;
+	int                   TimezoneMinutes      = 0; // Minutes west of UTC
+	int                   OffsetMinutes        = 0; // TimezoneMinutes for a local TimeFormat, or zero for UTC
+	uint64_t              LocalDayStartSeconds = 0; // Unix time, in the time zone of the format, of start of today. Guarded by Lock.
+	char                  DateStr[11];              // 2015-01-01. Guarded by Lock.
+	char                  TimeZoneStr[6];           // +0200, or Z
+	std::mutex            Lock;                     // Guards NewSecond() and NewDay()
+	std::atomic<uint32_t> Version;                  // Seqlock over CachedSecond and Cached. Odd while the cache is being written.
+	std::atomic<uint64_t> CachedSecond;             // Unix time, in the time zone of the format, of the time stamp in Cached
+	std::atomic<uint64_t> Cached[5];                // The time stamp for CachedSecond, with a zero fraction. Atomic words, so that a torn read is not UB.
+	std::atomic<uint32_t> ClockVersion;             // Seqlock over AnchorTSC, AnchorNS, NSPerTick and ReanchorTicks
+	std::atomic<uint64_t> AnchorTSC;                // TSC reading at AnchorNS
+	std::atomic<uint64_t> AnchorNS;                 // Unix time in nanoseconds, at AnchorTSC
+	std::atomic<uint64_t> NSPerTick;                // Nanoseconds per TSC tick, with TSCShift fractional bits. Zero when the TSC is not in use.
+	std::atomic<uint64_t> ReanchorTicks;            // Roughly one second of ticks, but at most MaxTSCDelta. An older anchor is anchored again.
+	uint64_t              BaselineTSC = 0;          // Start of the interval over which Reanchor measures the TSC rate. Guarded by Lock.
+	uint64_t              BaselineNS  = 0;          // System time at BaselineTSC. Guarded by Lock.
 
 // Dynamically load GetSystemTimePreciseAsFileTime so that we can fall back to GetSystemTimeAsFileTime on a Windows 7 class OS.
 #ifdef _WIN32
 	void(WINAPI* __GetSystemTimePreciseAsFileTime)(_Out_ LPFILETIME lpSystemTimeAsFileTime) = nullptr;
 #endif
 
-	void NewDay() const;
-	void UnixTimeNow(uint64_t& seconds, uint32_t& nano) const;
+	bool ReadCache(uint64_t seconds, char* buf) const;
+	void NewSecond(uint64_t seconds, char* buf) const;
+	void BuildPrefix(uint64_t seconds, char* buf);
+	void NewDay(uint64_t seconds);
+	bool TSCTimeNS(uint64_t& ns, bool& stale) const;
+	void TryReanchor() const;
+	void Reanchor();
+	void PublishAnchor(uint64_t tsc, uint64_t ns, uint64_t mult);
+	void PublishCache(uint64_t seconds, const char* buf);
+
+	uint64_t        SystemTimeNS() const;
+	void            ReadClockPair(uint64_t& tsc, uint64_t& ns) const;
+	static uint64_t ReadTSC();
+	static bool     HaveInvariantTSC();
 };
 
 // A command sent over the ring buffer
-enum class Command : uint32_t
+enum class Command : uint8_t
+{
+	Null    = 0,
+	Close   = 1,
+	LogMsg  = 2,
+	Pad     = 3, // Unused space. PayloadLen is the size of the entire pad, including its header, which may be only 8 bytes long.
+	LogFmt  = 4, // A log message that the logger slave must format. The payload starts with a DeferredMsgHead.
+	LogLine = 5, // A log message whose prefix the logger slave must render. The payload is a RawPrefix, followed by the rest of the line.
+};
+
+// Flags of a MessageHead
+enum MessageFlags : uint8_t
 {
-	Null   = 0,
-	Close  = 1,
-	LogMsg = 2,
+	MessageFlagStamp = 1, // The head is followed by a uint64_t monotonic time stamp, which is used to merge per-thread rings
+	MessageFlagSeq   = 2, // The head (and its time stamp, if any) is followed by the message's uint64_t sequence number. See SharedControl::CommittedSeq.
 };
 
-// Header of a message sent over the ring buffer
+// Header of a message sent over the ring buffer.
+// Messages start on an 8 byte boundary inside the ring, and never straddle the end of the ring.
+// The first 4 bytes double as the commit flag of a message. A producer writes the rest of the message first,
+// and then publishes those 4 bytes with release semantics. The reader treats Command::Null as "not yet committed".
+// The head itself is 8 bytes, but every log message is followed by its 8 byte sequence number, so the common case
+// pays for 16 bytes of header, and 24 with the time stamps of per-thread rings. The logger slave cannot derive the
+// sequence number, because producers commit messages in a different order to the one in which they reserve them.
 struct MessageHead
 {
 	Command  Cmd        = Command::Null;
-	uint32_t Padding    = 0; // ensure PayloadLen starts at byte 8, and entire structure is defined.
-	size_t   PayloadLen = 0;
+	uint8_t  Flags      = 0; // MessageFlags
+	uint8_t  Level      = 0; // uberlog::Level of a log message. The writer uses this for SyncPolicy::OnWarn.
+	uint8_t  Reserved   = 0;
+	uint32_t PayloadLen = 0;
+
+	uint32_t CommitWord() const
+	{
+		uint32_t w;
+		memcpy(&w, this, sizeof(w));
+		return w;
+	}
+	size_t HeadLen() const { return sizeof(MessageHead) + ((Flags & MessageFlagStamp) ? sizeof(uint64_t) : 0) + ((Flags & MessageFlagSeq) ? sizeof(uint64_t) : 0); }
+};
+
+static const size_t MessageAlign = 8;
+
+// Number of bytes that a message header occupies, including the sequence number, and the optional time stamp
+inline size_t MessageHeadSize(bool stamped)
+{
+	return sizeof(MessageHead) + sizeof(uint64_t) + (stamped ? sizeof(uint64_t) : 0);
+}
+
+// Number of bytes that a message occupies inside the ring buffer, including its header and alignment padding
+inline size_t MessageSize(size_t payloadLen, bool stamped)
+{
+	return (MessageHeadSize(stamped) + payloadLen + MessageAlign - 1) & ~(MessageAlign - 1);
+}
+
+// Payload of Command::LogFmt. The head is followed by the message prefix (time, level, thread id),
+// and then by NumArgs DeferredArgs, the first of which starts on an 8 byte boundary.
+// If IsRawPrefix is set, then the prefix is a RawPrefix, which the logger slave renders.
+struct DeferredMsgHead
+{
+	uint32_t FormatID;    // Offset of the format string inside SharedControl::FormatTable
+	uint16_t NumArgs;     // Number of DeferredArgs
+	uint8_t  PrefixLen;   // Length of the message prefix
+	uint8_t  IsRawPrefix; // 1 if the prefix is a RawPrefix
+};
+
+// A serialized uberlog_tsf::fmtarg. Strings are copied, including their null terminator, into the space immediately
+// after the DeferredArg. The next DeferredArg starts on the following 8 byte boundary.
+struct DeferredArg
+{
+	uint32_t Type;  // uberlog_tsf::fmtarg::Types
+	uint32_t Len;   // Number of string bytes that follow. Zero for types other than strings.
+	uint64_t Value; // Bit pattern of the value, for types other than strings
+};
+
+// The time and thread id of a log message, in binary. With Logger::SetDeferredPrefix, producers send this instead of the
+// text at the start of the line, and the logger slave renders it with FormatLinePrefix. The level is in the MessageHead.
+struct RawPrefix
+{
+	uint64_t Time        = 0; // Unix time in nanoseconds, from TimeKeeper::Now(). Zero if IncludeDate is false.
+	uint32_t TID         = 0; // GetMyTID() of the producer
+	uint8_t  IncludeDate = 0; // Logger::IncludeDate, at the time of the message
+	uint8_t  Reserved[3] = {0};
 };
+
+static const size_t MaxLinePrefixLen = TimeKeeper::MaxLen + 14; // The longest result of FormatLinePrefix
+
+// Write the text at the start of a log line into buf, and return its length, which is tk.Len() + 14 with the date, or 13 without it.
+// See Logger::FormatPrefix for the layout.
+size_t FormatLinePrefix(char* buf, const TimeKeeper& tk, uint64_t unixNS, char levelChar, const char* tidHex, bool includeDate);
+
+// A ring buffer that is owned by a single producer thread
+struct ThreadRing
+{
+	RingBuffer   Ring;
+	shm_handle_t ShmHandle = NullShmHandle;
+	uint32_t     Index     = 0;    // Index into SharedControl::ThreadRings
+	bool         IsNew     = true; // True until the producer has seen the logger slave consume its first message
+};
+
+// Counters for monitoring, such as by the uberlog-stat tool. Everything is updated with relaxed atomics, so a reader
+// may see a slightly inconsistent picture. The number of messages and bytes produced are in SharedControl, next to
+// CommittedSeq, because producers update them on every message.
+struct SharedStats
+{
+	static const uint32_t NumLatencyBuckets = 24; // Bucket i counts writes that took less than 2^i microseconds, and at least half of that
+
+	// Producers. These are only touched when the ring is full.
+	std::atomic<uint64_t> Stalls;  // Number of times that a producer had to wait for space in the ring
+	std::atomic<uint64_t> StallNS; // Total time that producers spent waiting for space in the ring
+
+	// Logger slave
+	alignas(RingBuffer::CacheLineSize) std::atomic<uint64_t> MaxBacklog; // High-water mark of AvailableForRead, of any ring
+	std::atomic<uint64_t>                                    Writes;     // Calls to write or writev, and io_uring writes
+	std::atomic<uint64_t>                                    BytesWritten;
+	std::atomic<uint64_t>                                    Rollovers;
+	std::atomic<uint64_t>                                    RolloverNS;                      // Time that the writer spent rolling over, not counting the background work
+	std::atomic<uint64_t>                                    WriteLatency[NumLatencyBuckets]; // Histogram of the time from the start of a write until it completed
+
+	static uint32_t LatencyBucket(uint64_t nanoseconds)
+	{
+		uint32_t b = 0;
+		for (uint64_t us = nanoseconds / 1000; us != 0 && b < NumLatencyBuckets - 1; us >>= 1)
+			b++;
+		return b;
+	}
+};
+
+// The control block lives at the start of the primary shared memory segment, ahead of the primary ring buffer.
+// It is how the logger slave discovers state that is created after it was launched, such as per-thread rings.
+struct SharedControl
+{
+	static const uint32_t MaxThreadRings  = 256;
+	static const uint32_t FormatTableSize = 64 * 1024;
+
+	struct ThreadRingEntry
+	{
+		uint32_t TID;
+		uint32_t Padding;
+	};
+
+	uint64_t              ThreadRingSize; // Size of every per-thread ring buffer
+	std::atomic<uint32_t> NumThreadRings; // Number of published entries in ThreadRings. Shared memory segment i+1 holds ring i.
+	std::atomic<uint32_t> WriterAsleep;   // Non-zero while the logger slave is blocked on this word, waiting for messages
+	std::atomic<uint32_t> SpaceArmed;     // Non-zero if a producer wants SpaceEventFD to be signalled when the logger slave consumes a message
+	int32_t               SpaceEventFD;   // An eventfd that the logger slave inherits from its parent, or -1
+	std::atomic<uint64_t> Dropped;        // Number of messages that producers have discarded, because the ring buffer was full
+	std::atomic<uint64_t> WrittenSeq;     // Logger slave. Every message up to and including this sequence number has been written to the log file.
+	std::atomic<uint64_t> SyncedSeq;      // Logger slave. Like WrittenSeq, but the messages have also been synced to disk. See SyncPolicy.
+	std::atomic<uint32_t> SeqWord;        // Bumped by the logger slave when it advances WrittenSeq or SyncedSeq, if SeqWaiters is non-zero
+	std::atomic<uint32_t> SeqWaiters;     // Number of producers that are blocked on SeqWord. See Logger::WaitFor.
+	std::atomic<uint32_t> IncludeDate;    // Producers. Logger::IncludeDate of the most recently reserved log message. See LoggerSlave::ReportDropped.
+
+	// Producers. The sequence number of the most recently committed log message. Messages are numbered from 1, in the
+	// order in which they were committed, which may differ slightly from the order in which they appear in the rings.
+	// This has a cache line to itself, because every producer increments it.
+	alignas(RingBuffer::CacheLineSize) std::atomic<uint64_t> CommittedSeq;
+	std::atomic<uint64_t>                                    BytesProduced; // Producers. Payload bytes of all log messages. Shares CommittedSeq's cache line.
+
+	alignas(RingBuffer::CacheLineSize) SharedStats Stats;
+
+	alignas(RingBuffer::CacheLineSize) ThreadRingEntry ThreadRings[MaxThreadRings];
+	char                  FormatTable[FormatTableSize]; // Format strings of deferred log messages. Each is null terminated. Only appended to.
+};
+
+// A message that could not be placed into the ring buffer, because it was full. See OverflowPolicy::Spill.
+struct SpilledMessage
+{
+	Command     Cmd   = Command::Null;
+	uint8_t     Level = 0;
+	uint64_t    Stamp = 0;
+	uint64_t    Seq   = 0;
+	std::string Payload;
+};
+
+// Space reserved for SharedControl, ahead of the primary ring buffer
+static const size_t SharedControlSize = (sizeof(SharedControl) + 4095) & ~((size_t) 4095);
 } // namespace internal
 
 // Logging levels
@@ -163,6 +471,58 @@ static char LevelChar(Level lev)
 
 UBERLOG_API Level ParseLevel(const char* level);
 
+// How application threads place their messages into the ring buffer
+enum class ProducerMode
+{
+	Locked,    // All threads serialize on a mutex before writing into the ring buffer. This is the fallback.
+	LockFree,  // Threads claim space with an atomic compare-and-swap on the write pointer, and commit their messages individually.
+	PerThread, // Every thread gets its own ring buffer, which is created on the first message from that thread. The logger slave merges them by time.
+};
+
+// What to do with a log message when the ring buffer is full
+enum class OverflowPolicy
+{
+	Block,         // Wait for the logger slave to make space. This is the default.
+	Drop,          // Discard the message. The logger slave writes a line that says how many messages were dropped.
+	DropBelowWarn, // Discard Debug and Info messages, as with Drop. Warn and above wait for space, as with Block.
+	Spill,         // Queue the message in memory, and move it into the ring buffer later, from a background thread.
+};
+
+// When the logger slave forces log data out to disk
+enum class SyncPolicy
+{
+	Never,       // Leave it to the OS. This is the default.
+	Periodic,    // fdatasync once the given number of milliseconds or bytes have passed since the last sync
+	WriteBehind, // Start writeback of every region of the given number of bytes with sync_file_range, and wait for the region before it
+	OnWarn,      // fdatasync after writing a batch that contains a Warn or higher message
+};
+
+/* A region of the ring buffer that has been claimed by Logger::Reserve, and which must be released by Logger::Commit.
+Write your message into the Len bytes starting at Ptr. The region is always contiguous.
+*/
+struct UBERLOG_API Reservation
+{
+	char*  Ptr = nullptr;
+	size_t Len = 0;
+
+	size_t Size() const { return Len; }
+
+	// Copy data into the region, at the given offset
+	void Write(size_t offset, const void* data, size_t len);
+
+private:
+	friend class Logger;
+	internal::RingBuffer*     Ring          = nullptr;
+	internal::ThreadRing*     Thread        = nullptr; // Non-null if Ring is the calling thread's own ring
+	internal::SpilledMessage* Spilled       = nullptr; // Non-null if the region is in memory, instead of the ring. See OverflowPolicy::Spill.
+	size_t                    Pos           = 0;       // Position of the MessageHead inside Ring
+	bool                      MultiProducer = false;
+	bool                      HoldsLock     = false; // True if Logger::Lock is held until Commit
+	uint8_t                   Slot          = 0;     // Producer count that this reservation holds until Commit. See Logger::EnterProducer.
+	uint64_t                  Stamp         = 0;     // Non-zero if the message carries a time stamp
+	uint8_t                   Level         = 0;     // uberlog::Level
+};
+
 /* A logger
 Use this from your application to write logs. This class will launch the child process
 and setup a memory mapped buffer which is used to communicate with the child process.
@@ -215,8 +575,73 @@ public:
 	// The maximum size of a log message is limited by the size of the ring buffer.
 	void SetRingBufferSize(size_t ringBufferSize);
 
+	// Set the way in which concurrent threads write into the ring buffer. This must be called before Open().
+	// The default is ProducerMode::LockFree.
+	// With ProducerMode::PerThread, every thread's ring buffer is the size specified by SetRingBufferSize. After
+	// SharedControl::MaxThreadRings threads have been given rings, further threads share the primary ring, under a lock.
+	void SetProducerMode(ProducerMode mode);
+
+	// Set what happens to a log message when the ring buffer is full. This must be called before Open().
+	// With OverflowPolicy::Spill, at most spillLimit bytes are queued in memory. Beyond that, messages are dropped.
+	// LogRaw and Reserve count as Level::Info. TryReserve is not affected by the policy.
+	void SetOverflowPolicy(OverflowPolicy policy, size_t spillLimit = 64 * 1024 * 1024);
+
+	// Set when the logger slave forces log data out to disk. This must be called before Open().
+	// intervalMS is only used by SyncPolicy::Periodic. intervalBytes is used by Periodic and WriteBehind. Zero means no limit.
+	// For OnWarn, the level of each message travels in its header, so producers pay nothing extra. LogRaw and Reserve count as Level::Info.
+	// WriteBehind only has an effect on Linux. Elsewhere, it behaves like Never.
+	void SetSyncPolicy(SyncPolicy policy, uint32_t intervalMS = 1000, uint64_t intervalBytes = 1024 * 1024);
+
+	// Drop log data from the OS page cache once it has been written to disk, so that it doesn't push other pages
+	// out of the cache. This must be called before Open(). Pages can only be dropped once they have been written back,
+	// so with SyncPolicy::Never, the logger slave uses SyncPolicy::WriteBehind instead. This only has an effect on Linux.
+	void SetDropPageCache(bool drop);
+
+	// Move the formatting of log messages out of the calling thread, and into the logger slave. This must be called before Open().
+	// When enabled, the arguments of a log message are copied into the ring buffer, and the format string is identified by
+	// an entry in a table in shared memory. Every distinct format string is added to that table the first time it is seen.
+	// If the table fills up, then messages with new format strings are formatted by the caller, as usual.
+	// Messages are still formatted by the caller when TeeStdOut is enabled, and for Level::Fatal.
+	void SetDeferredFormatting(bool deferred);
+
+	// Move the rendering of the time stamp, level, and thread id at the start of each line into the logger slave.
+	// This must be called before Open(). Producers only read the clock, and send the raw values in binary, so the date
+	// formatting is taken off your threads entirely. The log file is byte for byte the same.
+	// The prefix is still rendered by the caller when TeeStdOut is enabled, for Level::Fatal, and for LogRaw.
+	void SetDeferredPrefix(bool deferred);
+
 	// Set the log archive settings. This must be called before Open().
-	void SetArchiveSettings(int64_t maxFileSize, int32_t maxNumArchives);
+	// Besides keeping at most maxNumArchives archives, the oldest archives are also deleted once all of the archives
+	// together are larger than maxArchiveBytes, or once they are older than maxArchiveAgeSeconds. Zero means no limit.
+	void SetArchiveSettings(int64_t maxFileSize, int32_t maxNumArchives, int64_t maxArchiveBytes = 0, int64_t maxArchiveAgeSeconds = 0);
+
+	// Set the size of the log writer's swap buffers. This must be called before Open().
+	// The log writer copies messages out of the ring buffer into a swap buffer, and hands it to its I/O thread once
+	// it has this many bytes. The default is LoggerSlaveWriteBufferSize.
+	void SetWriteBufferSize(size_t writeBufferSize);
+
+	// Set the number of swap buffers that the log writer may have in flight at once. This must be called before Open().
+	// With a depth above 1, the log writer's I/O thread submits its writes through io_uring, instead of waiting for
+	// each write before it starts the next one. If io_uring is not available (it is Linux only, and
+	// may be disabled), then the log writer falls back to synchronous writes. The default is 1, which means synchronous writes.
+	void SetWriteQueueDepth(uint32_t depth);
+
+	// Allocate the disk space for each log file up front, up to its maximum size. This must be called before Open().
+	// This saves the file system from allocating blocks, and journaling a size change, on every write. The file size
+	// stays correct while we're writing, and unused space is given back when the file is rolled over or closed.
+	// This only has an effect on Linux, on file systems that support fallocate, such as ext4 and XFS.
+	void SetPreallocate(bool preallocate);
+
+	// Read time stamps from the CPU's time stamp counter, instead of asking the OS for the time. This must be called before Open().
+	// Reading the TSC costs a few nanoseconds, while clock_gettime costs 20 to 30 ns, or much more on a VM that doesn't expose
+	// a vDSO clock. The TSC is calibrated against the system clock when this is called, which takes TimeKeeper::TSCCalibrateMS,
+	// and it is anchored to the system clock again once per second. If the CPU does not have an invariant TSC, or is not x86,
+	// then the system clock stays in use.
+	void SetClockSource(ClockSource source);
+
+	// Set the precision and the time zone of the time at the start of each line. This must be called before Open().
+	// The format is turned into a fixed layout at Open(), so all of the formats cost about the same.
+	void SetTimeFormat(TimeFormat format);
 
 	// Set the log level.
 	void SetLevel(uberlog::Level level);
@@ -227,6 +652,38 @@ public:
 	// Low level "write bytes to log file"
 	void LogRaw(const void* data, size_t len) const;
 
+	// Claim space for a message of up to len bytes, directly inside the ring buffer, so that you can produce the
+	// message in place, instead of building it up elsewhere and then having LogRaw copy it.
+	// Every successful Reserve must be followed by a Commit, on the same thread. With ProducerMode::Locked,
+	// the logger's lock is held from Reserve until Commit.
+	// Returns false if the log is not open, or if it was opened with OpenStdOut.
+	bool Reserve(size_t len, Reservation& r) const;
+
+	// Publish the first len bytes of a reservation. len may be less than the size that was reserved.
+	// If len is zero, then the reservation is abandoned, and nothing is logged.
+	void Commit(Reservation& r, size_t len) const;
+
+	// Like Reserve, but instead of waiting for space when the ring buffer is full, return false.
+	// When that happens, SpaceEventFD becomes readable once the logger slave has consumed a message, so that
+	// an event loop can try again later, instead of blocking.
+	bool TryReserve(size_t len, Reservation& r) const;
+
+	// An eventfd that is signalled after TryReserve has failed, and there may now be space in the ring buffer.
+	// Read from it to reset it. This is only available on linux, and while the log is open. Otherwise, it is -1.
+	int SpaceEventFD() const { return SpaceEvent; }
+
+	// Returns the sequence number of the most recent log message, from any thread. Messages are numbered from 1, in the
+	// order in which they were committed. Pass this to WaitFor, to find out when your messages have reached the log file.
+	uint64_t Sequence() const;
+
+	// Wait until every message up to and including seq has been written to the log file. If synced is true, then also
+	// wait until those messages have been synced to disk, which only happens with SyncPolicy::Periodic and SyncPolicy::OnWarn.
+	// Returns false if timeoutMS passes first. If the log is not open, or was opened with OpenStdOut, this returns true immediately.
+	bool WaitFor(uint64_t seq, uint32_t timeoutMS = 10000, bool synced = false) const;
+
+	// Wait until every message that was committed before this call has been written to the log file. See WaitFor.
+	bool Flush(uint32_t timeoutMS = 10000, bool synced = false) const;
+
 	// Write a log message in the default uberlog format, which is "Date [Level] ThreadID Message"
 	template <typename... Args>
 	void Log(Level level, const char* format_str, const Args&... args) const
@@ -234,25 +691,11 @@ public:
 		if (level < Level)
 			return;
 
-		const bool   includeDate  = IncludeDate;
-		const size_t fixedPortion = includeDate ? 42 : 13;
-
-		// IncludeDate = true
-		// [------------- 42 characters ------------]
-		// [------ 28 characters -----]
-		// 2015-07-15T14:53:51.979+0200 [I] 00001fdc The log message here
-
-		// IncludeDate = false
-		// [  13 chars ]
-		// [I] 00001fdc The log message here
-
-		const size_t statbufsize = 200;
-		char         statbuf[statbufsize];
-
-		uberlog_tsf::StrLenPair msg = uberlog_tsf::fmt_buf(statbuf + fixedPortion, statbufsize - fixedPortion - EolLen, format_str, args...);
-
 		// Split this into two phases, to reduce the amount of code in the header
-		LogDefaultFormat_Phase2(level, includeDate, msg, msg.Str == statbuf + fixedPortion);
+		const auto          num_args = sizeof...(Args);
+		uberlog_tsf::fmtarg pack_array[num_args + 1]; // +1 for zero args case
+		uberlog_tsf::internal::fmt_pack(pack_array, args...);
+		LogDefaultFormat_Phase2(level, format_str, (ssize_t) num_args, pack_array);
 	}
 
 	template <typename... Args>
@@ -291,28 +734,105 @@ private:
 	size_t                      RingBufferSize            = 1 * 1024 * 1024;
 	int64_t                     MaxFileSize               = 30 * 1048576;
 	int32_t                     MaxNumArchives            = 3;
+	int64_t                     MaxArchiveBytes           = 0;
+	int64_t                     MaxArchiveAgeSeconds      = 0;
+	bool                        Preallocate               = false;
+	size_t                      WriteBufferSize           = internal::LoggerSlaveWriteBufferSize;
+	uint32_t                    WriteQueueDepth           = 1;
 	uint32_t                    TimeoutChildProcessInitMS = 10000; // Time we wait for our child process to come alive
 	const int                   EolLen                    = uberlog::internal::UseCRLF ? 2 : 1;
-	bool                        IsOpen                    = false;
+	ProducerMode                Mode                      = ProducerMode::LockFree;
+	OverflowPolicy              Overflow                  = OverflowPolicy::Block;
+	size_t                      SpillLimit                = 64 * 1024 * 1024;
+	SyncPolicy                  Sync                      = SyncPolicy::Never;
+	uint32_t                    SyncIntervalMS            = 1000;
+	uint64_t                    SyncIntervalBytes         = 1024 * 1024;
+	bool                        DropPageCache             = false;
 	bool                        IsStdOutMode              = false;
 	int                         StdOutFD                  = -1;
+	int                         SpaceEvent                = -1; // See SpaceEventFD()
+	std::atomic<bool>           IsOpen;
 	std::atomic<bool>           IsFirstLogMessage;
 	std::atomic<uberlog::Level> Level;
-	std::mutex                  Lock; // Guards access to all public functions
+	std::mutex                  Lock; // Guards access to all public functions, except for the logging functions when Mode is LockFree or PerThread
 	internal::TimeKeeper        TK;
 	internal::RingBuffer        Ring;
+	internal::SharedControl*    Control = nullptr;
+	std::atomic<uint64_t>       InstanceID; // Unique for every Open(), so that stale thread-local ring pointers can be detected. Published by IsOpen.
 	internal::proc_handle_t     HChildProcess = nullptr; // not used on linux
 	internal::proc_id_t         ChildPID      = -1;
 	internal::shm_handle_t      ShmHandle     = internal::NullShmHandle;
 
+	std::vector<internal::ThreadRing*> ThreadRings; // Only used when Mode is PerThread. Guarded by Lock.
+
+	// The number of producers that are between Reserve and Commit. Close waits for these to reach zero before
+	// it unmaps the ring. The count is split over a few cache lines, so that threads don't contend for one.
+	struct ProducerCount
+	{
+		std::atomic<uint32_t> N;
+		char                  Pad[internal::RingBuffer::CacheLineSize - sizeof(std::atomic<uint32_t>)];
+	};
+	static const uint32_t NumProducerCounts = 16;
+	ProducerCount         Producers[NumProducerCounts];
+
+	// Only used when Overflow is OverflowPolicy::Spill
+	std::mutex                           SpillLock; // Guards Spill, SpillBytes, SpillStop, and SpillThread
+	std::condition_variable              SpillCV;
+	std::deque<internal::SpilledMessage> Spill;
+	size_t                               SpillBytes = 0;
+	bool                                 SpillStop  = false;
+	std::atomic<bool>                    SpillActive; // True from the moment that a message is spilled, until Spill has been emptied into the ring
+	std::thread                          SpillThread;
+
+	// Maps from format string pointer to an offset inside Control->FormatTable. Lookups are lock free, but insertions are guarded by Lock.
+	// An entry is only used if the string at the pointer still matches the string in the table, because the pointer may have been reused.
+	struct FormatCacheEntry
+	{
+		std::atomic<const char*> Str;
+		uint32_t                 ID;
+	};
+	static const size_t   FormatCacheSize = 1024; // Must be a power of 2
+	static const uint32_t NoFormatID      = UINT32_MAX;
+	bool                  Deferred        = false;
+	bool                  DeferredPrefix  = false;
+	TimeFormat            TimeFmt         = TimeFormat::LocalMilli;
+	FormatCacheEntry*     FormatCache     = nullptr;
+	uint32_t              FormatTableUsed = 0; // Guarded by Lock
+
 	//	Special state for tests
-	char _Test_OverridePrefix[42] = {0};
+	char _Test_OverridePrefix[internal::MaxLinePrefixLen] = {0}; // Copied in place of the first PrefixLen() bytes of every line
 
 	bool Open();
 	void SendMessage(internal::Command cmd, const void* payload, size_t payload_len);
+	void LogRawAtLevel(const void* data, size_t len, uberlog::Level level) const;
+	bool WaitForSpace(internal::RingBuffer& ring, bool multiProducer, size_t len, size_t& pos, bool wait, bool armSpaceEvent);
+	bool ReserveSpace(size_t len, Reservation& r, bool wait, uberlog::Level level) const;
+	void WarnIfNotOpen(const char* entryPoint) const;
+	bool ReserveRegion(size_t len, Reservation& r, bool wait, uberlog::Level level) const;
+	bool EnterProducer(uint32_t& slot) const;
+	void LeaveProducer(uint32_t slot) const;
+	void WaitForProducers();
+	bool ReserveSpill(size_t len, Reservation& r, uberlog::Level level) const;
+	void PushSpill(Reservation& r, internal::Command cmd, size_t len) const;
+	void SpillLoop();
+	void StopSpill();
+	void CommitReservation(Reservation& r, internal::Command cmd, size_t len) const;
+	uint64_t CommitMessage(internal::RingBuffer& ring, bool multiProducer, size_t pos, size_t reservedLen, internal::Command cmd, size_t payloadLen, uint64_t stamp, uberlog::Level level = uberlog::Level::Info, uint64_t seq = 0);
+	void WakeWriter();
 	bool CreateRingBuffer();
 	void CloseRingBuffer();
-	bool WaitForRingToBeEmpty(uint32_t milliseconds) const; // Returns true if the ring is empty
-	void LogDefaultFormat_Phase2(uberlog::Level level, bool includeDate, uberlog_tsf::StrLenPair msg, bool buf_is_static) const;
+
+	internal::ThreadRing* GetThreadRing();
+	internal::ThreadRing* CreateThreadRing();
+	bool                  StampMessages() const { return Mode == ProducerMode::PerThread; } // The logger slave needs time stamps to merge per-thread rings
+	size_t                PrefixLen(bool includeDate) const { return includeDate ? TK.Len() + 14 : 13; }
+	void                  FormatPrefix(char* buf, uberlog::Level level, bool includeDate) const;
+	bool                  UseRawPrefix() const { return DeferredPrefix && !TeeStdOut && _Test_OverridePrefix[0] == 0; }
+	void                  WriteRawPrefix(char* buf, bool includeDate) const;
+	void                  PublishIncludeDate(bool includeDate) const;
+	void                  LogDefaultFormat_Phase2(uberlog::Level level, const char* format_str, ssize_t nargs, const uberlog_tsf::fmtarg* args) const;
+	uint32_t              FormatStringID(const char* format_str) const;
+	bool                  LogDeferred(uberlog::Level level, const char* format_str, ssize_t nargs, const uberlog_tsf::fmtarg* args) const;
+	void                  LogDefaultFormat_Buffered(uberlog::Level level, bool includeDate, const char* format_str, ssize_t nargs, const uberlog_tsf::fmtarg* args) const;
 };
 } // namespace uberlog
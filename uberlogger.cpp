@@ -14,6 +14,7 @@ into the log file.
 #include <fcntl.h>
 #include <sys/timeb.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #define write _write
 #define open _open
 #define close _close
@@ -22,25 +23,61 @@ into the log file.
 #ifdef __linux__
 #include <sys/types.h>
 #include <sys/fcntl.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <glob.h>
 #include <time.h>
+#include <errno.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+// We talk to io_uring directly, so that we don't depend on liburing
+#if defined(IORING_OFF_SQ_RING) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define UBERLOG_IO_URING 1
+#endif
 #endif
 
 #ifdef __APPLE__
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/fcntl.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <glob.h>
 #include <time.h>
 #define lseek64 lseek
 #endif
 
+#ifdef _WIN32
+struct iovec
+{
+	void*  iov_base;
+	size_t iov_len;
+};
+#endif
+
+#include <limits.h>
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#include <stddef.h>
 #include <string.h>
 #include <string>
 #include <vector>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <queue>
+#include <functional>
 #include <algorithm>
 #include <stdio.h>
 #include <stdint.h>
@@ -54,6 +91,158 @@ into the log file.
 namespace uberlog {
 namespace internal {
 
+#ifdef UBERLOG_IO_URING
+// Just enough of io_uring to submit writes, and collect their completions
+class Uring
+{
+public:
+	Uring()
+	{
+	}
+
+	~Uring()
+	{
+		Close();
+	}
+
+	// Returns false if the kernel doesn't support io_uring, or if it has been disabled
+	bool Init(unsigned entries)
+	{
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		FD = (int) syscall(__NR_io_uring_setup, entries, &p);
+		if (FD == -1)
+			return false;
+
+		SQMapSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+		CQMapSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		SQEsSize  = p.sq_entries * sizeof(io_uring_sqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			SQMapSize = CQMapSize = std::max(SQMapSize, CQMapSize);
+
+		SQMap = (uint8_t*) mmap(nullptr, SQMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, FD, IORING_OFF_SQ_RING);
+		if (SQMap == MAP_FAILED)
+			SQMap = nullptr;
+		if (SQMap && (p.features & IORING_FEAT_SINGLE_MMAP))
+			CQMap = SQMap;
+		else if (SQMap)
+			CQMap = (uint8_t*) mmap(nullptr, CQMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, FD, IORING_OFF_CQ_RING);
+		if (CQMap == MAP_FAILED)
+			CQMap = nullptr;
+		if (CQMap)
+			SQEs = (io_uring_sqe*) mmap(nullptr, SQEsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, FD, IORING_OFF_SQES);
+		if (SQEs == MAP_FAILED)
+			SQEs = nullptr;
+		if (!SQEs)
+		{
+			Close();
+			return false;
+		}
+
+		SQTail  = (std::atomic<uint32_t>*) (SQMap + p.sq_off.tail);
+		SQMask  = *(uint32_t*) (SQMap + p.sq_off.ring_mask);
+		SQArray = (uint32_t*) (SQMap + p.sq_off.array);
+		CQHead  = (std::atomic<uint32_t>*) (CQMap + p.cq_off.head);
+		CQTail  = (std::atomic<uint32_t>*) (CQMap + p.cq_off.tail);
+		CQMask  = *(uint32_t*) (CQMap + p.cq_off.ring_mask);
+		CQEs    = (io_uring_cqe*) (CQMap + p.cq_off.cqes);
+		return true;
+	}
+
+	void Close()
+	{
+		if (SQEs)
+			munmap(SQEs, SQEsSize);
+		if (CQMap && CQMap != SQMap)
+			munmap(CQMap, CQMapSize);
+		if (SQMap)
+			munmap(SQMap, SQMapSize);
+		if (FD != -1)
+			close(FD);
+		SQEs    = nullptr;
+		CQMap   = nullptr;
+		SQMap   = nullptr;
+		SQTail  = nullptr;
+		SQArray = nullptr;
+		CQHead  = nullptr;
+		CQTail  = nullptr;
+		CQEs    = nullptr;
+		FD      = -1;
+	}
+
+	bool IsOpen() const { return FD != -1; }
+
+	// Submit a writev at the given file offset. The pieces must stay alive until the write completes.
+	// The caller must not have more writes in flight than the number of entries that it asked for in Init.
+	bool SubmitWriteV(int fd, const iovec* iov, size_t niov, int64_t offset, uint64_t tag)
+	{
+		uint32_t      tail = SQTail->load(std::memory_order_relaxed);
+		uint32_t      idx  = tail & SQMask;
+		io_uring_sqe* sqe  = SQEs + idx;
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode    = IORING_OP_WRITEV;
+		sqe->fd        = fd;
+		sqe->addr      = (uint64_t) (uintptr_t) iov;
+		sqe->len       = (uint32_t) niov;
+		sqe->off       = (uint64_t) offset;
+		sqe->user_data = tag;
+		SQArray[idx]   = idx;
+		SQTail->store(tail + 1, std::memory_order_release);
+
+		int res;
+		do
+			res = (int) syscall(__NR_io_uring_enter, FD, 1, 0, 0, nullptr, 0);
+		while (res == -1 && errno == EINTR);
+		if (res != 1)
+		{
+			// The kernel didn't take the entry, so take it back, lest a later io_uring_enter submit it
+			SQTail->store(tail, std::memory_order_release);
+			return false;
+		}
+		return true;
+	}
+
+	// Fetch a completion. If wait is false, and there are no completions, then return false.
+	bool Complete(bool wait, uint64_t& tag, int32_t& result)
+	{
+		if (!IsOpen())
+			return false;
+		while (true)
+		{
+			uint32_t head = CQHead->load(std::memory_order_relaxed);
+			if (head != CQTail->load(std::memory_order_acquire))
+			{
+				const io_uring_cqe* cqe = CQEs + (head & CQMask);
+				tag                     = cqe->user_data;
+				result                  = cqe->res;
+				CQHead->store(head + 1, std::memory_order_release);
+				return true;
+			}
+			if (!wait)
+				return false;
+			if (syscall(__NR_io_uring_enter, FD, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) == -1 && errno != EINTR)
+				return false;
+		}
+	}
+
+private:
+	int                    FD        = -1;
+	uint8_t*               SQMap     = nullptr;
+	uint8_t*               CQMap     = nullptr;
+	io_uring_sqe*          SQEs      = nullptr;
+	size_t                 SQMapSize = 0;
+	size_t                 CQMapSize = 0;
+	size_t                 SQEsSize  = 0;
+	std::atomic<uint32_t>* SQTail    = nullptr;
+	uint32_t               SQMask    = 0;
+	uint32_t*              SQArray   = nullptr;
+	std::atomic<uint32_t>* CQHead    = nullptr;
+	std::atomic<uint32_t>* CQTail    = nullptr;
+	uint32_t               CQMask    = 0;
+	io_uring_cqe*          CQEs      = nullptr;
+};
+#endif
+
 // Manage the log file, and the log rotation.
 // Assume we are the only process writing to this log file.
 class LogFile
@@ -68,44 +257,253 @@ public:
 		Close();
 	}
 
-	void Init(std::string filename, int64_t maxFileSize, int32_t maxNumArchiveFiles)
+	// maxArchiveBytes and maxArchiveAgeMS are ignored if they are zero
+	void Init(std::string filename, int64_t maxFileSize, int32_t maxNumArchiveFiles, int64_t maxArchiveBytes = 0, int64_t maxArchiveAgeMS = 0, bool preallocate = false)
 	{
 		Filename           = filename;
 		MaxFileSize        = maxFileSize;
 		MaxNumArchiveFiles = maxNumArchiveFiles;
+		MaxArchiveBytes    = maxArchiveBytes;
+		MaxArchiveAgeMS    = maxArchiveAgeMS;
+		IsPreallocate      = preallocate;
+	}
+
+	// intervalMS and intervalBytes are ignored if they are zero. See uberlog::SyncPolicy.
+	void SetSyncPolicy(SyncPolicy policy, int64_t intervalMS, int64_t intervalBytes)
+	{
+		Sync              = policy;
+		SyncIntervalMS    = intervalMS;
+		SyncIntervalBytes = intervalBytes;
+	}
+
+	// Drop what we have written from the page cache, once it has been synced, or written back by SyncPolicy::WriteBehind
+	void SetDropPageCache(bool drop)
+	{
+		IsDropPageCache = drop;
+	}
+
+	// Count our writes and rollovers in stats, which may be null
+	void SetStats(SharedStats* stats)
+	{
+		Stats = stats;
+	}
+
+	// Try to write through io_uring, with up to 'depth' writes in flight. Returns false if io_uring is not available,
+	// in which case SubmitV always returns false, and the caller must use WriteV.
+	bool EnableAsyncWrites(unsigned depth)
+	{
+#ifdef UBERLOG_IO_URING
+		return Ring.Init(depth);
+#else
+		return false;
+#endif
+	}
+
+	// Testing only. Make the n-th call to SubmitV fail, as if io_uring had refused it. Zero means never.
+	void SetTestFailSubmit(uint32_t n)
+	{
+#ifdef UBERLOG_IO_URING
+		TestFailSubmit = n;
+#endif
 	}
 
 	bool Write(const void* buf, size_t len)
+	{
+		iovec piece = {(void*) buf, len};
+		return WriteV(&piece, 1);
+	}
+
+	// Write a batch of pieces, as few at a time as we can, without going past MaxFileSize.
+	// A piece holds many lines, so we split a piece after the last line that fits into the current file.
+	bool WriteV(const iovec* iov, size_t niov)
 	{
 		if (!Open())
 			return false;
+		SyncFilePosition();
 
-		if (FileSize + (int64_t) len > MaxFileSize)
+		Pieces.assign(iov, iov + niov);
+		iovec* p = Pieces.size() != 0 ? &Pieces[0] : nullptr;
+		while (niov != 0)
 		{
-			if (!RollOver())
-				return false;
-			if (!Open())
+			// Find the pieces that fit into the current file, and the lines of the next piece that also fit
+			size_t n   = 0;
+			size_t len = 0;
+			for (; n < niov && n < IOV_MAX && FileSize + (int64_t) (len + p[n].iov_len) <= MaxFileSize; n++)
+				len += p[n].iov_len;
+			size_t head = 0;
+			if (n < niov && n < IOV_MAX)
+			{
+				head = LinesThatFit(p[n], (size_t) std::max(MaxFileSize - FileSize - (int64_t) len, (int64_t) 0));
+				// A line that is larger than MaxFileSize still gets written, to a file of its own
+				if (n == 0 && head == 0 && FileSize == 0)
+					head = p[0].iov_len;
+			}
+
+			if (n == 0 && head == 0)
+			{
+				uint64_t start = MonotonicNanoseconds();
+				if (!RollOver())
+					return false;
+				if (Stats)
+				{
+					Stats->Rollovers.fetch_add(1, std::memory_order_relaxed);
+					Stats->RolloverNS.fetch_add(MonotonicNanoseconds() - start, std::memory_order_relaxed);
+				}
+				if (!Open())
+					return false;
+				continue;
+			}
+
+			// Write the split piece's head as an extra piece, and leave its tail in place
+			iovec tail = {nullptr, 0};
+			if (head != 0)
+			{
+				tail         = {(char*) p[n].iov_base + head, p[n].iov_len - head};
+				p[n].iov_len = head;
+				len += head;
+				n++;
+			}
+
+			// ignore the possibility that writev() is allowed to write less than 'len' bytes.
+			uint64_t start = MonotonicNanoseconds();
+			auto     res   = WriteV_Raw(p, n);
+			if (res == -1)
+			{
+				// Perhaps something has happened on the file system, such as a network share being lost and then restored, etc.
+				// Closing and opening again is the best thing we can try in this scenario.
+				if (!Reopen())
+					return false;
+				res = WriteV_Raw(p, n);
+			}
+			CountWrite(start, res);
+			if (res != -1)
+				AddFileSize(res);
+			if (res != (int64_t) len)
 				return false;
+			p += n;
+			niov -= n;
+			if (tail.iov_len != 0)
+			{
+				p--;
+				niov++;
+				*p = tail;
+			}
 		}
+		return true;
+	}
 
-		if (len == 0)
-			return true;
+	// Start writing the pieces to the end of the file, through io_uring. The pieces must stay alive until Complete returns
+	// this tag. The caller must not have more writes in flight than the depth given to EnableAsyncWrites.
+	// Returns false if io_uring is not enabled, or if the pieces don't fit into the current file. In that case, the caller
+	// must wait for all of its outstanding writes to complete, and then use WriteV. We never roll over while
+	// writes are in flight.
+	bool SubmitV(const iovec* iov, size_t niov, uint64_t tag)
+	{
+#ifdef UBERLOG_IO_URING
+		if (!Ring.IsOpen() || IsRingBroken || niov > IOV_MAX || FD == -1)
+			return false;
+		size_t len = 0;
+		for (size_t i = 0; i < niov; i++)
+			len += iov[i].iov_len;
+		if (FileSize + (int64_t) len > MaxFileSize)
+			return false;
+		bool fail = TestFailSubmit != 0 && ++NumSubmitCalls == TestFailSubmit;
+		if (fail || !Ring.SubmitWriteV(FD, iov, niov, FileSize, tag))
+		{
+			// Writes that are already in flight still need the ring to complete, so we only close it once they have
+			OutOfBandWarning("io_uring submit failed. Falling back to synchronous writes\n");
+			IsRingBroken = true;
+			if (NumInFlight == 0)
+				Ring.Close();
+			return false;
+		}
+		NumInFlight++;
+		if (tag >= Pending.size())
+			Pending.resize(tag + 1);
+		Pending[tag] = {iov, niov, FileSize, len, MonotonicNanoseconds()};
+		AddFileSize(len);
+		IsPositionStale = true;
+		return true;
+#else
+		return false;
+#endif
+	}
 
-		// ignore the possibility that write() is allowed to write less than 'len' bytes.
-		auto res = write(FD, buf, (int) len);
-		if (res == -1)
+	// Wait for (if 'wait' is true) a write that was started by SubmitV, and return its tag.
+	// Returns false if wait is false, and no write has completed yet.
+	bool Complete(bool wait, uint64_t& tag)
+	{
+#ifdef UBERLOG_IO_URING
+		int32_t res = 0;
+		if (!Ring.Complete(wait, tag, res))
 		{
-			// Perhaps something has happened on the file system, such as a network share being lost and then restored, etc.
-			// Closing and opening again is the best thing we can try in this scenario.
-			Close();
-			if (!Open())
-				return false;
-			res = write(FD, buf, (int) len);
+			if (wait)
+				Panic("io_uring wait failed");
+			return false;
+		}
+		const AsyncWrite& w = Pending[tag];
+		CountWrite(w.StartNS, res);
+		if (res < 0 || (size_t) res != w.Len)
+		{
+			// Finish short writes ourselves. There is nothing more that we can do about failures.
+			if (res < 0 || !WriteAt(w.Iov, w.NumIov, w.Offset, (size_t) res))
+				OutOfBandWarning("Failed to write to log file '%s'\n", Filename.c_str());
+		}
+		if (--NumInFlight == 0 && IsRingBroken)
+			Ring.Close();
+		return true;
+#else
+		if (wait)
+			Panic("LogFile.Complete called without io_uring");
+		return false;
+#endif
+	}
+
+	// Force what we have written out to disk, if our sync policy says that it is time to do so. 'urgent' means that
+	// the writes since the last call contained a Warn or higher message. Writes started by SubmitV must have completed.
+	void Synchronize(bool urgent)
+	{
+		if (!IsSyncDue(urgent))
+			return;
+		if (Sync == SyncPolicy::WriteBehind)
+			WriteBehind();
+		else
+			DataSync();
+	}
+
+	// Returns true if Synchronize would do anything. Writes that are still in flight count as written.
+	bool IsSyncDue(bool urgent) const
+	{
+		if (FD == -1 || FileSize == SyncPos)
+			return false;
+		switch (Sync)
+		{
+		case SyncPolicy::Never:
+			return false;
+		case SyncPolicy::Periodic:
+			return (SyncIntervalBytes != 0 && FileSize - SyncPos >= SyncIntervalBytes) || (SyncIntervalMS != 0 && NowMS() - DirtySinceMS >= SyncIntervalMS);
+		case SyncPolicy::WriteBehind:
+			return FileSize - SyncPos >= std::max(SyncIntervalBytes, (int64_t) 1);
+		case SyncPolicy::OnWarn:
+			return urgent;
 		}
+		return false;
+	}
 
-		if (res != -1)
-			FileSize += res;
-		return res == len;
+	// Returns true if everything that we have written is on disk. WriteBehind doesn't count, because sync_file_range
+	// doesn't flush the disk's cache, or the file's metadata.
+	bool IsSynced() const
+	{
+		return (Sync == SyncPolicy::Periodic || Sync == SyncPolicy::OnWarn) && FileSize == SyncPos;
+	}
+
+	// Returns the number of milliseconds until Synchronize needs to be called again, even if nothing more is written,
+	// or -1 if there is no such deadline.
+	int64_t SyncDeadlineMS() const
+	{
+		if (Sync != SyncPolicy::Periodic || SyncIntervalMS == 0 || DirtySinceMS == 0)
+			return -1;
+		return std::max(DirtySinceMS + SyncIntervalMS - NowMS(), (int64_t) 0);
 	}
 
 	bool Open()
@@ -113,11 +511,17 @@ public:
 		if (FD == -1)
 		{
 #ifdef _WIN32
+			if (!IsArchiveIndexLoaded)
+				LoadArchiveIndex();
 			FD = _open(Filename.c_str(), _O_BINARY | _O_WRONLY | _O_CREAT, _S_IREAD | _S_IWRITE);
 			if (FD == -1)
 				return false;
 			FileSize = (int64_t) _lseeki64(FD, 0, SEEK_END);
 #else
+			if (!IsArchiveIndexLoaded)
+				LoadArchiveIndex();
+			if (!Archiver.joinable())
+				RecoverNextFile();
 			FD = open(Filename.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 			if (FD == -1)
 				return false;
@@ -128,25 +532,421 @@ public:
 				close(FD);
 				FD = -1;
 			}
+			if (FD != -1)
+			{
+				ResetSyncState();
+				Preallocate(FD, FileSize);
+				PrepareNextFile();
+			}
 		}
 		return FD != -1;
 	}
 
+	// Writes that were started by SubmitV must have completed by now
 	void Close()
+	{
+		StopArchiver();
+		CloseFD();
+	}
+
+private:
+	std::string        Filename;
+	int64_t            FileSize           = 0;
+	int64_t            MaxFileSize        = 0;
+	int32_t            MaxNumArchiveFiles = 0;
+	int64_t            MaxArchiveBytes    = 0;
+	int64_t            MaxArchiveAgeMS    = 0;
+	bool               IsPreallocate      = false; // Allocate disk space for MaxFileSize bytes up front. See Preallocate.
+	SyncPolicy         Sync               = SyncPolicy::Never;
+	int64_t            SyncIntervalMS     = 0;
+	int64_t            SyncIntervalBytes  = 0;
+	int64_t            SyncPos            = 0; // Bytes of the current file that we have synced, or started writeback of
+	int64_t            WritebackPos       = 0; // WriteBehind: the start of the region whose writeback we have not yet waited for
+	int64_t            DirtySinceMS       = 0; // Periodic: when we first wrote after the last sync, or zero if we haven't
+	SharedStats*       Stats              = nullptr;
+	bool               IsDropPageCache    = false;
+	int64_t            DroppedPos         = 0; // Page aligned. Everything before it has been dropped from the page cache.
+	int                FD                 = -1;
+	bool               IsPositionStale    = false; // SubmitV writes at an offset, so it doesn't move the file position
+	std::vector<iovec> Pieces;                     // WriteV's copy of its pieces, so that it can split them
+
+#ifdef UBERLOG_IO_URING
+	struct AsyncWrite
+	{
+		const iovec* Iov;
+		size_t       NumIov;
+		int64_t      Offset;
+		size_t       Len;
+		uint64_t     StartNS;
+	};
+	Uring                   Ring;
+	std::vector<AsyncWrite> Pending;                // Indexed by tag
+	uint32_t                NumInFlight    = 0;     // Writes that we have submitted, but not yet completed
+	bool                    IsRingBroken   = false; // A submit failed, so we close the ring once NumInFlight reaches zero
+	uint32_t                TestFailSubmit = 0;     // See SetTestFailSubmit
+	uint32_t                NumSubmitCalls = 0;
+
+	// Write the pieces at offset, skipping the first 'done' bytes
+	bool WriteAt(const iovec* iov, size_t niov, int64_t offset, size_t done)
+	{
+		for (size_t i = 0; i < niov; i++)
+		{
+			size_t skip = std::min(done, iov[i].iov_len);
+			done -= skip;
+			offset += skip;
+			const char* p    = (const char*) iov[i].iov_base + skip;
+			size_t      left = iov[i].iov_len - skip;
+			while (left != 0)
+			{
+				auto res = pwrite(FD, p, left, offset);
+				if (res <= 0)
+					return false;
+				p += res;
+				left -= res;
+				offset += res;
+			}
+		}
+		return true;
+	}
+#endif
+
+	// Reserve disk blocks for the rest of the file, so that the file system doesn't need to allocate blocks, and journal
+	// a size change, for every write. The file size stays the same, so readers only see what we have written.
+	void Preallocate(int fd, int64_t size)
+	{
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+		// Failure is harmless. Not all file systems support this.
+		if (IsPreallocate && size < MaxFileSize)
+			fallocate(fd, FALLOC_FL_KEEP_SIZE, size, MaxFileSize - size);
+#endif
+	}
+
+	// Give back the blocks that Preallocate reserved beyond the end of the file
+	void TrimPreallocation(int fd, int64_t size)
+	{
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+		if (IsPreallocate && size < MaxFileSize && ftruncate(fd, size) != 0)
+			OutOfBandWarning("Failed to trim preallocated space of log file '%s'\n", Filename.c_str());
+#endif
+	}
+
+	void AddFileSize(int64_t len)
+	{
+		if (DirtySinceMS == 0 && len != 0)
+			DirtySinceMS = NowMS();
+		FileSize += len;
+	}
+
+	void CountWrite(uint64_t startNS, int64_t bytes)
+	{
+		if (!Stats)
+			return;
+		Stats->Writes.fetch_add(1, std::memory_order_relaxed);
+		if (bytes > 0)
+			Stats->BytesWritten.fetch_add(bytes, std::memory_order_relaxed);
+		Stats->WriteLatency[SharedStats::LatencyBucket(MonotonicNanoseconds() - startNS)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void ResetSyncState()
+	{
+		SyncPos      = FileSize;
+		WritebackPos = FileSize;
+		DirtySinceMS = 0;
+		DroppedPos   = 0; // This may be a file that we wrote in a previous life, and never dropped
+	}
+
+	// Wait until the file's data is on disk. Metadata that isn't needed to read the data back, such as the modification time, may lag.
+	static bool DataSync(int fd)
+	{
+#if defined(__linux__)
+		return fdatasync(fd) == 0;
+#elif defined(_WIN32)
+		return _commit(fd) == 0;
+#else
+		return fsync(fd) == 0;
+#endif
+	}
+
+	void DataSync()
+	{
+		if (!DataSync(FD))
+			OutOfBandWarning("Failed to sync log file '%s'\n", Filename.c_str());
+		SyncPos      = FileSize;
+		WritebackPos = FileSize;
+		DirtySinceMS = 0;
+		DropPages(FileSize);
+	}
+
+	// Tell the OS that we won't read back the region from DroppedPos up to 'end', which must be on disk already, so that it
+	// can evict the region from the page cache. Only whole pages are dropped, so the page that 'end' is in stays.
+	void DropPages(int64_t end)
+	{
+#if defined(__linux__) && defined(POSIX_FADV_DONTNEED)
+		static const int64_t pageSize = (int64_t) sysconf(_SC_PAGESIZE);
+		if (!IsDropPageCache || end <= DroppedPos)
+			return;
+		posix_fadvise(FD, DroppedPos, end - DroppedPos, POSIX_FADV_DONTNEED);
+		DroppedPos = end & ~(pageSize - 1);
+#endif
+	}
+
+	// Start writeback of every complete region, and then wait for the region before it. This keeps a steady trickle of
+	// writes going to the disk, instead of letting dirty pages pile up until the kernel flushes them all at once.
+	// If SyncIntervalBytes is zero, then everything written since the last call is one region.
+	void WriteBehind()
+	{
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+		while (IsSyncDue(false))
+		{
+			int64_t start = SyncPos;
+			int64_t len   = SyncIntervalBytes != 0 ? SyncIntervalBytes : FileSize - SyncPos;
+			sync_file_range(FD, start, len, SYNC_FILE_RANGE_WRITE);
+			if (start > WritebackPos)
+			{
+				sync_file_range(FD, WritebackPos, start - WritebackPos, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+				DropPages(start);
+			}
+			WritebackPos = start;
+			SyncPos      = start + len;
+		}
+#endif
+	}
+
+	// Returns the length of the lines at the start of the piece that fit into room bytes
+	static size_t LinesThatFit(const iovec& piece, size_t room)
+	{
+		if (piece.iov_len <= room)
+			return piece.iov_len;
+		const char* p = (const char*) piece.iov_base;
+		for (size_t i = room; i != 0; i--)
+		{
+			if (p[i - 1] == '\n')
+				return i;
+		}
+		return 0;
+	}
+
+	void SyncFilePosition()
+	{
+		if (!IsPositionStale)
+			return;
+#ifdef _WIN32
+		_lseeki64(FD, FileSize, SEEK_SET);
+#else
+		lseek64(FD, FileSize, SEEK_SET);
+#endif
+		IsPositionStale = false;
+	}
+
+	int64_t WriteV_Raw(const iovec* iov, size_t niov)
+	{
+#ifdef _WIN32
+		int64_t total = 0;
+		for (size_t i = 0; i < niov; i++)
+		{
+			auto res = write(FD, iov[i].iov_base, (int) iov[i].iov_len);
+			if (res == -1)
+				return -1;
+			total += res;
+		}
+		return total;
+#else
+		return (int64_t) writev(FD, iov, (int) niov);
+#endif
+	}
+
+	// Rollover is split in two. At the size limit, the writer switches to a file that was opened in advance, under the
+	// name NextFilename(). A background thread then closes the old file, archives it, renames the next file into place,
+	// deletes old archives, and opens a new next file. The writer only waits for the background thread if it reaches the
+	// size limit again before all of that is done. Windows can't rename open files, so there we roll over synchronously.
+	std::thread             Archiver;
+	std::mutex              ArchiverLock; // Guards the members below
+	std::condition_variable ArchiverCV;
+	bool                    IsArchiverBusy = false;
+	bool                    IsArchiverQuit = false;
+	int                     RetiredFD      = -1;    // The file that the background thread must close and archive
+	std::string             RetiredArchive;         // The archive name of RetiredFD
+	int64_t                 RetiredSize    = 0;
+	int                     NextFD       = -1;      // A fresh file, ready for the writer to switch to
+	bool                    IsActiveNext = false;   // The writer's file is still called NextFilename()
+	int64_t                 LastArchiveMS = 0;      // Writer only. Archive names are unique, even if we roll over twice in one millisecond.
+
+	// Our archives, oldest first. We scan the directory once, and then keep this up to date ourselves.
+	struct ArchiveFile
+	{
+		std::string Path;
+		int64_t     Size;
+		int64_t     TimeMS; // When the file was archived
+	};
+	std::mutex              ArchiveIndexLock; // Guards the members below. Renaming and deleting archives happens while holding it.
+	std::deque<ArchiveFile> Archives;
+	int64_t                 ArchiveBytes         = 0; // Sum of Archives[].Size
+	bool                    IsArchiveIndexLoaded = false;
+
+	std::string NextFilename() const
+	{
+		return Filename + ".next";
+	}
+
+	void CloseFD()
 	{
 		if (FD == -1)
 			return;
+		TrimPreallocation(FD, FileSize);
+		if (Sync != SyncPolicy::Never && (FileSize != SyncPos || IsDropPageCache))
+			DataSync();
 		close(FD);
-		FD       = -1;
-		FileSize = 0;
+		FD              = -1;
+		FileSize        = 0;
+		IsPositionStale = false;
 	}
 
-private:
-	std::string Filename;
-	int64_t     FileSize           = 0;
-	int64_t     MaxFileSize        = 0;
-	int32_t     MaxNumArchiveFiles = 0;
-	int         FD                 = -1;
+	bool Reopen()
+	{
+		{
+			std::unique_lock<std::mutex> lock(ArchiverLock);
+			ArchiverCV.wait(lock, [this]() { return !IsArchiverBusy; });
+		}
+		CloseFD();
+		return Open();
+	}
+
+	// Ask the background thread to open the next file, if it hasn't already
+	void PrepareNextFile()
+	{
+#ifndef _WIN32
+		if (!Archiver.joinable())
+			Archiver = std::thread([this]() { this->ArchiverLoop(); });
+		{
+			std::lock_guard<std::mutex> lock(ArchiverLock);
+			if (IsArchiverBusy || NextFD != -1 || IsActiveNext)
+				return;
+			IsArchiverBusy = true;
+		}
+		ArchiverCV.notify_all();
+#endif
+	}
+
+	void StopArchiver()
+	{
+		if (!Archiver.joinable())
+			return;
+		{
+			std::lock_guard<std::mutex> lock(ArchiverLock);
+			IsArchiverQuit = true;
+		}
+		ArchiverCV.notify_all();
+		Archiver.join();
+		IsArchiverQuit = false;
+		if (NextFD != -1)
+		{
+			close(NextFD);
+			NextFD = -1;
+			remove(NextFilename().c_str());
+		}
+	}
+
+	void ArchiverLoop()
+	{
+		std::unique_lock<std::mutex> lock(ArchiverLock);
+		auto                         hasWork = [this]() { return IsArchiverBusy || IsArchiverQuit; };
+		while (true)
+		{
+			// Archives can expire without a rollover, so look at them every now and then
+			if (MaxArchiveAgeMS != 0)
+			{
+				if (!ArchiverCV.wait_for(lock, std::chrono::milliseconds(std::min(MaxArchiveAgeMS, (int64_t) 60000)), hasWork))
+				{
+					lock.unlock();
+					PruneArchives();
+					lock.lock();
+					continue;
+				}
+			}
+			else
+			{
+				ArchiverCV.wait(lock, hasWork);
+			}
+			if (!IsArchiverBusy)
+				return;
+			int         retired     = RetiredFD;
+			std::string archive     = RetiredArchive;
+			int64_t     retiredSize = RetiredSize;
+			RetiredFD               = -1;
+			lock.unlock();
+
+			bool ok = true;
+			if (retired != -1)
+			{
+				TrimPreallocation(retired, retiredSize);
+				if (Sync != SyncPolicy::Never && !DataSync(retired))
+					OutOfBandWarning("Failed to sync log file '%s'\n", Filename.c_str());
+#if defined(__linux__) && defined(POSIX_FADV_DONTNEED)
+				if (IsDropPageCache)
+					posix_fadvise(retired, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+				close(retired);
+				ok = Archive(Filename, archive, retiredSize) && Rename(NextFilename(), Filename);
+				PruneArchives();
+			}
+			int next = -1;
+			if (ok)
+				next = open(NextFilename().c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+			if (next != -1 && lseek64(next, 0, SEEK_END) != 0)
+			{
+				// A next file that RecoverNextFile could not move into place holds log lines, so leave it alone
+				OutOfBandWarning("Log file '%s' already exists. Rolling over without it.\n", NextFilename().c_str());
+				close(next);
+				next = -1;
+			}
+			if (next != -1)
+				Preallocate(next, 0);
+
+			lock.lock();
+			if (ok)
+				IsActiveNext = false;
+			NextFD         = next;
+			IsArchiverBusy = false;
+			ArchiverCV.notify_all();
+		}
+	}
+
+	// If we died in the middle of a rollover, then finish it
+	void RecoverNextFile()
+	{
+#ifndef _WIN32
+		int fd = open(NextFilename().c_str(), O_WRONLY);
+		if (fd == -1)
+			return;
+		bool empty = lseek64(fd, 0, SEEK_END) == 0;
+		close(fd);
+		if (empty)
+			remove(NextFilename().c_str());
+		else if (access(Filename.c_str(), F_OK) != 0)
+			Rename(NextFilename(), Filename); // We died after archiving the old file, but before renaming the next file
+		else if (Archive(Filename, ArchiveFilename(), FileSizeOf(Filename)))
+			Rename(NextFilename(), Filename);
+#endif
+	}
+
+	// Rename a log file into the archive
+	bool Archive(const std::string& from, const std::string& to, int64_t size)
+	{
+		std::lock_guard<std::mutex> lock(ArchiveIndexLock);
+		if (!Rename(from, to))
+			return false;
+		Archives.push_back({to, size, NowMS()});
+		ArchiveBytes += size;
+		return true;
+	}
+
+	bool Rename(const std::string& from, const std::string& to)
+	{
+		if (rename(from.c_str(), to.c_str()) == 0)
+			return true;
+		OutOfBandWarning("Rollover failed trying to rename '%s' to '%s'\n", from.c_str(), to.c_str());
+		return false;
+	}
 
 	std::string FilenameExtension() const
 	{
@@ -160,21 +960,44 @@ private:
 		return "";
 	}
 
-	std::string ArchiveFilename() const
+	// Milliseconds since the unix epoch
+	static int64_t NowMS()
 	{
-		// build time representation (UTC)
-		char timeBuf[100];
-		tm   timev;
 #ifdef _WIN32
-		struct timeb t;
-		ftime(&t);
-		_gmtime64_s(&timev, &t.time);
-		uint32_t millis = (uint32_t) t.millitm;
+		struct timeb tb;
+		ftime(&tb);
+		return (int64_t) tb.time * 1000 + tb.millitm;
 #else
 		struct timespec tp;
 		clock_gettime(CLOCK_REALTIME, &tp);
-		time_t t = tp.tv_sec;
-		uint32_t millis = tp.tv_nsec / 1000000;
+		return (int64_t) tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+#endif
+	}
+
+	static int64_t FileSizeOf(const std::string& path)
+	{
+#ifdef _WIN32
+		struct _stat64 st;
+		return _stat64(path.c_str(), &st) == 0 ? (int64_t) st.st_size : 0;
+#else
+		struct stat st;
+		return stat(path.c_str(), &st) == 0 ? (int64_t) st.st_size : 0;
+#endif
+	}
+
+	std::string ArchiveFilename()
+	{
+		// build time representation (UTC)
+		char    timeBuf[100];
+		tm      timev;
+		int64_t ms    = std::max(NowMS(), LastArchiveMS + 1);
+		LastArchiveMS = ms;
+		time_t   t    = (time_t)(ms / 1000);
+		uint32_t millis = (uint32_t)(ms % 1000);
+#ifdef _WIN32
+		__time64_t t64 = t;
+		_gmtime64_s(&timev, &t64);
+#else
 		gmtime_r(&t, &timev);
 #endif
 		strftime(timeBuf, sizeof(timeBuf), "-%Y-%m-%dT%H-%M-%S-", &timev);
@@ -198,12 +1021,13 @@ private:
 		return Filename.substr(0, lastSlash + 1);
 	}
 
-	std::vector<std::string> FindArchiveFiles() const
+	// Scan the log directory for archives. We only do this once, and keep the index up to date after that.
+	void LoadArchiveIndex()
 	{
 		auto                     dir      = LogDir();
 		auto                     ext      = FilenameExtension();
 		auto                     wildcard = Filename.substr(0, Filename.length() - ext.length()) + "-*";
-		std::vector<std::string> archives;
+		std::vector<ArchiveFile> archives;
 #ifdef _WIN32
 		WIN32_FIND_DATAA fd;
 		HANDLE           fh = FindFirstFileA(wildcard.c_str(), &fd);
@@ -211,44 +1035,93 @@ private:
 		{
 			do
 			{
-				archives.push_back(dir + fd.cFileName);
+				// FILETIME is in 100ns units, since 1601
+				int64_t size  = ((int64_t) fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+				int64_t mtime = (((int64_t) fd.ftLastWriteTime.dwHighDateTime << 32) | fd.ftLastWriteTime.dwLowDateTime) / 10000 - 11644473600000LL;
+				archives.push_back({dir + fd.cFileName, size, mtime});
 			} while (!!FindNextFileA(fh, &fd));
 			FindClose(fh);
 		}
 #else
+		// Unlike FindFirstFile, glob returns paths that already include the directory
 		glob_t pglob;
 		if (glob(wildcard.c_str(), 0, nullptr, &pglob) == 0)
 		{
 			for (size_t i = 0; i < pglob.gl_pathc; i++)
-				archives.push_back(dir + pglob.gl_pathv[i]);
+			{
+				struct stat st;
+				if (stat(pglob.gl_pathv[i], &st) == 0)
+					archives.push_back({pglob.gl_pathv[i], (int64_t) st.st_size, (int64_t) st.st_mtime * 1000});
+			}
 			globfree(&pglob);
 		}
 #endif
 		// rely on our lexicographic archive naming convention, so that files are sorted oldest to newest
-		std::sort(archives.begin(), archives.end());
-		return archives;
+		std::sort(archives.begin(), archives.end(), [](const ArchiveFile& a, const ArchiveFile& b) { return a.Path < b.Path; });
+
+		std::lock_guard<std::mutex> lock(ArchiveIndexLock);
+		Archives.assign(archives.begin(), archives.end());
+		ArchiveBytes = 0;
+		for (const auto& a : Archives)
+			ArchiveBytes += a.Size;
+		IsArchiveIndexLoaded = true;
 	}
 
 	bool RollOver()
 	{
-		Close();
+		// The background thread syncs the old file too, but IsSynced must not have to wait for it
+		if ((Sync == SyncPolicy::Periodic || Sync == SyncPolicy::OnWarn) && FileSize != SyncPos)
+			DataSync();
 
-		// rename current log file
-		std::string archive = ArchiveFilename();
-		if (rename(Filename.c_str(), archive.c_str()) != 0)
+		std::unique_lock<std::mutex> lock(ArchiverLock);
+		ArchiverCV.wait(lock, [this]() { return !IsArchiverBusy; });
+		if (NextFD != -1)
 		{
-			OutOfBandWarning("Rollover failed trying to rename '%s' to '%s'\n", Filename.c_str(), archive.c_str());
-			return false;
+			// Switch to the next file, and leave the rest to the background thread
+			RetiredFD       = FD;
+			RetiredArchive  = ArchiveFilename();
+			RetiredSize     = FileSize;
+			FD              = NextFD;
+			NextFD          = -1;
+			FileSize        = 0;
+			IsPositionStale = false;
+			IsActiveNext    = true;
+			ResetSyncState();
+			IsArchiverBusy  = true;
+			ArchiverCV.notify_all();
+			return true;
 		}
 
-		// delete old archives, but ignore failure
-		auto archives = FindArchiveFiles();
-		if (archives.size() > (size_t) MaxNumArchiveFiles)
+		// There is no next file, either because this is Windows, or because the previous rollover failed.
+		// So do it all ourselves.
+		std::string active = IsActiveNext ? NextFilename() : Filename;
+		IsActiveNext       = false;
+		lock.unlock();
+		int64_t size = FileSize;
+		CloseFD();
+
+		// rename current log file
+		if (!Archive(active, ArchiveFilename(), size))
+			return false;
+
+		PruneArchives();
+		return true;
+	}
+
+	// Delete the oldest archives, until we're within our limits. Ignore failure.
+	void PruneArchives()
+	{
+		std::lock_guard<std::mutex> lock(ArchiveIndexLock);
+		int64_t                     now = NowMS();
+		while (Archives.size() != 0 &&
+		       ((int64_t) Archives.size() > MaxNumArchiveFiles ||
+		        (MaxArchiveBytes != 0 && ArchiveBytes > MaxArchiveBytes) ||
+		        (MaxArchiveAgeMS != 0 && now - Archives.front().TimeMS > MaxArchiveAgeMS)))
 		{
-			for (size_t i = 0; i < archives.size() - MaxNumArchiveFiles; i++)
-				remove(archives[i].c_str());
+			remove(Archives.front().Path.c_str());
+			ArchiveBytes -= Archives.front().Size;
+			Archives.pop_front();
 		}
-		return true;
 	}
 };
 
@@ -260,21 +1133,69 @@ private:
 class LoggerSlave
 {
 public:
-	static const size_t WriteBufSize        = LoggerSlaveWriteBufferSize;
+	size_t              WriteBufSize        = LoggerSlaveWriteBufferSize; // The size of each swap buffer
+	uint32_t            WriteQueueDepth     = 1;                          // Number of swap buffers that may be in flight at once. Above 1, we use io_uring.
+	uint32_t            NumSwapBuffers      = 4;                          // At least WriteQueueDepth + 2, so that the drain thread always has one to fill
 	bool                EnableDebugMessages = false;
 	uint32_t            ParentPID           = 0;
 	uint32_t            RingSize            = 0;
 	std::atomic<bool>   IsParentDead;
 	RingBuffer          Ring;
+	SharedControl*      Control   = nullptr;
 	shm_handle_t        ShmHandle = internal::NullShmHandle;
 	std::thread         WatcherThread;
 	std::string         Filename;
 	int64_t             MaxLogSize         = 30 * 1024 * 1024;
 	int32_t             MaxNumArchives     = 3;
+	int64_t             MaxArchiveBytes    = 0; // Zero means no limit
+	int64_t             MaxArchiveAgeS     = 0; // Zero means no limit
+	bool                Preallocate        = false;
+	bool                DropPageCache      = false;
+	TimeFormat          TimeFmt            = TimeFormat::LocalMilli;
+	SyncPolicy          Sync               = SyncPolicy::Never;
+	uint32_t            SyncIntervalMS     = 0; // Zero means no limit
+	uint64_t            SyncIntervalBytes  = 0; // Zero means no limit
+	uint32_t            TestFailSubmit     = 0; // From UBERLOG_TEST_FAIL_SUBMIT. See LogFile::SetTestFailSubmit.
 	uint32_t            MaxSleepMS         = 1024;
 	uint32_t            WaitForOpenSleepMS = 1; // Our sleep periods when we're waiting for the ring buffer to be opened
-	LogFile             Log;
-	char*               WriteBuf = nullptr;
+	LogFile             Log; // Owned by the I/O thread, once it is running
+
+	// The drain thread copies messages out of the rings, into swap buffers, and gives the ring space back to
+	// the producers immediately. The I/O thread writes full swap buffers to the log file, and takes care of rollover.
+	// A slow write or rollover only holds up the ring once all of the swap buffers are full.
+	struct SwapBuffer
+	{
+		std::vector<char> Data;             // WriteBufSize, unless a single message needed more
+		size_t            Len      = 0;     // Bytes used
+		uint32_t          Index    = 0;     // Position in SwapBuffers. This is our io_uring tag.
+		bool              IsUrgent = false; // Holds a Warn or higher message. See SyncPolicy::OnWarn.
+		bool              IsDone   = false; // Its io_uring write has completed, but an earlier one hasn't
+		uint64_t          Seq      = 0;     // Every message up to and including this sequence number is in this buffer, or an earlier one
+		iovec             Iov;              // Stays alive while an io_uring write is in flight
+	};
+	std::vector<SwapBuffer>  SwapBuffers;
+	SwapBuffer*              Cur = nullptr; // Drain thread only. The buffer that we are filling.
+	std::mutex               SwapLock;      // Guards FreeBuffers, FullBuffers, IsDrainFinished and SwapControl
+	std::condition_variable  FreeCV;
+	std::condition_variable  FullCV;
+	std::vector<SwapBuffer*> FreeBuffers;
+	std::deque<SwapBuffer*>  FullBuffers; // In log order
+	bool                     IsDrainFinished = false;
+	SharedControl*           SwapControl     = nullptr; // Control, handed to the I/O thread once the drain thread has opened it
+	SharedControl*           IOControl       = nullptr; // I/O thread only. Our copy of SwapControl, which is null until the parent's shared memory is open.
+	std::thread              IOThread;
+	std::deque<SwapBuffer*>  InFlight; // I/O thread only. Buffers that we've submitted to io_uring, in log order.
+
+	// Drain thread only. Producers take sequence numbers just before they commit a message, so we may see them slightly
+	// out of order. ConsumedSeq is the point up to which we have seen all of them, and EarlySeqs are the ones after it.
+	uint64_t                                                                     ConsumedSeq = 0;
+	std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<uint64_t>> EarlySeqs;
+
+	std::vector<ThreadRing*> ThreadRings; // Per-thread rings that we have opened so far
+
+	TimeKeeper                       TK;
+	uint64_t                         ReportedDropped = 0;    // The value of SharedControl::Dropped when we last reported it
+	std::vector<uberlog_tsf::fmtarg> DeferredArgs;        // Arguments of a Command::LogFmt message, pointing into the ring
 
 #ifdef _WIN32
 	HANDLE CloseMessageEvent = NULL;
@@ -291,19 +1212,40 @@ public:
 	{
 		DebugMsg("uberlog writer [%v, %v MB max size, %v archives] is starting\n", Filename, MaxLogSize / 1024 / 1024, MaxNumArchives);
 
-		WriteBuf = new char[WriteBufSize];
-
 #ifdef _WIN32
 		CloseMessageEvent = CreateEvent(NULL, true, false, NULL);
 #endif
 
 		std::thread watcherThread = WatchForParentProcessDeath(); // Windows-only
 
-		Log.Init(Filename, MaxLogSize, MaxNumArchives);
+		TK.SetFormat(TimeFmt);
+
+		Log.Init(Filename, MaxLogSize, MaxNumArchives, MaxArchiveBytes, MaxArchiveAgeS * 1000, Preallocate);
+		// Pages can only be dropped from the cache once they have been written back
+		if (DropPageCache && Sync == SyncPolicy::Never)
+			Sync = SyncPolicy::WriteBehind;
+		Log.SetSyncPolicy(Sync, SyncIntervalMS, (int64_t) SyncIntervalBytes);
+		Log.SetDropPageCache(DropPageCache);
+		Log.SetTestFailSubmit(TestFailSubmit);
+		if (WriteQueueDepth > 1 && !Log.EnableAsyncWrites(WriteQueueDepth))
+		{
+			DebugMsg("uberlog writer cannot use io_uring. Falling back to synchronous writes\n");
+			WriteQueueDepth = 1;
+		}
 
 		// Try to open file immediately, for consistency & predictability sake
 		Log.Open();
 
+		NumSwapBuffers = std::max(NumSwapBuffers, WriteQueueDepth + 2);
+		SwapBuffers.resize(NumSwapBuffers);
+		for (uint32_t i = 0; i < NumSwapBuffers; i++)
+		{
+			SwapBuffers[i].Data.resize(WriteBufSize);
+			SwapBuffers[i].Index = i;
+			FreeBuffers.push_back(&SwapBuffers[i]);
+		}
+		IOThread = std::thread([this]() { this->IOLoop(); });
+
 		uint32_t sleepMS      = 0;
 		uint64_t totalSleepMS = 0;
 
@@ -314,6 +1256,7 @@ public:
 				OpenRingBuffer();
 			if (Ring.Buf)
 			{
+				OpenThreadRings();
 				uint64_t nmessages = ReadMessages();
 				if (nmessages == 0)
 					idle = true;
@@ -329,15 +1272,28 @@ public:
 			// This is a no-op on Windows, because on Windows we just WaitForSingleObject(parentProcessHandle)
 			PollForParentProcessDeath();
 			totalSleepMS += sleepMS;
-			internal::SleepMS(sleepMS);
+			if (idle && HaveSharedFutex)
+				SleepUntilWoken(MaxSleepMS);
+			else
+				internal::SleepMS(sleepMS);
 		}
 
 		// Drain the buffer
 		if (IsParentDead && Ring.Buf)
+		{
+			OpenThreadRings();
 			ReadMessages();
+		}
 
 		//uberlog_tsf::print("Logger slave slept for a total of %v MS\n", totalSleepMS);
 
+		{
+			std::lock_guard<std::mutex> lock(SwapLock);
+			IsDrainFinished = true;
+		}
+		FullCV.notify_one();
+		IOThread.join();
+
 		CloseRingBuffer();
 		Log.Close();
 
@@ -357,7 +1313,6 @@ public:
 			CloseHandle(CloseMessageEvent);
 		CloseMessageEvent = NULL;
 #endif
-		delete[] WriteBuf;
 	}
 
 private:
@@ -406,100 +1361,546 @@ private:
 	{
 		shm_handle_t shm = NullShmHandle;
 		void*        buf = nullptr;
-		if (!SetupSharedMemory(ParentPID, Filename.c_str(), SharedMemSizeFromRingSize(RingSize), false, shm, buf))
+		if (!SetupSharedMemory(ParentPID, Filename.c_str(), 0, SharedControlSize + SharedMemSizeFromRingSize(RingSize), false, shm, buf))
 			return false;
 		ShmHandle = shm;
-		Ring.Init(buf, RingSize, false);
+		Control   = (SharedControl*) buf;
+		Ring.Init((uint8_t*) buf + SharedControlSize, RingSize, false);
+		{
+			std::lock_guard<std::mutex> lock(SwapLock);
+			SwapControl = Control;
+		}
 		return true;
 	}
 
+	// Open any per-thread rings that the parent has created since we last looked
+	void OpenThreadRings()
+	{
+		uint32_t n = Control->NumThreadRings.load(std::memory_order_acquire);
+		while (ThreadRings.size() < n)
+		{
+			uint32_t     index = (uint32_t) ThreadRings.size();
+			size_t       size  = (size_t) Control->ThreadRingSize;
+			shm_handle_t shm   = NullShmHandle;
+			void*        buf   = nullptr;
+			if (!SetupSharedMemory(ParentPID, Filename.c_str(), index + 1, SharedMemSizeFromRingSize(size), false, shm, buf))
+				return;
+			ThreadRing* tr = new ThreadRing();
+			tr->ShmHandle  = shm;
+			tr->Index      = index;
+			tr->Ring.Init(buf, size, false);
+			ThreadRings.push_back(tr);
+		}
+	}
+
 	void CloseRingBuffer()
 	{
+		for (auto tr : ThreadRings)
+		{
+			CloseSharedMemory(tr->ShmHandle, tr->Ring.Buf, SharedMemSizeFromRingSize(tr->Ring.Size));
+			delete tr;
+		}
+		ThreadRings.clear();
+
 		if (Ring.Buf)
-			CloseSharedMemory(ShmHandle, Ring.Buf, SharedMemSizeFromRingSize(Ring.Size));
+			CloseSharedMemory(ShmHandle, Control, SharedControlSize + SharedMemSizeFromRingSize(Ring.Size));
 		Ring.Buf  = nullptr;
 		Ring.Size = 0;
+		Control   = nullptr;
 		ShmHandle = NullShmHandle;
 	}
 
-	// Returns number of log messages consumed
-	uint64_t ReadMessages()
+	// Tell producers that are waiting for space in the ring that we have consumed a message
+	void NotifySpace(RingBuffer& ring)
 	{
-		// Buffer up messages, so that we don't issue an OS write for every message
-		size_t   bufpos    = 0;
-		uint64_t nmessages = 0;
+		// Pairs with the re-check in Logger::WaitForSpace. Either the producer sees the new read pointer, or we see the producer.
+		// Waiting producers are only woken once the ring is half empty.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (ring.Waiters()->load(std::memory_order_relaxed) != 0 && ring.AvailableForWrite() >= ring.Size / 2)
+			FutexWake(ring.ReadPtrWord(), INT32_MAX);
 
-		while (true)
+		if (Control->SpaceArmed.load(std::memory_order_relaxed) != 0 && Control->SpaceArmed.exchange(0) != 0)
 		{
-			MessageHead head;
-			size_t      avail = Ring.AvailableForRead();
-			if (avail < sizeof(head))
-				break;
+#ifdef __linux__
+			uint64_t one = 1;
+			if (Control->SpaceEventFD != -1 && write(Control->SpaceEventFD, &one, sizeof(one)) != sizeof(one))
+				OutOfBandWarning("Failed to signal space event\n");
+#endif
+		}
+	}
+
+	// Block until a producer commits a message, or until the timeout expires. We still need the timeout, so that
+	// we notice when our parent dies.
+	void SleepUntilWoken(uint32_t milliseconds)
+	{
+		Control->WriterAsleep.store(1);
+
+		// Pairs with the fence in Logger::WakeWriter. A producer may have committed a message after ReadMessages
+		// looked at the rings, but before it could see that we're asleep.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		OpenThreadRings();
+		if (NextRing() == nullptr)
+			FutexWait(&Control->WriterAsleep, 1, milliseconds);
 
-			if (Ring.Read(&head, sizeof(head)) != sizeof(head))
-				Panic("ring.Read(head) failed");
-			avail -= sizeof(head);
+		Control->WriterAsleep.store(0);
+	}
+
+	// If the ring has a committed message at its read pointer, then return true, and the message's stamp
+	static bool PeekMessage(const RingBuffer& ring, uint64_t& stamp)
+	{
+		// A Pad record may be as short as its MessageHead
+		if (!ring.CanRead(sizeof(MessageHead)))
+			return false;
 
-			switch (head.Cmd)
+		// A producer may have reserved this message, but not yet committed it
+		size_t readp = ring.ReadCursor();
+		if (((std::atomic<uint32_t>*) ring.PtrAt(readp))->load(std::memory_order_acquire) == 0)
+			return false;
+
+		// Get rid of padding as soon as possible, so that it doesn't hold up the other rings
+		auto head = (const MessageHead*) ring.PtrAt(readp);
+		stamp     = head->Cmd != Command::Pad && (head->Flags & MessageFlagStamp) ? *((const uint64_t*) (head + 1)) : 0;
+		return true;
+	}
+
+	// Returns the ring whose next message is the oldest, or null if no ring has a committed message.
+	// Every ring is ordered by itself, so this is a k-way merge of all the rings.
+	RingBuffer* NextRing()
+	{
+		RingBuffer* best      = nullptr;
+		uint64_t    bestStamp = 0;
+		uint64_t    stamp     = 0;
+		if (PeekMessage(Ring, stamp))
+		{
+			best      = &Ring;
+			bestStamp = stamp;
+		}
+		for (auto tr : ThreadRings)
+		{
+			if (PeekMessage(tr->Ring, stamp) && (best == nullptr || stamp < bestStamp))
 			{
-			case Command::Close:
-				SetReceivedCloseMessage();
-				break;
-			case Command::LogMsg:
+				best      = &tr->Ring;
+				bestStamp = stamp;
+			}
+		}
+		return best;
+	}
+
+	// Give the ring space that we have consumed back to the producers. Everything in it has been copied out already.
+	void ReleaseRings()
+	{
+		Release(Ring);
+		for (auto tr : ThreadRings)
+			Release(tr->Ring);
+	}
+
+	void Release(RingBuffer& ring)
+	{
+		if (ring.Held == 0)
+			return;
+		ring.Release();
+		NotifySpace(ring);
+	}
+
+	// Return a pointer to at least len free bytes in the current swap buffer. If the current buffer is too full, then
+	// hand it over to the I/O thread, and wait for a free one.
+	char* Space(size_t len)
+	{
+		if (Cur && Cur->Data.size() - Cur->Len < len && Cur->Len != 0)
+			Handoff();
+		if (!Cur)
+		{
+			std::unique_lock<std::mutex> lock(SwapLock);
+			FreeCV.wait(lock, [this]() { return FreeBuffers.size() != 0; });
+			Cur = FreeBuffers.back();
+			FreeBuffers.pop_back();
+		}
+		if (Cur->Data.size() - Cur->Len < len)
+			Cur->Data.resize(Cur->Len + len);
+		return &Cur->Data[Cur->Len];
+	}
+
+	// Give the current swap buffer to the I/O thread
+	void Handoff()
+	{
+		// The ring space is free either way, so release it before we possibly wait for the next buffer
+		ReleaseRings();
+		if (!Cur || Cur->Len == 0)
+			return;
+		Cur->Seq = ConsumedSeq;
+		{
+			std::lock_guard<std::mutex> lock(SwapLock);
+			FullBuffers.push_back(Cur);
+		}
+		FullCV.notify_one();
+		Cur = nullptr;
+	}
+
+	// Copy text into the current swap buffer
+	void Append(const char* text, size_t len)
+	{
+		if (len == 0)
+			return;
+		memcpy(Space(len), text, len);
+		Cur->Len += len;
+	}
+
+	// The I/O thread. Write out full swap buffers, until the drain thread is finished, and everything has been written.
+	void IOLoop()
+	{
+		std::vector<SwapBuffer*> batch;
+		std::vector<iovec>       iov;
+		uint32_t                 inFlight = 0;     // io_uring writes
+		bool                     urgent   = false; // We have written a Warn or higher message since the last Synchronize
+		while (true)
+		{
+			bool finished = false;
 			{
-				nmessages++;
-				if (avail < head.PayloadLen)
-					Panic("ring.Read: message payload not available in ring buffer");
+				std::unique_lock<std::mutex> lock(SwapLock);
+				auto                         hasWork  = [this]() { return FullBuffers.size() != 0 || IsDrainFinished; };
+				int64_t                      deadline = Log.SyncDeadlineMS();
+				if (inFlight == 0 && deadline == -1)
+					FullCV.wait(lock, hasWork);
+				else if (inFlight == 0)
+					FullCV.wait_for(lock, std::chrono::milliseconds(deadline), hasWork);
+				batch.assign(FullBuffers.begin(), FullBuffers.end());
+				FullBuffers.clear();
+				finished  = IsDrainFinished;
+				IOControl = SwapControl;
+			}
 
-				if (head.PayloadLen > WriteBufSize - bufpos)
+			if (batch.size() == 0)
+			{
+				if (inFlight != 0)
 				{
-					if (!Log.Write(WriteBuf, bufpos))
-						OutOfBandWarning("Failed to write to log file '%s'\n", Filename.c_str());
-					bufpos = 0;
+					CompleteWrite(true);
+					inFlight--;
+					continue;
 				}
+				Synchronize(urgent);
+				urgent = false;
+				if (finished)
+					return;
+				continue;
+			}
 
-				if (head.PayloadLen <= WriteBufSize - bufpos)
+			// Buffers only exist once the drain thread has opened the control block
+			Log.SetStats(&IOControl->Stats);
+			for (auto b : batch)
+				urgent |= b->IsUrgent;
+
+			if (WriteQueueDepth > 1)
+			{
+				for (auto b : batch)
 				{
-					// store message in buffer
-					size_t nread = Ring.Read(WriteBuf + bufpos, head.PayloadLen);
-					if (nread != head.PayloadLen)
-						Panic("ring.Read: unable to read all of payload\n");
-					bufpos += head.PayloadLen;
+					if (inFlight == WriteQueueDepth)
+					{
+						CompleteWrite(true);
+						inFlight--;
+					}
+					b->Iov = {&b->Data[0], b->Len};
+					if (Log.SubmitV(&b->Iov, 1, b->Index))
+					{
+						InFlight.push_back(b);
+						inFlight++;
+						continue;
+					}
+					// This buffer will cause a rollover, so everything before it must reach the file first
+					for (; inFlight != 0; inFlight--)
+						CompleteWrite(true);
+					if (!Log.Write(&b->Data[0], b->Len))
+						OutOfBandWarning("Failed to write to log file '%s'\n", Filename.c_str());
+					PublishSeq(IOControl->WrittenSeq, b->Seq);
+					FreeBuffer(b);
 				}
-				else
+				// Syncing only covers writes that have completed
+				if (Log.IsSyncDue(urgent))
 				{
-					// log message is too large to buffer. write it directly
-					if (bufpos != 0)
-						Panic("ring.Read: should have flushed log"); // the Log.Write call 10 lines above should have done this already
-					void*  ptr1  = nullptr;
-					void*  ptr2  = nullptr;
-					size_t size1 = 0;
-					size_t size2 = 0;
-					Ring.ReadNoCopy(head.PayloadLen, ptr1, size1, ptr2, size2);
-					bool ok = Log.Write(ptr1, size1);
-					if (ok && size2 != 0)
-						ok = Log.Write(ptr2, size2);
-					if (!ok)
-						OutOfBandWarning("Failed to write to log file '%s'\n", Filename.c_str());
-					Ring.Read(nullptr, head.PayloadLen);
+					for (; inFlight != 0; inFlight--)
+						CompleteWrite(true);
+					Synchronize(urgent);
+					urgent = false;
 				}
-				break;
+				continue;
 			}
+
+			// Write everything that is waiting, with one writev
+			iov.clear();
+			for (auto b : batch)
+				iov.push_back({&b->Data[0], b->Len});
+			if (!Log.WriteV(&iov[0], iov.size()))
+				OutOfBandWarning("Failed to write to log file '%s'\n", Filename.c_str());
+			PublishSeq(IOControl->WrittenSeq, batch.back()->Seq);
+			for (auto b : batch)
+				FreeBuffer(b);
+			Synchronize(urgent);
+			urgent = false;
+		}
+	}
+
+	// io_uring writes may complete out of order, but we only publish their sequence numbers in order
+	void CompleteWrite(bool wait)
+	{
+		uint64_t tag;
+		if (!Log.Complete(wait, tag))
+			return;
+		SwapBuffers[tag].IsDone = true;
+		while (InFlight.size() != 0 && InFlight.front()->IsDone)
+		{
+			PublishSeq(IOControl->WrittenSeq, InFlight.front()->Seq);
+			FreeBuffer(InFlight.front());
+			InFlight.pop_front();
+		}
+	}
+
+	void Synchronize(bool urgent)
+	{
+		Log.Synchronize(urgent);
+		// Nothing can have been written until the drain thread has opened the parent's shared memory
+		if (IOControl != nullptr && Log.IsSynced())
+			PublishSeq(IOControl->SyncedSeq, IOControl->WrittenSeq.load(std::memory_order_relaxed));
+	}
+
+	// Tell producers how far we've got. See Logger::WaitFor for the other side of this. I/O thread only.
+	void PublishSeq(std::atomic<uint64_t>& mark, uint64_t seq)
+	{
+		if (IOControl == nullptr || seq <= mark.load(std::memory_order_relaxed))
+			return;
+		mark.store(seq, std::memory_order_release);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (IOControl->SeqWaiters.load(std::memory_order_relaxed) != 0)
+		{
+			IOControl->SeqWord.fetch_add(1);
+			FutexWake(&IOControl->SeqWord, INT32_MAX);
+		}
+	}
+
+	// Drain thread only
+	void ConsumeSeq(uint64_t seq)
+	{
+		if (seq <= ConsumedSeq)
+			return;
+		if (seq != ConsumedSeq + 1)
+		{
+			EarlySeqs.push(seq);
+			return;
+		}
+		ConsumedSeq = seq;
+		while (EarlySeqs.size() != 0 && EarlySeqs.top() == ConsumedSeq + 1)
+		{
+			ConsumedSeq++;
+			EarlySeqs.pop();
+		}
+	}
+
+	void FreeBuffer(SwapBuffer* b)
+	{
+		if (b->Data.size() > WriteBufSize)
+		{
+			b->Data.resize(WriteBufSize);
+			b->Data.shrink_to_fit();
+		}
+		b->Len      = 0;
+		b->IsUrgent = false;
+		b->IsDone   = false;
+		{
+			std::lock_guard<std::mutex> lock(SwapLock);
+			FreeBuffers.push_back(b);
+		}
+		FreeCV.notify_one();
+	}
+
+	// If producers have dropped messages since we last looked, then say so in the log
+	void ReportDropped()
+	{
+		uint64_t dropped = Control->Dropped.load(std::memory_order_relaxed);
+		if (dropped == ReportedDropped)
+			return;
+
+		// Follow the producers' choice of whether to include the date. No producer wrote this line, so it carries our own thread ID.
+		bool   includeDate = Control->IncludeDate.load(std::memory_order_relaxed) != 0;
+		char   line[MaxLinePrefixLen + 100];
+		size_t len = FormatLinePrefix(line, TK, includeDate ? TK.Now() : 0, LevelChar(Level::Warn), GetMyTIDHex(), includeDate);
+		auto   msg = uberlog_tsf::fmt_buf(line + len, sizeof(line) - len, "uberlog: %v messages dropped%v", dropped - ReportedDropped, UseCRLF ? "\r\n" : "\n");
+		Append(line, len + msg.Len);
+		Cur->IsUrgent   = true;
+		ReportedDropped = dropped;
+	}
+
+	// Render a RawPrefix into buf, which must have space for MaxLinePrefixLen bytes. Returns the length of the prefix.
+	size_t RenderPrefix(const char* raw, uint8_t level, char* buf)
+	{
+		RawPrefix rp;
+		memcpy(&rp, raw, sizeof(rp));
+		char tidHex[8];
+		TimeKeeper::FormatUintHex(8, tidHex, rp.TID);
+		return FormatLinePrefix(buf, TK, rp.Time, LevelChar((Level) level), tidHex, rp.IncludeDate != 0);
+	}
+
+	// Append a Command::LogLine message to the current swap buffer, after rendering its prefix. See Logger::SetDeferredPrefix.
+	void AppendLine(uint8_t level, const char* payload, size_t len)
+	{
+		if (len < sizeof(RawPrefix))
+			Panic("Invalid log line");
+		len -= sizeof(RawPrefix);
+		char*  out       = Space(MaxLinePrefixLen + len);
+		size_t prefixLen = RenderPrefix(payload, level, out);
+		memcpy(out + prefixLen, payload + sizeof(RawPrefix), len);
+		Cur->Len += prefixLen + len;
+	}
+
+	// Format a Command::LogFmt message into the current swap buffer. See Logger::LogDeferred for the other side of this.
+	void FormatDeferred(uint8_t level, const char* payload, size_t len)
+	{
+		DeferredMsgHead head;
+		memcpy(&head, payload, sizeof(head));
+		const char* prefix    = payload + sizeof(head);
+		size_t      prefixLen = head.PrefixLen;
+		size_t      pos       = (sizeof(head) + head.PrefixLen + 7) & ~(size_t) 7;
+		if (head.FormatID >= SharedControl::FormatTableSize || pos > len || (head.IsRawPrefix && head.PrefixLen != sizeof(RawPrefix)))
+			Panic("Invalid deferred log message");
+
+		char rendered[MaxLinePrefixLen];
+		if (head.IsRawPrefix)
+		{
+			prefixLen = RenderPrefix(prefix, level, rendered);
+			prefix    = rendered;
+		}
+
+		DeferredArgs.resize(head.NumArgs + 1); // +1 for zero args case
+		for (uint16_t i = 0; i < head.NumArgs; i++)
+		{
+			DeferredArg da;
+			if (pos + sizeof(da) > len)
+				Panic("Invalid deferred log message");
+			memcpy(&da, payload + pos, sizeof(da));
+			pos += sizeof(da);
+
+			auto& arg = DeferredArgs[i];
+			arg.Type  = (uberlog_tsf::fmtarg::Types) da.Type;
+			switch (arg.Type)
+			{
+			case uberlog_tsf::fmtarg::TCStr:
+			case uberlog_tsf::fmtarg::TWStr:
+				if (pos + da.Len > len)
+					Panic("Invalid deferred log message");
+				arg.Ptr = payload + pos;
+				pos += (da.Len + 7) & ~(size_t) 7;
+				break;
+			case uberlog_tsf::fmtarg::TI32:
+			case uberlog_tsf::fmtarg::TU32:
+				arg.UI32 = (uint32_t) da.Value;
+				break;
 			default:
-				Panic("Unexpected command");
+				memcpy(&arg.UI64, &da.Value, sizeof(da.Value));
+				break;
 			}
 		}
 
-		// flush write buffer
-		if (bufpos != 0)
+		const char*  format = Control->FormatTable + head.FormatID;
+		const char*  eol    = UseCRLF ? "\r\n" : "\n";
+		const size_t eolLen = strlen(eol);
+
+		// Format directly into the swap buffer, after making sure that it has space for a typical message.
+		// The formatter's null terminator is overwritten by the EOL.
+		char*                   out   = Space(prefixLen + 256 + eolLen);
+		size_t                  space = Cur->Data.size() - Cur->Len - prefixLen - eolLen + 1;
+		uberlog_tsf::context    cx;
+		uberlog_tsf::StrLenPair msg = uberlog_tsf::fmt_core(cx, format, head.NumArgs, &DeferredArgs[0], out + prefixLen, space);
+		if (msg.Str == out + prefixLen)
 		{
-			if (!Log.Write(WriteBuf, bufpos))
-				OutOfBandWarning("Failed to write to log file '%s'\n", Filename.c_str());
+			size_t lineLen = prefixLen + msg.Len + eolLen;
+			memcpy(out, prefix, prefixLen);
+			memcpy(out + prefixLen + msg.Len, eol, eolLen);
+			Cur->Len += lineLen;
+			return;
+		}
+
+		// The message is too large for the space that we have left
+		std::string line(prefix, prefixLen);
+		line.append(msg.Str, msg.Len);
+		line.append(eol);
+		delete[] msg.Str;
+		Append(line.c_str(), line.size());
+	}
+
+	// Returns number of log messages consumed
+	uint64_t ReadMessages()
+	{
+		// Copy messages into swap buffers, so that the I/O thread doesn't issue an OS write for every message
+		uint64_t nmessages = 0;
+		UpdateMaxBacklog();
+
+		while (true)
+		{
+			ReportDropped();
+			RingBuffer* ring = NextRing();
+			if (ring == nullptr)
+				break;
+
+			size_t readp = ring->ReadCursor();
+			auto   head  = (const MessageHead*) ring->PtrAt(readp);
+			if (head->Cmd == Command::Pad)
+			{
+				// Space that a producer reserved, but did not use, or the skip at the end of the ring
+				ring->Hold(head->PayloadLen);
+				continue;
+			}
+
+			// Records never straddle the end of the ring, so we can use them in place
+			size_t      total   = MessageSize(head->PayloadLen, (head->Flags & MessageFlagStamp) != 0);
+			const char* payload = (const char*) head + head->HeadLen();
+			if (total > ring->TailAt(readp) || !ring->CanRead(total))
+				Panic("ring.Read: message payload not available in ring buffer");
+
+			switch (head->Cmd)
+			{
+			case Command::Close:
+				SetReceivedCloseMessage();
+				break;
+			case Command::LogMsg:
+				nmessages++;
+				Append(payload, head->PayloadLen);
+				break;
+			case Command::LogFmt:
+				nmessages++;
+				if (head->PayloadLen < sizeof(DeferredMsgHead))
+					Panic("Invalid deferred log message");
+				FormatDeferred(head->Level, payload, head->PayloadLen);
+				break;
+			case Command::LogLine:
+				nmessages++;
+				AppendLine(head->Level, payload, head->PayloadLen);
+				break;
+			default:
+				Panic("Unexpected command");
+			}
+			if (head->Level >= (uint8_t) Level::Warn && Cur)
+				Cur->IsUrgent = true;
+			if (head->Flags & MessageFlagSeq)
+				ConsumeSeq(*(const uint64_t*) (payload - sizeof(uint64_t)));
+			ring->Hold(total);
+
+			// Don't sit on more than half of a ring, otherwise producers will stall
+			if (ring->Held >= ring->Size / 2)
+				Release(*ring);
 		}
 
+		Handoff();
+
 		return nmessages;
 	}
 
+	// We're the only writer of MaxBacklog
+	void UpdateMaxBacklog()
+	{
+		uint64_t backlog = Ring.AvailableForRead();
+		for (auto tr : ThreadRings)
+			backlog = std::max(backlog, (uint64_t) tr->Ring.AvailableForRead());
+		if (backlog > Control->Stats.MaxBacklog.load(std::memory_order_relaxed))
+			Control->Stats.MaxBacklog.store(backlog, std::memory_order_relaxed);
+	}
+
 	void SetReceivedCloseMessage()
 	{
 #ifdef _WIN32
@@ -531,7 +1932,7 @@ void ShowHelp()
 {
 	auto help = R"(uberlogger is a child process that is spawned by an application that performs logging.
 Normally, you do not launch uberlogger manually. It is launched automatically by the uberlog library.
-uberlogger <parentpid> <ringsize> <logfilename> <maxlogsize> <maxarchives>)";
+uberlogger <parentpid> <ringsize> <logfilename> <maxlogsize> <maxarchives> [writebufsize] [writequeuedepth] [maxarchivebytes] [maxarchiveage] [preallocate] [syncpolicy] [syncms] [syncbytes] [droppagecache] [timeformat])";
 	printf("%s\n", help);
 }
 } // namespace internal
@@ -541,7 +1942,7 @@ int main(int argc, char** argv)
 {
 	bool showHelp = true;
 
-	if (argc == 6)
+	if (argc >= 6 && argc <= 16)
 	{
 		showHelp = false;
 		uberlog::internal::LoggerSlave slave;
@@ -550,6 +1951,28 @@ int main(int argc, char** argv)
 		slave.Filename       = argv[3];
 		slave.MaxLogSize     = (int64_t) strtoull(argv[4], nullptr, 10);
 		slave.MaxNumArchives = (int32_t) strtol(argv[5], nullptr, 10);
+		if (argc >= 7)
+			slave.WriteBufSize = std::max((size_t) strtoull(argv[6], nullptr, 10), (size_t) 1024); // FormatDeferred needs some room
+		if (argc >= 8)
+			slave.WriteQueueDepth = std::min(std::max((uint32_t) strtoul(argv[7], nullptr, 10), 1u), 64u);
+		if (argc >= 9)
+			slave.MaxArchiveBytes = (int64_t) strtoull(argv[8], nullptr, 10);
+		if (argc >= 10)
+			slave.MaxArchiveAgeS = (int64_t) strtoull(argv[9], nullptr, 10);
+		if (argc >= 11)
+			slave.Preallocate = strtoul(argv[10], nullptr, 10) != 0;
+		if (argc >= 12)
+			slave.Sync = (uberlog::SyncPolicy) std::min(strtoul(argv[11], nullptr, 10), (unsigned long) uberlog::SyncPolicy::OnWarn);
+		if (argc >= 13)
+			slave.SyncIntervalMS = (uint32_t) strtoul(argv[12], nullptr, 10);
+		if (argc >= 14)
+			slave.SyncIntervalBytes = (uint64_t) strtoull(argv[13], nullptr, 10);
+		if (argc >= 15)
+			slave.DropPageCache = strtoul(argv[14], nullptr, 10) != 0;
+		if (argc >= 16)
+			slave.TimeFmt = (uberlog::TimeFormat) std::min(strtoul(argv[15], nullptr, 10), (unsigned long) uberlog::TimeFormat::EpochNano);
+		if (const char* failSubmit = getenv("UBERLOG_TEST_FAIL_SUBMIT"))
+			slave.TestFailSubmit = (uint32_t) strtoul(failSubmit, nullptr, 10);
 		slave.Run();
 	}
 	if (showHelp)